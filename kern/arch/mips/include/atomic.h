@@ -0,0 +1,67 @@
+#ifndef _MIPS_ATOMIC_H_
+#define _MIPS_ATOMIC_H_
+
+/*
+ * Atomic operations, using LL/SC. See machine/spinlock.h for how those
+ * work; the important restriction is that there can be no other memory
+ * accesses between the LL and the SC. The SYNCs on either side make
+ * each operation a full memory barrier.
+ *
+ * See include/atomic.h for the interface.
+ */
+
+ATOMIC_INLINE
+unsigned
+atomic_cas(volatile unsigned *p, unsigned oldval, unsigned newval)
+{
+	unsigned x, y;
+
+	do {
+		/*
+		 * Load into X; if it isn't OLDVAL, bail out without
+		 * storing. Otherwise store Y; afterwards Y is 1 if the
+		 * store succeeded and 0 if it has to be tried again.
+		 */
+		y = newval;
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"sync;"			/* barrier before */
+			"ll %0, 0(%2);"		/*   x = *p */
+			"bne %0, %3, 1f;"	/*   if (x != oldval) done */
+			"sc %1, 0(%2);"		/*   *p = y; y = success? */
+			"1: sync;"		/* barrier after */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "+r" (y)
+			: "r" (p), "r" (oldval)
+			: "memory");
+	} while (x == oldval && y == 0);
+
+	return x;
+}
+
+ATOMIC_INLINE
+unsigned
+atomic_add(volatile unsigned *p, int delta)
+{
+	unsigned x, y;
+
+	do {
+		x = *p;
+		y = atomic_cas(p, x, x + delta);
+	} while (y != x);
+
+	return x + delta;
+}
+
+/* Pointers are 32 bits, so this is the same as atomic_cas. */
+ATOMIC_INLINE
+void *
+atomic_casptr(void *volatile *p, void *oldval, void *newval)
+{
+	return (void *)atomic_cas((volatile unsigned *)p,
+				  (unsigned)oldval, (unsigned)newval);
+}
+
+#endif /* _MIPS_ATOMIC_H_ */
@@ -47,6 +47,10 @@ spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 SPINLOCK_INLINE
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
 
+/* Cycle counter, for timing how long we spin */
+SPINLOCK_INLINE
+uint32_t spinlock_cycles(void);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -118,5 +122,25 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 	return x;
 }
 
+/*
+ * Read the cycle counter. $9 is c0_count, which counts up once per
+ * processor cycle; we can't use the symbolic name inside the asm
+ * string. It's reset when the on-chip timer is set, but that doesn't
+ * happen while we're spinning with interrupts off.
+ */
+SPINLOCK_INLINE
+uint32_t
+spinlock_cycles(void)
+{
+	uint32_t count;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
 
 #endif /* _MIPS_SPINLOCK_H_ */
@@ -38,6 +38,7 @@
 #include <current.h>
 #include <vm.h>
 #include <mainbus.h>
+#include <softint.h>
 #include <syscall.h>
 #include <proc.h>
 #include <kern/wait.h>
@@ -154,7 +155,7 @@ mips_trap(struct trapframe *tf)
 	/* Interrupt? Call the interrupt handler and return. */
 	if (code == EX_IRQ) {
 		int old_in;
-		bool doadjust;
+		bool doadjust, yield;
 
 		old_in = curthread->t_in_interrupt;
 		curthread->t_in_interrupt = 1;
@@ -196,7 +197,43 @@ mips_trap(struct trapframe *tf)
 			curthread->t_curspl = 0;
 		}
 
+		/*
+		 * If we're going back to a thread that had interrupts
+		 * on (and not to another interrupt handler, including
+		 * one running softints), run any softints the handler
+		 * queued, with interrupts back on. Then, if hardclock
+		 * asked for it, yield; doing that only now means the
+		 * softints don't wait out the next thread's quantum.
+		 * Otherwise yield with interrupts off, as hardclock
+		 * would have.
+		 */
+		yield = curcpu->c_yieldpending;
+		curcpu->c_yieldpending = false;
+		if (doadjust && !old_in &&
+		    (curcpu->c_softints != NULL || yield)) {
+			cpu_irqon();
+			softint_run();
+			if (yield) {
+				thread_yield();
+			}
+			cpu_irqoff();
+		}
+		else if (yield) {
+			thread_yield();
+		}
+
 		curthread->t_in_interrupt = old_in;
+
+		/*
+		 * Going back to user mode in a process that another
+		 * thread is taking down? Leave instead. This is what
+		 * stops threads that never make syscalls.
+		 */
+		if (!iskern && curproc->p_exiting) {
+			cpu_irqon();
+			proc_checkexit();
+			cpu_irqoff();
+		}
 		goto done2;
 	}
 
@@ -224,7 +261,7 @@ mips_trap(struct trapframe *tf)
 		      tf->tf_v0, tf->tf_a0, tf->tf_a1, tf->tf_a2, tf->tf_a3);
 
 		syscall(tf);
-		goto done;
+		goto userret;
 	}
 
 	/*
@@ -235,17 +272,17 @@ mips_trap(struct trapframe *tf)
 	switch (code) {
 	case EX_MOD:
 		if (vm_fault(VM_FAULT_READONLY, tf->tf_vaddr)==0) {
-			goto done;
+			goto userret;
 		}
 		break;
 	case EX_TLBL:
 		if (vm_fault(VM_FAULT_READ, tf->tf_vaddr)==0) {
-			goto done;
+			goto userret;
 		}
 		break;
 	case EX_TLBS:
 		if (vm_fault(VM_FAULT_WRITE, tf->tf_vaddr)==0) {
-			goto done;
+			goto userret;
 		}
 		break;
 	case EX_IBE:
@@ -316,6 +353,11 @@ mips_trap(struct trapframe *tf)
 
 	panic("I can't handle this... I think I'll just die now...\n");
 
+ userret:
+	/* If another thread of the process called _exit, don't go back. */
+	if (!iskern) {
+		proc_checkexit();
+	}
  done:
 	/*
 	 * Turn interrupts off on the processor, without affecting the
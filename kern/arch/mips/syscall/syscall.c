@@ -112,6 +112,10 @@ syscall(struct trapframe *tf)
 			err = sys___time((userptr_t) tf->tf_a0, (userptr_t) tf->tf_a1);
 			break;
 		}
+		case SYS_nanosleep: {
+			err = sys_nanosleep((const_userptr_t) tf->tf_a0, (userptr_t) tf->tf_a1);
+			break;
+		}
 		case SYS_open: {
 			err = sys_open((userptr_t) tf->tf_a0, (int) tf->tf_a1, &retval_v0);
 			break;
@@ -128,6 +132,44 @@ syscall(struct trapframe *tf)
 			err = sys_write((int) tf->tf_a0, (const_userptr_t) tf->tf_a1, (size_t) tf->tf_a2, &retval_v0);
 			break;
 		}
+		case SYS_readv: {
+			err = sys_readv((int) tf->tf_a0, (const_userptr_t) tf->tf_a1, (int) tf->tf_a2, &retval_v0);
+			break;
+		}
+		case SYS_writev: {
+			err = sys_writev((int) tf->tf_a0, (const_userptr_t) tf->tf_a1, (int) tf->tf_a2, &retval_v0);
+			break;
+		}
+		case SYS_pread:
+		case SYS_pwrite:
+		case SYS_preadv:
+		case SYS_pwritev: {
+			/* The 64-bit offset is the 4th arg, so it's on the stack. */
+			off_t offset;
+			err = copyin((const_userptr_t) tf->tf_sp + 16, &offset, sizeof(offset));
+			if (err) {
+				break;
+			}
+			switch (callno) {
+			    case SYS_pread:
+				err = sys_pread((int) tf->tf_a0, (const_userptr_t) tf->tf_a1, (size_t) tf->tf_a2, offset, &retval_v0);
+				break;
+			    case SYS_pwrite:
+				err = sys_pwrite((int) tf->tf_a0, (const_userptr_t) tf->tf_a1, (size_t) tf->tf_a2, offset, &retval_v0);
+				break;
+			    case SYS_preadv:
+				err = sys_preadv((int) tf->tf_a0, (const_userptr_t) tf->tf_a1, (int) tf->tf_a2, offset, &retval_v0);
+				break;
+			    default:
+				err = sys_pwritev((int) tf->tf_a0, (const_userptr_t) tf->tf_a1, (int) tf->tf_a2, offset, &retval_v0);
+				break;
+			}
+			break;
+		}
+		case SYS_pipe: {
+			err = sys_pipe((userptr_t) tf->tf_a0, &retval_v0);
+			break;
+		}
 		case SYS_dup2: {
 			err = sys_dup2((int) tf->tf_a0, (int) tf->tf_a1, &retval_v0);
 			break;
@@ -174,6 +216,22 @@ syscall(struct trapframe *tf)
 			err = sys_sbrk((intptr_t) tf->tf_a0, &retval_v0);
 			break;
 		}
+		case SYS_futex: {
+			err = sys_futex((userptr_t) tf->tf_a0, (int) tf->tf_a1, (int) tf->tf_a2, &retval_v0);
+			break;
+		}
+		case SYS___thread_create: {
+			err = sys___thread_create(tf, &retval_v0);
+			break;
+		}
+		case SYS_thread_exit: {
+			sys_thread_exit((int) tf->tf_a0);
+			break;
+		}
+		case SYS_thread_join: {
+			err = sys_thread_join((int) tf->tf_a0, (userptr_t) tf->tf_a1, &retval_v0);
+			break;
+		}
 		default:
 			kprintf("Unknown syscall %d\n", callno);
 			err = ENOSYS;
@@ -225,3 +283,19 @@ enter_forked_process(struct trapframe *tf)
 	mips_usermode(tf);
 }
 
+/*
+ * Enter user mode in a new thread made by __thread_create. TF is a
+ * copy of the creating thread's trapframe, so the global pointer and
+ * such carry over; the syscall's arguments say where to start, what
+ * to pass, and which stack to use. There's nothing to return to.
+ */
+void
+enter_new_thread(struct trapframe *tf)
+{
+	tf->tf_epc = tf->tf_a0;
+	tf->tf_sp = tf->tf_a2;
+	tf->tf_a0 = tf->tf_a1;
+	tf->tf_ra = 0;
+
+	mips_usermode(tf);
+}
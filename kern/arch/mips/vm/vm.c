@@ -8,21 +8,24 @@
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
+#include <synch.h>
 #include <vm.h>
 #include <elf.h>
 
 static uint32_t tlb_index = 0;
 static struct spinlock tlb_lock = SPINLOCK_INITIALIZER;
 
+static int vm_fault_as(struct addrspace *as, int faulttype,
+		       vaddr_t faultaddress);
+
 void vm_bootstrap(void)
 {
 }
 
 int vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	uint32_t ehi, elo;
 	struct addrspace *as;
-	int spl;
+	int result;
 
 	faultaddress &= PAGE_FRAME;
 
@@ -44,6 +47,23 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
+	lock_acquire(as->as_lock);
+	result = vm_fault_as(as, faulttype, faultaddress);
+	lock_release(as->as_lock);
+	return result;
+}
+
+/*
+ * The rest of vm_fault, with the address space locked so that other
+ * threads sharing it can't change the page table underneath us.
+ */
+static
+int
+vm_fault_as(struct addrspace *as, int faulttype, vaddr_t faultaddress)
+{
+	uint32_t ehi, elo;
+	int spl;
+
 	/* Assert that the address space has been set up properly. */
 	KASSERT(as->segments != NULL);
 	KASSERT(as->segments->vstart != 0);
@@ -173,9 +193,16 @@ void vm_tlbshootdown_all(void)
 
 void vm_tlbshootdown(const struct tlbshootdown *tlbs)
 {
-	(void) tlbs;
-//	int spl = splhigh();
-//
-//
-//	splx(spl);
+	spinlock_acquire(&tlb_lock);
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	int spl = splhigh();
+
+	int i = tlb_probe(tlbs->ts_vaddr & PAGE_FRAME, 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+
+	splx(spl);
+	spinlock_release(&tlb_lock);
 }
\ No newline at end of file
@@ -57,8 +57,28 @@
  *
  * The c0_count register increments on every cycle; when the value
  * matches the c0_compare register, the timer interrupt line is
- * asserted. Writing to c0_compare again clears the interrupt.
+ * asserted. Writing to c0_compare again clears the interrupt, and
+ * starts c0_count over from zero.
  */
+static
+uint32_t
+mips_timer_count(void)
+{
+	uint32_t count;
+
+	/*
+	 * $9 == c0_count; we can't use the symbolic name inside the
+	 * asm string.
+	 */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
 static
 void
 mips_timer_set(uint32_t count)
@@ -75,6 +95,55 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Set the on-chip timer to go off after NTICKS hardclocks. The timer
+ * can't actually be switched off, so for 0 (and anything too long to
+ * fit) push it out as far as it'll go, which at 25 MHz is nearly
+ * three minutes; if it goes off then, hardclock will just stop it
+ * again.
+ *
+ * Setting the timer restarts c0_count, so first bank the cycles it
+ * had counted in c_timercycles for mainbus_timerelapsed.
+ */
+void
+mainbus_settimer(unsigned nticks)
+{
+	uint32_t period;
+
+	curcpu->c_timercycles += mips_timer_count();
+
+	period = CPU_FREQUENCY / hz;
+	if (nticks == 0 || nticks > 0xffffffff / period) {
+		mips_timer_set(0xffffffff);
+	}
+	else {
+		mips_timer_set(nticks * period);
+	}
+}
+
+/*
+ * Return how many hardclock periods (at the current hz) this cpu's
+ * cycle counter has gone through since the last call, keeping the
+ * leftover part of a period for next time.
+ */
+unsigned
+mainbus_timerelapsed(void)
+{
+	uint64_t cycles;
+	uint32_t count, period;
+
+	period = CPU_FREQUENCY / hz;
+	count = mips_timer_count();
+	cycles = curcpu->c_timercycles + count;
+
+	/*
+	 * The current count gets banked again the next time the timer
+	 * is set, so take it back out of what's left over.
+	 */
+	curcpu->c_timercycles = cycles % period - count;
+	return cycles / period;
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -113,9 +182,11 @@ mainbus_bootstrap(void)
 	autoconf_lamebus(lamebus, 0);
 
 	/*
-	 * Configure the MIPS on-chip timer to interrupt HZ times a second.
+	 * Configure the MIPS on-chip timer to interrupt hz times a second.
+	 * (Once the thread system is going it takes over from here; see
+	 * hardclock_reload.)
 	 */
-	mips_timer_set(CPU_FREQUENCY / HZ);
+	mainbus_settimer(1);
 }
 
 /*
@@ -304,9 +375,7 @@ mainbus_interrupt(struct trapframe *tf)
 		seen = true;
 	}
 	if (cause & MIPS_TIMER_BIT) {
-		/* Reset the timer (this clears the interrupt) */
-		mips_timer_set(CPU_FREQUENCY / HZ);
-		/* and call hardclock */
+		/* hardclock resets the timer, which clears the interrupt */
 		hardclock();
 		seen = true;
 	}
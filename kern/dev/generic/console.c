@@ -55,6 +55,8 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <atomic.h>
+#include <softint.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
@@ -135,18 +137,22 @@ putch_intr(struct con_softc *cs, int ch)
 
 /*
  * Read a character, using interrupts to wait for I/O completion.
+ * Fails with EINTR if the process exits while we're waiting.
  */
 static
 int
-getch_intr(struct con_softc *cs)
+getch_intr(struct con_softc *cs, int *ret)
 {
-	unsigned char ret;
+	int result;
 
-	P(cs->cs_rsem);
-	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
+	result = P_intr(cs->cs_rsem);
+	if (result) {
+		return result;
+	}
+	*ret = (unsigned char)cs->cs_gotchars[cs->cs_gotchars_tail];
 	cs->cs_gotchars_tail =
 		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
-	return ret;
+	return 0;
 }
 
 /*
@@ -173,17 +179,52 @@ con_input(void *vcs, int ch)
 	cs->cs_gotchars[cs->cs_gotchars_head] = ch;
 	cs->cs_gotchars_head = nexthead;
 
-	V(cs->cs_rsem);
+	atomic_add(&cs->cs_rpending, 1);
+	softint_schedule(&cs->cs_rsi);
+}
+
+/*
+ * Softint for con_input: wake up readers, once per character that
+ * arrived since the last time.
+ */
+static
+void
+con_rwakeup(void *vcs)
+{
+	struct con_softc *cs = vcs;
+	unsigned n;
+
+	do {
+		n = cs->cs_rpending;
+	} while (atomic_cas(&cs->cs_rpending, n, 0) != n);
+
+	while (n-- > 0) {
+		V(cs->cs_rsem);
+	}
 }
 
 /*
  * Called from underlying device when a write-done interrupt occurs.
+ * Only one character is ever in flight, so one pending softint is
+ * enough.
  */
 void
 con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
 
+	softint_schedule(&cs->cs_wsi);
+}
+
+/*
+ * Softint for con_start: let the next writer go.
+ */
+static
+void
+con_wwakeup(void *vcs)
+{
+	struct con_softc *cs = vcs;
+
 	V(cs->cs_wsem);
 }
 
@@ -220,9 +261,16 @@ getch(void)
 {
 	struct con_softc *cs = the_console;
 	KASSERT(cs != NULL);
+	int ch, result;
+
 	KASSERT(!curthread->t_in_interrupt && curthread->t_iplhigh_count == 0);
 
-	return getch_intr(cs);
+	result = getch_intr(cs, &ch);
+	if (result) {
+		/* Only a process that's exiting gets here; it won't look. */
+		return -1;
+	}
+	return ch;
 }
 
 ////////////////////////////////////////////////////////////
@@ -245,6 +293,7 @@ int
 con_io(struct device *dev, struct uio *uio)
 {
 	int result;
+	int c;
 	char ch;
 	struct lock *lk;
 
@@ -262,7 +311,12 @@ con_io(struct device *dev, struct uio *uio)
 
 	while (uio->uio_resid > 0) {
 		if (uio->uio_rw==UIO_READ) {
-			ch = getch();
+			result = getch_intr(the_console, &c);
+			if (result) {
+				lock_release(lk);
+				return result;
+			}
+			ch = c;
 			if (ch=='\r') {
 				ch = '\n';
 			}
@@ -386,6 +440,9 @@ config_con(struct con_softc *cs, int unit)
 	cs->cs_wsem = wsem;
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
+	cs->cs_rpending = 0;
+	softint_init(&cs->cs_rsi, con_rwakeup, cs);
+	softint_init(&cs->cs_wsi, con_wwakeup, cs);
 
 	the_console = cs;
 	con_userlock_read = rlk;
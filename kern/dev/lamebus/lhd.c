@@ -36,7 +36,8 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -96,15 +97,17 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Record that an I/O has completed: save the result and arrange for
+ * lhd_iocomplete to run once we're out of the interrupt handler.
+ * (There's only ever one sector in flight, so the softint can't
+ * already be pending for a previous one.)
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
 	lh->lh_result = err;
-	V(lh->lh_done);
+	softint_schedule(&lh->lh_donesi);
 }
 
 /*
@@ -179,22 +182,176 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+////////////////////////////////////////////////////////////
+// Request queue
+
 /*
- * I/O function (for both reads and writes)
+ * Requests wait on lh_queue, in no particular order, and lhd_pick
+ * chooses the next one by C-SCAN: the request starting at or after
+ * the sector last transferred with the lowest sector number, or if
+ * there isn't one, the lowest overall. The head only sweeps upward,
+ * so every request gets its turn within one sweep. A request that
+ * starts where the current one ends is always picked next, so
+ * adjacent requests go to the disk as one continuous run.
+ *
+ * Only one sector is in flight at a time. lhd_start sends the next
+ * sector of the current request, or picks a new request; the
+ * completion softint, lhd_iocomplete, finishes the sector and calls
+ * lhd_start again. lh_qlock covers the queue and the
+ * lh_cur, lh_pos and lh_busy fields.
+ */
+
+/*
+ * Remove and return the next request to serve, or NULL.
  */
 static
-int
-lhd_io(struct device *d, struct uio *uio)
+struct lhd_req *
+lhd_pick(struct lhd_softc *lh)
 {
-	struct lhd_softc *lh = d->d_data;
+	struct lhd_req **rp, **best, **lowest;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_qlock));
+
+	best = lowest = NULL;
+	for (rp = &lh->lh_queue; *rp != NULL; rp = &(*rp)->r_next) {
+		if ((*rp)->r_sector >= lh->lh_pos &&
+		    (best == NULL || (*rp)->r_sector < (*best)->r_sector)) {
+			best = rp;
+		}
+		if (lowest == NULL || (*rp)->r_sector < (*lowest)->r_sector) {
+			lowest = rp;
+		}
+	}
+	if (best == NULL) {
+		/* End of the sweep; go back to the start. */
+		best = lowest;
+	}
+	if (best == NULL) {
+		return NULL;
+	}
+
+	{
+		struct lhd_req *req = *best;
+
+		*best = req->r_next;
+		req->r_next = NULL;
+		return req;
+	}
+}
+
+/*
+ * Start the next sector transfer, if the device is idle and there's
+ * anything to do.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh)
+{
+	struct lhd_req *req;
+	uint32_t statval = LHD_WORKING;
+	int result;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_qlock));
+
+	if (lh->lh_busy) {
+		return;
+	}
+	if (lh->lh_cur == NULL) {
+		lh->lh_cur = lhd_pick(lh);
+		if (lh->lh_cur == NULL) {
+			return;
+		}
+	}
+	req = lh->lh_cur;
+
+	/*
+	 * Are we writing? If so, transfer the data to the on-card
+	 * buffer. The uio is in kernel space, so this can't fail.
+	 */
+	if (req->r_uio->uio_rw == UIO_WRITE) {
+		statval |= LHD_ISWRITE;
+		result = uiomove(lh->lh_buf, LHD_SECTSIZE, req->r_uio);
+		KASSERT(result == 0);
+		membar_store_store();
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, req->r_sector);
+
+	/* and start the operation. */
+	lh->lh_busy = true;
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Softint run when a sector transfer finishes.
+ */
+static
+void
+lhd_iocomplete(void *vlh)
+{
+	struct lhd_softc *lh = vlh;
+	struct lhd_req *req, *done;
+	int result;
+
+	spinlock_acquire(&lh->lh_qlock);
+
+	KASSERT(lh->lh_busy);
+	lh->lh_busy = false;
+	req = lh->lh_cur;
+	KASSERT(req != NULL);
+
+	/* Get the result value saved by the interrupt handler. */
+	result = lh->lh_result;
+
+	/*
+	 * Are we reading? If so, and if we succeeded, transfer the
+	 * data out of the on-card buffer.
+	 */
+	if (result == 0 && req->r_uio->uio_rw == UIO_READ) {
+		membar_load_load();
+		result = uiomove(lh->lh_buf, LHD_SECTSIZE, req->r_uio);
+		KASSERT(result == 0);
+	}
+
+	lh->lh_pos = req->r_sector;
+	req->r_sector++;
+	req->r_left--;
+
+	/* If we failed or we're finished, this request is done. */
+	done = NULL;
+	if (result || req->r_left == 0) {
+		lh->lh_cur = NULL;
+		done = req;
+	}
+
+	lhd_start(lh);
+	spinlock_release(&lh->lh_qlock);
+
+	if (done != NULL) {
+		done->r_done(done, result);
+	}
+}
 
+/*
+ * Queue a request. The caller fills in r_uio, which must be in kernel
+ * space and cover whole sectors, and r_done and r_data. R_DONE is
+ * called with the result when the request finishes; it's called from
+ * a softint, so it mustn't sleep. It may submit more requests.
+ *
+ * Returns an error, without queueing anything, if the request is bad.
+ */
+int
+lhd_submit(struct lhd_softc *lh, struct lhd_req *req)
+{
+	struct uio *uio = req->r_uio;
 	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
-	int result;
+
+	KASSERT(uio->uio_segflg == UIO_SYSSPACE);
+	KASSERT(req->r_done != NULL);
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -202,66 +359,140 @@ lhd_io(struct device *d, struct uio *uio)
 	}
 
 	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	if (len > lh->lh_dev.d_blocks || sector > lh->lh_dev.d_blocks - len) {
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		req->r_done(req, 0);
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	req->r_sector = sector;
+	req->r_left = len;
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	spinlock_acquire(&lh->lh_qlock);
+	req->r_next = lh->lh_queue;
+	lh->lh_queue = req;
+	lhd_start(lh);
+	spinlock_release(&lh->lh_qlock);
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
-			if (result) {
-				V(lh->lh_clear);
-				return result;
-			}
-		}
+	return 0;
+}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
+////////////////////////////////////////////////////////////
+// Synchronous I/O
 
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
+/* Bounce buffer size for I/O to and from user space. */
+#define LHD_BOUNCE 4096
 
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
+struct lhd_syncreq {
+	struct lhd_softc *s_lh;
+	bool s_done;
+	int s_result;
+};
 
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
+static
+void
+lhd_syncdone(struct lhd_req *req, int result)
+{
+	struct lhd_syncreq *sr = req->r_data;
+	struct lhd_softc *lh = sr->s_lh;
+
+	spinlock_acquire(&lh->lh_qlock);
+	sr->s_result = result;
+	sr->s_done = true;
+	wchan_wakeall(lh->lh_wchan, &lh->lh_qlock);
+	spinlock_release(&lh->lh_qlock);
+}
 
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
+/*
+ * Submit a request for kernel-space UIO and wait for it.
+ */
+static
+int
+lhd_syncio(struct lhd_softc *lh, struct uio *uio)
+{
+	struct lhd_req req;
+	struct lhd_syncreq sr;
+	int result;
+
+	sr.s_lh = lh;
+	sr.s_done = false;
+	sr.s_result = 0;
+	req.r_uio = uio;
+	req.r_done = lhd_syncdone;
+	req.r_data = &sr;
+
+	result = lhd_submit(lh, &req);
+	if (result) {
+		return result;
+	}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
+	spinlock_acquire(&lh->lh_qlock);
+	while (!sr.s_done) {
+		wchan_sleep(lh->lh_wchan, &lh->lh_qlock);
+	}
+	spinlock_release(&lh->lh_qlock);
+
+	return sr.s_result;
+}
+
+/*
+ * I/O function (for both reads and writes)
+ *
+ * This goes through the request queue like everything else and waits
+ * for the result. User-space I/O is bounced through a kernel buffer,
+ * since the transfers happen outside the process's context.
+ */
+static
+int
+lhd_io(struct device *d, struct uio *uio)
+{
+	struct lhd_softc *lh = d->d_data;
+	struct iovec iov;
+	struct uio ku;
+	char *buf;
+	size_t len;
+	int result;
+
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		return lhd_syncio(lh, uio);
+	}
 
-		/* If we failed, return the error. */
+	buf = kmalloc(LHD_BOUNCE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	result = 0;
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid;
+		if (len > LHD_BOUNCE) {
+			len = LHD_BOUNCE;
+		}
+		uio_kinit(&iov, &ku, buf, len, uio->uio_offset, uio->uio_rw);
+
+		if (uio->uio_rw == UIO_WRITE) {
+			result = uiomove(buf, len, uio);
+			if (result) {
+				break;
+			}
+		}
+		result = lhd_syncio(lh, &ku);
 		if (result) {
-			return result;
+			break;
+		}
+		if (uio->uio_rw == UIO_READ) {
+			result = uiomove(buf, len, uio);
+			if (result) {
+				break;
+			}
 		}
 	}
 
-	return 0;
+	kfree(buf);
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
@@ -284,17 +515,17 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	lh->lh_wchan = wchan_create(name);
+	if (lh->lh_wchan == NULL) {
 		return ENOMEM;
 	}
+	spinlock_init(&lh->lh_qlock);
+	lh->lh_queue = NULL;
+	lh->lh_cur = NULL;
+	lh->lh_pos = 0;
+	lh->lh_busy = false;
+	softint_init(&lh->lh_donesi, lhd_iocomplete, lh);
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
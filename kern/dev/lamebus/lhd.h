@@ -31,12 +31,29 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <softint.h>
+#include <spinlock.h>
 
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * An asynchronous I/O request; see lhd_submit. The caller fills in
+ * the first three fields.
+ */
+struct lhd_req {
+	struct uio *r_uio;		/* Where and what (kernel space) */
+	void (*r_done)(struct lhd_req *req, int result);
+	void *r_data;			/* For r_done's use */
+
+	/* Private to the driver */
+	uint32_t r_sector;		/* Next sector to transfer */
+	uint32_t r_left;		/* Sectors still to transfer */
+	struct lhd_req *r_next;		/* Next in queue */
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -52,8 +69,14 @@ struct lhd_softc {
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
 	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct softint lh_donesi;	/* Runs lhd_iocomplete off the irq */
+
+	struct spinlock lh_qlock;	/* Covers the following */
+	struct lhd_req *lh_queue;	/* Requests waiting */
+	struct lhd_req *lh_cur;		/* Request being served */
+	uint32_t lh_pos;		/* Last sector transferred */
+	bool lh_busy;			/* A sector is in flight */
+	struct wchan *lh_wchan;		/* For synchronous callers */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -61,4 +84,7 @@ struct lhd_softc {
 /* Functions called by lower-level drivers */
 void lhd_irq(/*struct lhd_softc*/ void *);	/* Interrupt handler */
 
+/* Asynchronous I/O, for the buffer cache and swap */
+int lhd_submit(struct lhd_softc *lh, struct lhd_req *req);
+
 #endif /* _LAMEBUS_LHD_H_ */
@@ -34,6 +34,7 @@
 #include <lib.h>
 #include <spl.h>
 #include <clock.h>
+#include <timeout.h>
 #include <platform/bus.h>
 #include <lamebus/ltimer.h>
 #include "autoconf.h"
@@ -46,11 +47,21 @@
 #define LT_REG_COUNT  16    /* Time for countdown timer (usec) */
 #define LT_REG_SPKR   20    /* Beep control */
 
-/* Granularity of countdown timer (usec) */
-#define LT_GRANULARITY   1000000
-
 static bool havetimerclock;
 
+/*
+ * Start the countdown timer, to go off once after USECS microseconds.
+ * Called by the timeout code.
+ */
+static
+void
+ltimer_settimer(void *vlt, uint32_t usecs)
+{
+	struct ltimer_softc *lt = vlt;
+
+	bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_COUNT, usecs);
+}
+
 /*
  * Setup routine called by autoconf stuff when an ltimer is found.
  */
@@ -84,17 +95,17 @@ config_ltimer(struct ltimer_softc *lt, int ltimerno)
 	lt->lt_hardclock = 0;
 
 	/*
-	 * We do, however, use ltimer for the timer clock, since the
-	 * on-chip timer can't do that.
+	 * We do, however, use ltimer for timeouts (and through them,
+	 * the timer clock), since its countdown is in microseconds
+	 * and the on-chip timer is busy being hardclock.
 	 */
 	if (!havetimerclock) {
 		havetimerclock = true;
 		lt->lt_timerclock = 1;
 
-		/* Wire it to go off once every second. */
-		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 1);
-		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_COUNT,
-				   LT_GRANULARITY);
+		/* One-shot; the timeout code sets the countdown as needed. */
+		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 0);
+		timeout_setclock(lt, ltimer_gettime, ltimer_settimer);
 	}
 
 	return 0;
@@ -119,10 +130,10 @@ ltimer_irq(void *vlt)
 			hardclock();
 		}
 		/*
-		 * Likewise for timerclock.
+		 * Likewise for timeouts.
 		 */
 		if (lt->lt_timerclock) {
-			timerclock();
+			timeout_interrupt();
 		}
 	}
 }
@@ -33,47 +33,93 @@
  * Block allocation.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Zero out a disk block.
+ * Zero out a disk block. This only zeroes it in the buffer cache; it
+ * gets to disk on the next sync or when the buffer is recycled.
  */
 static
 int
 sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
+	struct sfs_buf *buf;
+	int result;
 
-	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
+	result = sfs_buf_get(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(sfs_buf_data(buf), SFS_BLOCKSIZE);
+	sfs_buf_markdirty(buf);
+	sfs_buf_release(buf);
+	return 0;
 }
 
 /*
- * Allocate a block.
+ * How far past the goal block sfs_balloc looks before giving up and
+ * taking the first free block on the volume.
+ */
+#define SFS_BALLOC_SCAN 64
+
+/*
+ * Allocate a block. If GOAL is nonzero, prefer it or a free block a
+ * little after it, so that files laid down in order end up
+ * contiguous on disk. Unless ZERO is set, the caller must overwrite
+ * the whole block before anything reads it.
  */
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, daddr_t goal, bool zero, daddr_t *diskblock)
 {
+	daddr_t block, end;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	result = ENOSPC;
+	if (goal != 0) {
+		end = goal + SFS_BALLOC_SCAN;
+		if (end > sfs->sfs_sb.sb_nblocks) {
+			end = sfs->sfs_sb.sb_nblocks;
+		}
+		for (block = goal; block < end; block++) {
+			if (!bitmap_isset(sfs->sfs_freemap, block)) {
+				bitmap_mark(sfs->sfs_freemap, block);
+				*diskblock = block;
+				result = 0;
+				break;
+			}
+		}
+	}
 	if (result) {
-		return result;
+		result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
 	}
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
 		      sfs->sfs_sb.sb_volname, *diskblock);
 	}
 
+	if (!zero) {
+		return 0;
+	}
+
 	/* Clear block before returning it */
 	result = sfs_clearblock(sfs, *diskblock);
 	if (result) {
+		lock_acquire(sfs->sfs_freemaplock);
 		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		lock_release(sfs->sfs_freemaplock);
 	}
 	return result;
 }
@@ -84,8 +130,16 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	/*
+	 * Drop the cached copy first: once the bit is clear the block
+	 * can be handed out again. No need to write back what was in it.
+	 */
+	sfs_buf_invalidate(sfs, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -94,10 +148,15 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
@@ -35,197 +35,399 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Block pointers in the inode. After the direct blocks come three
+ * tiers, each mapped by a single block pointer in the inode: the
+ * indirect block, the double indirect block, and the triple indirect
+ * block. An N-indirect block holds SFS_DBPERIDB pointers to
+ * (N-1)-indirect blocks, each mapping SFS_DBPERIDB^(N-1) file blocks;
+ * a 1-indirect block holds pointers to data blocks.
+ *
+ * To save walking down from the inode for every block of a big file,
+ * sv_bmleaf remembers the last 1-indirect block we went through and
+ * sv_bmbase the first file block it maps. Anything that might free
+ * it (that is, sfs_itrunc) clears sv_bmleaf.
+ */
+
+/*
+ * Find where file block FILEBLOCK lives: the inode field that maps
+ * it, how many levels of indirect blocks are under that field, and
+ * the block's offset from the start of the range that field maps.
+ */
+static
+int
+sfs_bmap_tier(struct sfs_vnode *sv, uint32_t fileblock,
+	      uint32_t **slotret, unsigned *levelsret, uint32_t *offsetret)
+{
+	uint32_t range;
+
+	if (fileblock < SFS_NDIRECT) {
+		*slotret = &sv->sv_i.sfi_direct[fileblock];
+		*levelsret = 0;
+		*offsetret = 0;
+		return 0;
+	}
+	fileblock -= SFS_NDIRECT;
+
+	range = SFS_DBPERIDB;
+	if (fileblock < range) {
+		*slotret = &sv->sv_i.sfi_indirect;
+		*levelsret = 1;
+		*offsetret = fileblock;
+		return 0;
+	}
+	fileblock -= range;
+
+	range *= SFS_DBPERIDB;
+	if (fileblock < range) {
+		*slotret = &sv->sv_i.sfi_dindirect;
+		*levelsret = 2;
+		*offsetret = fileblock;
+		return 0;
+	}
+	fileblock -= range;
+
+	range *= SFS_DBPERIDB;
+	if (fileblock < range) {
+		*slotret = &sv->sv_i.sfi_tindirect;
+		*levelsret = 3;
+		*offsetret = fileblock;
+		return 0;
+	}
+
+	/* Past the end of the biggest file we can map. */
+	return EFBIG;
+}
+
+/*
+ * Get entry INDEX of indirect block IDBLOCK. If it's empty and DOALLOC
+ * is set, allocate a block for it (zeroed if ZERO is set), next to
+ * the entry before it if there is one, or else just after IDBLOCK.
+ */
+static
+int
+sfs_bmap_entry(struct sfs_fs *sfs, daddr_t idblock, uint32_t index,
+	       bool doalloc, bool zero, daddr_t *ret)
+{
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
+	daddr_t block, goal;
+	int result;
+
+	KASSERT(index < SFS_DBPERIDB);
+
+	result = sfs_buf_read(sfs, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = sfs_buf_data(idbuf);
+
+	block = iddata[index];
+	if (block == 0 && doalloc) {
+		goal = (index > 0 && iddata[index-1] != 0) ?
+			iddata[index-1] + 1 : idblock + 1;
+		result = sfs_balloc(sfs, goal, zero, &block);
+		if (result) {
+			sfs_buf_release(idbuf);
+			return result;
+		}
+
+		/* Remember the block we allocated */
+		iddata[index] = block;
+
+		/* The indirect block is now dirty */
+		sfs_buf_markdirty(idbuf);
+	}
+	sfs_buf_release(idbuf);
+
+	*ret = block;
+	return 0;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
- * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * file. If ALLOC isn't SFS_BMAP_NOALLOC, and no such block exists,
+ * one will be allocated, along with any indirect blocks needed to
+ * reach it; with SFS_BMAP_ALLOCRAW the new data block isn't zeroed,
+ * because the caller is about to overwrite all of it.
+ *
+ * New blocks are allocated just after the block before them in the
+ * file when possible, so files written in order come out contiguous.
  */
 int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int alloc,
 	 daddr_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-	daddr_t block;
-	daddr_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t *slot;
+	unsigned levels;
+	uint32_t offset, range, leafbase;
+	daddr_t block, goal;
+	bool doalloc = (alloc != SFS_BMAP_NOALLOC);
+	bool zero = (alloc != SFS_BMAP_ALLOCRAW);
+	unsigned i;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	result = sfs_bmap_tier(sv, fileblock, &slot, &levels, &offset);
+	if (result) {
+		return result;
+	}
 
-	/*
-	 * If the block we want is one of the direct blocks...
-	 */
-	if (fileblock < SFS_NDIRECT) {
-		/*
-		 * Get the block number
-		 */
-		block = sv->sv_i.sfi_direct[fileblock];
-
-		/*
-		 * Do we need to allocate?
-		 */
-		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+	/* Number of file blocks each entry of the top block maps */
+	range = 1;
+	for (i=1; i<levels; i++) {
+		range *= SFS_DBPERIDB;
+	}
+
+	leafbase = fileblock - offset % SFS_DBPERIDB;
+	if (levels > 0 && sv->sv_bmleaf != 0 && sv->sv_bmbase == leafbase) {
+		/* Same 1-indirect block as last time; start there. */
+		block = sv->sv_bmleaf;
+		offset %= SFS_DBPERIDB;
+		range = 1;
+		levels = 1;
+	}
+	else {
+		block = *slot;
+		if (block == 0) {
+			if (!doalloc) {
+				*diskblock = 0;
+				return 0;
+			}
+
+			/*
+			 * Put the new block after the previous file
+			 * block. For an indirect block, that leaves it
+			 * right before the data it maps.
+			 */
+			goal = 0;
+			if (fileblock > 0) {
+				result = sfs_bmap(sv, fileblock - 1,
+						  SFS_BMAP_NOALLOC, &goal);
+				if (result) {
+					return result;
+				}
+				if (goal != 0) {
+					goal++;
+				}
+			}
+			result = sfs_balloc(sfs, goal, levels > 0 || zero,
+					    &block);
 			if (result) {
 				return result;
 			}
 
 			/* Remember what we allocated; mark inode dirty */
-			sv->sv_i.sfi_direct[fileblock] = block;
+			*slot = block;
 			sv->sv_dirty = true;
 		}
+	}
 
-		/*
-		 * Hand back the block
-		 */
-		if (block != 0 && !sfs_bused(sfs, block)) {
-			panic("sfs: %s: Data block %u (block %u of file %u) "
-			      "marked free\n", sfs->sfs_sb.sb_volname,
-			      block, fileblock, sv->sv_ino);
+	/* Go down through the indirect blocks, if any. */
+	for (; levels > 0; levels--) {
+		if (range == 1) {
+			sv->sv_bmbase = leafbase;
+			sv->sv_bmleaf = block;
 		}
-		*diskblock = block;
-		return 0;
+		result = sfs_bmap_entry(sfs, block, offset / range, doalloc,
+					levels > 1 || zero, &block);
+		if (result) {
+			return result;
+		}
+		if (block == 0) {
+			/* A hole, and we weren't asked to fill it */
+			KASSERT(!doalloc);
+			break;
+		}
+		offset %= range;
+		range /= SFS_DBPERIDB;
 	}
 
-	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
+	/* Hand back the result and return. */
+	if (block != 0 && !sfs_bused(sfs, block)) {
+		panic("sfs: %s: Data block %u (block %u of file %u) "
+		      "marked free\n", sfs->sfs_sb.sb_volname,
+		      block, fileblock, sv->sv_ino);
+	}
+	*diskblock = block;
+	return 0;
+}
 
-	fileblock -= SFS_NDIRECT;
+/*
+ * Take file block FILEBLOCK, which must be mapped, back out of the file
+ * and free it. This is for undoing an allocation whose contents
+ * couldn't be filled in. Indirect blocks stay, even if that empties
+ * them; they were just used, so they're still in the buffer cache.
+ */
+int
+sfs_bunmap(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *slot, *iddata;
+	unsigned levels, i;
+	uint32_t offset, range;
+	daddr_t block, idblock;
+	int result;
 
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum >= SFS_NINDIRECT) {
-		return EFBIG;
+	result = sfs_bmap_tier(sv, fileblock, &slot, &levels, &offset);
+	if (result) {
+		return result;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
+	if (levels == 0) {
+		block = *slot;
+		*slot = 0;
+		sv->sv_dirty = true;
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
+	else {
+		/* Find the 1-indirect block that maps it. */
+		range = 1;
+		for (i=1; i<levels; i++) {
+			range *= SFS_DBPERIDB;
+		}
+		idblock = *slot;
+		for (; levels > 1; levels--) {
+			KASSERT(idblock != 0);
+			result = sfs_bmap_entry(sfs, idblock, offset / range,
+						false, false, &idblock);
+			if (result) {
+				return result;
+			}
+			offset %= range;
+			range /= SFS_DBPERIDB;
+		}
+		KASSERT(idblock != 0);
+
+		result = sfs_buf_read(sfs, idblock, &idbuf);
 		if (result) {
 			return result;
 		}
+		iddata = sfs_buf_data(idbuf);
+		block = iddata[offset];
+		iddata[offset] = 0;
+		sfs_buf_markdirty(idbuf);
+		sfs_buf_release(idbuf);
+	}
 
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+	KASSERT(block != 0);
+	sfs_bfree(sfs, block);
+	return 0;
+}
 
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
+/*
+ * Discard the blocks under the indirect block *SLOT (which has LEVELS
+ * levels of indirection, and the first block of which maps file block
+ * BASE) that lie at or past block BLOCKLEN of the file. If that leaves
+ * it empty, free it too, clear *SLOT, and set *CHANGED.
+ */
+static
+int
+sfs_itrunc_ib(struct sfs_fs *sfs, uint32_t *slot, unsigned levels,
+	      uint32_t base, uint32_t blocklen, bool *changed)
+{
+	struct sfs_buf *idbuf;
+	uint32_t *iddata;
+	uint32_t range, j;
+	unsigned i;
+	bool hasnonzero, iddirty;
+	int result;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+	if (*slot == 0) {
+		return 0;
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+
+	/* Number of file blocks each entry maps */
+	range = 1;
+	for (i=1; i<levels; i++) {
+		range *= SFS_DBPERIDB;
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	if (blocklen >= base + range * SFS_DBPERIDB) {
+		/* All of it is before the proposed EOF */
+		return 0;
+	}
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
-		if (result) {
-			return result;
+	/* Read the indirect block */
+	result = sfs_buf_read(sfs, *slot, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = sfs_buf_data(idbuf);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		if (levels > 1) {
+			result = sfs_itrunc_ib(sfs, &iddata[j], levels - 1,
+					       base + j*range, blocklen,
+					       &iddirty);
+			if (result) {
+				if (iddirty) {
+					sfs_buf_markdirty(idbuf);
+				}
+				sfs_buf_release(idbuf);
+				return result;
+			}
 		}
-
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
+		/* Discard any blocks that are past the new EOF */
+		else if (blocklen <= base + j && iddata[j] != 0) {
+			sfs_bfree(sfs, iddata[j]);
+			iddata[j] = 0;
+			iddirty = true;
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (iddata[j] != 0) {
+			hasnonzero = true;
 		}
 	}
 
-	/* Hand back the result and return. */
-	if (block != 0 && !sfs_bused(sfs, block)) {
-		panic("sfs: %s: Data block %u (block %u of file %u) "
-		      "marked free\n", sfs->sfs_sb.sb_volname,
-		      block, fileblock, sv->sv_ino);
+	if (iddirty) {
+		sfs_buf_markdirty(idbuf);
+	}
+	sfs_buf_release(idbuf);
+
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		sfs_bfree(sfs, *slot);
+		*slot = 0;
+		*changed = true;
 	}
-	*diskblock = block;
 	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Called for ftruncate() and from sfs_reclaim, with the vnode locked.
  */
 int
 sfs_itrunc(struct sfs_vnode *sv, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+	uint32_t blocklen;
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
+	uint32_t i, base;
+	daddr_t block;
+	bool changed;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	vfs_biglock_acquire();
+	if (len > (off_t)SFS_MAXFILEBLOCKS * SFS_BLOCKSIZE) {
+		return EFBIG;
+	}
+	blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -240,55 +442,29 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
+	/* The cached indirect block might be about to go away. */
+	sv->sv_bmleaf = 0;
+
+	/* Then the indirect, double indirect, and triple indirect trees. */
+	changed = false;
+	base = SFS_NDIRECT;
+	result = sfs_itrunc_ib(sfs, &sv->sv_i.sfi_indirect, 1, base,
+			       blocklen, &changed);
+	if (result == 0) {
+		base += SFS_DBPERIDB;
+		result = sfs_itrunc_ib(sfs, &sv->sv_i.sfi_dindirect, 2, base,
+				       blocklen, &changed);
+	}
+	if (result == 0) {
+		base += SFS_DBPERIDB * SFS_DBPERIDB;
+		result = sfs_itrunc_ib(sfs, &sv->sv_i.sfi_tindirect, 3, base,
+				       blocklen, &changed);
+	}
+	if (changed) {
+		sv->sv_dirty = true;
+	}
+	if (result) {
+		return result;
 	}
 
 	/* Set the file size */
@@ -297,7 +473,5 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
-
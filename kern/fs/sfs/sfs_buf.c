@@ -0,0 +1,823 @@
+/*
+ * SFS filesystem
+ *
+ * Buffer cache.
+ *
+ * Every block SFS touches other than the superblock and the freemap
+ * (which are kept in memory whole) goes through here: inodes,
+ * indirect blocks, directories, and file data. One pool of buffers is
+ * shared by all mounted volumes and recycled in LRU order.
+ *
+ * Locking: sfs_bufspin covers the hash chains, the LRU list, and each
+ * buffer's identity (b_fs, b_block) and refcount. Each buffer also has
+ * a sleep lock, b_lock, which covers its contents and b_valid/b_dirty
+ * and is held by whoever has the buffer from sfs_buf_read/sfs_buf_get
+ * until sfs_buf_release. Disk I/O happens with only b_lock held.
+ *
+ * A buffer with a nonzero refcount keeps its identity; only buffers
+ * with a refcount of zero are recycled. Because nobody can be holding
+ * b_lock on such a buffer, b_dirty and b_valid may be looked at and
+ * cleared under sfs_bufspin alone in that state.
+ *
+ * Dirty buffers are written back when they're recycled and on
+ * sfs_buf_sync, which sfs_sync calls. sfs_buf_sync writes runs of
+ * consecutive blocks with one request each.
+ *
+ * Read-ahead: sfs_buf_prefetch queues a block to be read in by a
+ * kernel thread, so the caller doesn't wait for it. The queue is
+ * also covered by sfs_bufspin.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <synch.h>
+#include <thread.h>
+#include <mainbus.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Pool size limits; the actual size scales with memory. */
+#define SFS_MINBUFS 64
+#define SFS_MAXBUFS 2048
+
+/* Number of hash chains. A power of 2. */
+#define SFS_BUFHASH 256
+
+/* Number of queued read-ahead requests; any more are dropped. */
+#define SFS_RAQUEUE 64
+
+struct sfs_buf {
+	struct sfs_buf *b_hashnext;	/* Next in hash chain */
+	struct sfs_buf *b_lrunext;	/* Toward most recently used */
+	struct sfs_buf *b_lruprev;	/* Toward least recently used */
+	struct sfs_fs *b_fs;		/* Volume, or NULL if unused */
+	daddr_t b_block;		/* Block number on the volume */
+	unsigned b_refcount;		/* Number of holders and waiters */
+
+	struct lock *b_lock;		/* Covers the following */
+	bool b_valid;			/* b_data matches (or is newer than) disk */
+	bool b_dirty;			/* b_data needs writing back */
+	void *b_data;			/* The block */
+};
+
+static struct spinlock sfs_bufspin = SPINLOCK_INITIALIZER;
+static struct wchan *sfs_bufwchan;	/* Waiting for a free buffer */
+static struct sfs_buf *sfs_bufs;	/* The pool */
+static unsigned sfs_nbufs;
+static struct sfs_buf *sfs_bufhash[SFS_BUFHASH];
+static struct sfs_buf *sfs_lruhead;	/* Least recently used */
+static struct sfs_buf *sfs_lrutail;	/* Most recently used */
+
+/* Read-ahead queue, a ring */
+static struct {
+	struct sfs_fs *ra_fs;
+	daddr_t ra_block;
+} sfs_raq[SFS_RAQUEUE];
+static unsigned sfs_rahead, sfs_racount;
+static bool sfs_rarunning;		/* The thread exists */
+static struct sfs_fs *sfs_rabusy;	/* Volume the thread is reading */
+static struct wchan *sfs_rawchan;	/* The thread waits here */
+static struct wchan *sfs_radonewchan;	/* Waiting for sfs_rabusy */
+
+////////////////////////////////////////////////////////////
+// Hash and LRU list; all called with sfs_bufspin held.
+
+static
+unsigned
+sfs_buf_hashval(struct sfs_fs *sfs, daddr_t block)
+{
+	uint32_t h;
+
+	h = block ^ ((uintptr_t)sfs >> 4);
+	h *= 0x9e3779b1;
+	return (h >> 16) % SFS_BUFHASH;
+}
+
+static
+struct sfs_buf *
+sfs_buf_find(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *b;
+
+	for (b = sfs_bufhash[sfs_buf_hashval(sfs, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_fs == sfs && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_buf_hash(struct sfs_buf *b)
+{
+	unsigned h;
+
+	h = sfs_buf_hashval(b->b_fs, b->b_block);
+	b->b_hashnext = sfs_bufhash[h];
+	sfs_bufhash[h] = b;
+}
+
+static
+void
+sfs_buf_unhash(struct sfs_buf *b)
+{
+	struct sfs_buf **bp;
+
+	if (b->b_fs == NULL) {
+		return;
+	}
+	bp = &sfs_bufhash[sfs_buf_hashval(b->b_fs, b->b_block)];
+	while (*bp != b) {
+		KASSERT(*bp != NULL);
+		bp = &(*bp)->b_hashnext;
+	}
+	*bp = b->b_hashnext;
+	b->b_hashnext = NULL;
+	b->b_fs = NULL;
+}
+
+static
+void
+sfs_lru_remove(struct sfs_buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		sfs_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		sfs_lrutail = b->b_lruprev;
+	}
+	b->b_lrunext = b->b_lruprev = NULL;
+}
+
+static
+void
+sfs_lru_addtail(struct sfs_buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = sfs_lrutail;
+	if (sfs_lrutail != NULL) {
+		sfs_lrutail->b_lrunext = b;
+	}
+	else {
+		sfs_lruhead = b;
+	}
+	sfs_lrutail = b;
+}
+
+static
+void
+sfs_lru_addhead(struct sfs_buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = sfs_lruhead;
+	if (sfs_lruhead != NULL) {
+		sfs_lruhead->b_lruprev = b;
+	}
+	else {
+		sfs_lrutail = b;
+	}
+	sfs_lruhead = b;
+}
+
+////////////////////////////////////////////////////////////
+// Read-ahead thread
+
+/*
+ * Take over a clean, unused buffer for BLOCK on SFS, for read-ahead.
+ * Unlike sfs_buf_lookup this never waits or writes anything back: if
+ * BLOCK is already cached, or there's no clean buffer free, it gives
+ * up and returns NULL. The buffer comes back referenced but unlocked.
+ */
+static
+struct sfs_buf *
+sfs_buf_claim(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *b;
+
+	KASSERT(spinlock_do_i_hold(&sfs_bufspin));
+
+	if (sfs_buf_find(sfs, block) != NULL) {
+		return NULL;
+	}
+	for (b = sfs_lruhead; b != NULL; b = b->b_lrunext) {
+		if (b->b_refcount == 0 && !b->b_dirty) {
+			break;
+		}
+	}
+	if (b == NULL) {
+		return NULL;
+	}
+	sfs_buf_unhash(b);
+	b->b_fs = sfs;
+	b->b_block = block;
+	b->b_valid = false;
+	sfs_buf_hash(b);
+	b->b_refcount++;
+	sfs_lru_remove(b);
+	sfs_lru_addtail(b);
+	return b;
+}
+
+/*
+ * The read-ahead thread. Queued requests for consecutive blocks are
+ * read with a single device request.
+ */
+static
+void
+sfs_buf_rathread(void *unused1, unsigned long unused2)
+{
+	struct sfs_buf *bs[SFS_CLUSTER];
+	void *datas[SFS_CLUSTER];
+	struct sfs_fs *sfs;
+	daddr_t block;
+	unsigned i, n, m;
+
+	(void)unused1;
+	(void)unused2;
+
+	spinlock_acquire(&sfs_bufspin);
+	for (;;) {
+		while (sfs_racount == 0) {
+			wchan_sleep(sfs_rawchan, &sfs_bufspin);
+		}
+		sfs = sfs_raq[sfs_rahead].ra_fs;
+		block = sfs_raq[sfs_rahead].ra_block;
+
+		/* Take the run of requests that follow on from this one. */
+		n = 0;
+		while (sfs_racount > 0 && n < SFS_CLUSTER &&
+		       sfs_raq[sfs_rahead].ra_fs == sfs &&
+		       sfs_raq[sfs_rahead].ra_block == block + n) {
+			sfs_rahead = (sfs_rahead + 1) % SFS_RAQUEUE;
+			sfs_racount--;
+			bs[n] = sfs_buf_claim(sfs, block + n);
+			if (bs[n] == NULL) {
+				/* Cached already, or no buffers to spare. */
+				break;
+			}
+			n++;
+		}
+		if (n == 0) {
+			continue;
+		}
+
+		/* sfs_buf_purge waits for this before sfs goes away. */
+		sfs_rabusy = sfs;
+		spinlock_release(&sfs_bufspin);
+
+		/*
+		 * Someone looking for one of these blocks may have got
+		 * its lock first and read it; if so, only read up to it.
+		 */
+		for (i=0; i<n; i++) {
+			lock_acquire(bs[i]->b_lock);
+			datas[i] = bs[i]->b_data;
+		}
+		for (m=0; m<n && !bs[m]->b_valid; m++) {
+			/* nothing */
+		}
+
+		/* Errors don't matter; the reader will see them itself. */
+		if (m > 0 && sfs_readblocks(sfs, block, datas, m) == 0) {
+			for (i=0; i<m; i++) {
+				bs[i]->b_valid = true;
+			}
+		}
+		for (i=0; i<n; i++) {
+			sfs_buf_release(bs[i]);
+		}
+
+		spinlock_acquire(&sfs_bufspin);
+		sfs_rabusy = NULL;
+		wchan_wakeall(sfs_radonewchan, &sfs_bufspin);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Setup
+
+/*
+ * Create the pool. Called on each mount; only the first does anything.
+ * (Mounts are serialized by the VFS layer.)
+ */
+int
+sfs_buf_bootstrap(void)
+{
+	struct sfs_buf *b;
+	unsigned i, n;
+
+	if (sfs_bufs != NULL) {
+		return 0;
+	}
+
+	/* Use about 1/16 of memory. */
+	n = mainbus_ramsize() / 16 / SFS_BLOCKSIZE;
+	if (n < SFS_MINBUFS) {
+		n = SFS_MINBUFS;
+	}
+	if (n > SFS_MAXBUFS) {
+		n = SFS_MAXBUFS;
+	}
+
+	sfs_bufwchan = wchan_create("sfs_buf");
+	if (sfs_bufwchan == NULL) {
+		return ENOMEM;
+	}
+	b = kmalloc(n * sizeof(*b));
+	if (b == NULL) {
+		wchan_destroy(sfs_bufwchan);
+		sfs_bufwchan = NULL;
+		return ENOMEM;
+	}
+
+	for (i=0; i<n; i++) {
+		b[i].b_hashnext = NULL;
+		b[i].b_fs = NULL;
+		b[i].b_block = 0;
+		b[i].b_refcount = 0;
+		b[i].b_valid = false;
+		b[i].b_dirty = false;
+		b[i].b_lock = lock_create("sfs_buf");
+		b[i].b_data = kmalloc(SFS_BLOCKSIZE);
+		if (b[i].b_lock == NULL || b[i].b_data == NULL) {
+			n = i + 1;
+			for (i=0; i<n; i++) {
+				if (b[i].b_lock != NULL) {
+					lock_destroy(b[i].b_lock);
+				}
+				if (b[i].b_data != NULL) {
+					kfree(b[i].b_data);
+				}
+			}
+			kfree(b);
+			sfs_lruhead = sfs_lrutail = NULL;
+			wchan_destroy(sfs_bufwchan);
+			sfs_bufwchan = NULL;
+			return ENOMEM;
+		}
+		sfs_lru_addtail(&b[i]);
+	}
+	sfs_nbufs = n;
+	sfs_bufs = b;
+
+	/* Read-ahead is only an optimization; do without if need be. */
+	sfs_rawchan = wchan_create("sfs_ra");
+	sfs_radonewchan = wchan_create("sfs_radone");
+	if (sfs_rawchan == NULL || sfs_radonewchan == NULL ||
+	    thread_fork("sfs_readahead", NULL, sfs_buf_rathread,
+			NULL, 0) != 0) {
+		kprintf("sfs: Warning: no read-ahead\n");
+	}
+	else {
+		sfs_rarunning = true;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Getting and releasing buffers
+
+/*
+ * Find or make the buffer for BLOCK on SFS, and lock it. Doesn't read
+ * anything in.
+ */
+static
+int
+sfs_buf_lookup(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	struct sfs_fs *oldfs;
+	daddr_t oldblock;
+	int result;
+
+	KASSERT(sfs_bufs != NULL);
+
+	spinlock_acquire(&sfs_bufspin);
+	for (;;) {
+		b = sfs_buf_find(sfs, block);
+		if (b != NULL) {
+			/* Hit. */
+			b->b_refcount++;
+			sfs_lru_remove(b);
+			sfs_lru_addtail(b);
+			spinlock_release(&sfs_bufspin);
+			lock_acquire(b->b_lock);
+			*ret = b;
+			return 0;
+		}
+
+		/* Miss. Take the least recently used buffer nobody has. */
+		for (b = sfs_lruhead; b != NULL; b = b->b_lrunext) {
+			if (b->b_refcount == 0) {
+				break;
+			}
+		}
+		if (b == NULL) {
+			/*
+			 * Everyone waiting here gets woken when a buffer
+			 * frees up, since whoever wakes first may find
+			 * its block cached and not need the free one.
+			 */
+			wchan_sleep(sfs_bufwchan, &sfs_bufspin);
+			continue;
+		}
+
+		if (!b->b_dirty) {
+			/* Clean; just take it over. */
+			sfs_buf_unhash(b);
+			b->b_fs = sfs;
+			b->b_block = block;
+			b->b_valid = false;
+			sfs_buf_hash(b);
+			b->b_refcount++;
+			sfs_lru_remove(b);
+			sfs_lru_addtail(b);
+			spinlock_release(&sfs_bufspin);
+			lock_acquire(b->b_lock);
+			*ret = b;
+			return 0;
+		}
+
+		/*
+		 * Dirty. Write it back under its old identity, so
+		 * anyone looking for the old block finds it and waits,
+		 * and then start over, since things may have changed.
+		 */
+		b->b_refcount++;
+		oldfs = b->b_fs;
+		oldblock = b->b_block;
+		spinlock_release(&sfs_bufspin);
+
+		lock_acquire(b->b_lock);
+		result = 0;
+		if (b->b_dirty) {
+			KASSERT(b->b_valid);
+			result = sfs_writeblock(oldfs, oldblock, b->b_data,
+						SFS_BLOCKSIZE);
+			if (result == 0) {
+				b->b_dirty = false;
+			}
+		}
+		lock_release(b->b_lock);
+
+		spinlock_acquire(&sfs_bufspin);
+		b->b_refcount--;
+		if (b->b_refcount == 0) {
+			wchan_wakeall(sfs_bufwchan, &sfs_bufspin);
+		}
+		if (result) {
+			spinlock_release(&sfs_bufspin);
+			return result;
+		}
+	}
+}
+
+/*
+ * Get the buffer for BLOCK on SFS, reading it in if needed. The
+ * buffer is returned locked; give it back with sfs_buf_release.
+ */
+int
+sfs_buf_read(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	int result;
+
+	result = sfs_buf_lookup(sfs, block, &b);
+	if (result) {
+		return result;
+	}
+	if (!b->b_valid) {
+		result = sfs_readblock(sfs, block, b->b_data, SFS_BLOCKSIZE);
+		if (result) {
+			sfs_buf_release(b);
+			return result;
+		}
+		b->b_valid = true;
+	}
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Get the buffer for BLOCK on SFS without reading it, for a caller
+ * that is going to overwrite the whole block. Unless it was already
+ * cached the contents are garbage until the caller fills them in and
+ * calls sfs_buf_markdirty; if the caller gives up instead, the buffer
+ * is left invalid and will be read from disk next time.
+ */
+int
+sfs_buf_get(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+	return sfs_buf_lookup(sfs, block, ret);
+}
+
+/*
+ * Drop a reference to a buffer, without holding its lock.
+ */
+static
+void
+sfs_buf_unref(struct sfs_buf *b)
+{
+	spinlock_acquire(&sfs_bufspin);
+	KASSERT(b->b_refcount > 0);
+	b->b_refcount--;
+	if (b->b_refcount == 0) {
+		wchan_wakeall(sfs_bufwchan, &sfs_bufspin);
+	}
+	spinlock_release(&sfs_bufspin);
+}
+
+/*
+ * Give back a buffer.
+ */
+void
+sfs_buf_release(struct sfs_buf *b)
+{
+	lock_release(b->b_lock);
+	sfs_buf_unref(b);
+}
+
+void *
+sfs_buf_data(struct sfs_buf *b)
+{
+	KASSERT(lock_do_i_hold(b->b_lock));
+	return b->b_data;
+}
+
+/*
+ * Note that the buffer's contents have been changed (and are now all
+ * good).
+ */
+void
+sfs_buf_markdirty(struct sfs_buf *b)
+{
+	KASSERT(lock_do_i_hold(b->b_lock));
+	b->b_valid = true;
+	b->b_dirty = true;
+}
+
+/*
+ * Forget any cached copy of BLOCK on SFS; it's been freed, so there's
+ * no point writing it back.
+ */
+void
+sfs_buf_invalidate(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *b;
+
+	spinlock_acquire(&sfs_bufspin);
+	b = sfs_buf_find(sfs, block);
+	if (b != NULL && b->b_refcount == 0) {
+		sfs_buf_unhash(b);
+		b->b_valid = false;
+		b->b_dirty = false;
+		/* Reuse it first. */
+		sfs_lru_remove(b);
+		sfs_lru_addhead(b);
+	}
+	spinlock_release(&sfs_bufspin);
+}
+
+/*
+ * Start reading BLOCK on SFS into the cache in the background, if it
+ * isn't there already. This is only a hint; if the queue is full the
+ * request is dropped.
+ */
+void
+sfs_buf_prefetch(struct sfs_fs *sfs, daddr_t block)
+{
+	unsigned ix;
+
+	spinlock_acquire(&sfs_bufspin);
+	if (sfs_rarunning && sfs_racount < SFS_RAQUEUE &&
+	    sfs_buf_find(sfs, block) == NULL) {
+		ix = (sfs_rahead + sfs_racount) % SFS_RAQUEUE;
+		sfs_raq[ix].ra_fs = sfs;
+		sfs_raq[ix].ra_block = block;
+		sfs_racount++;
+		wchan_wakeone(sfs_rawchan, &sfs_bufspin);
+	}
+	spinlock_release(&sfs_bufspin);
+}
+
+////////////////////////////////////////////////////////////
+// Whole-volume operations
+
+/*
+ * Write back all the dirty buffers for SFS one at a time. This is the
+ * fallback for when sfs_buf_sync can't get memory to do better.
+ */
+static
+int
+sfs_buf_syncslow(struct sfs_fs *sfs)
+{
+	struct sfs_buf *b;
+	unsigned i;
+	int result, ret;
+
+	ret = 0;
+	for (i=0; i<sfs_nbufs; i++) {
+		b = &sfs_bufs[i];
+
+		/* Unlocked peek; checked again below. */
+		spinlock_acquire(&sfs_bufspin);
+		if (b->b_fs != sfs || !b->b_dirty) {
+			spinlock_release(&sfs_bufspin);
+			continue;
+		}
+		b->b_refcount++;
+		spinlock_release(&sfs_bufspin);
+
+		/* Holding a reference, the identity can't change. */
+		lock_acquire(b->b_lock);
+		if (b->b_dirty) {
+			result = sfs_writeblock(sfs, b->b_block, b->b_data,
+						SFS_BLOCKSIZE);
+			if (result) {
+				ret = result;
+			}
+			else {
+				b->b_dirty = false;
+			}
+		}
+		sfs_buf_release(b);
+	}
+	return ret;
+}
+
+/*
+ * Write out buffers BS[0..N), which are for consecutive blocks and
+ * which we hold references to, in as few requests as possible. Each
+ * one is copied to STAGING and marked clean under its own lock, so
+ * we never hold more than one buffer lock; if the write fails the
+ * buffers are marked dirty again.
+ */
+static
+int
+sfs_buf_writerun(struct sfs_fs *sfs, struct sfs_buf **bs, unsigned n,
+		 char *staging)
+{
+	bool copied[SFS_CLUSTER];
+	unsigned i, start;
+	int result, ret;
+
+	KASSERT(n <= SFS_CLUSTER);
+
+	for (i=0; i<n; i++) {
+		lock_acquire(bs[i]->b_lock);
+		copied[i] = bs[i]->b_dirty;
+		if (copied[i]) {
+			KASSERT(bs[i]->b_valid);
+			memcpy(staging + i*SFS_BLOCKSIZE, bs[i]->b_data,
+			       SFS_BLOCKSIZE);
+			bs[i]->b_dirty = false;
+		}
+		lock_release(bs[i]->b_lock);
+	}
+
+	/* Someone else may have cleaned some; write the rest in pieces. */
+	ret = 0;
+	for (i=0; i<n; ) {
+		if (!copied[i]) {
+			i++;
+			continue;
+		}
+		start = i;
+		while (i < n && copied[i]) {
+			i++;
+		}
+		result = sfs_writeblocks(sfs, bs[start]->b_block,
+					 staging + start*SFS_BLOCKSIZE,
+					 i - start);
+		if (result) {
+			ret = result;
+			for (; start < i; start++) {
+				lock_acquire(bs[start]->b_lock);
+				bs[start]->b_dirty = true;
+				lock_release(bs[start]->b_lock);
+			}
+		}
+	}
+	return ret;
+}
+
+/*
+ * Write back all the dirty buffers for SFS, in block order, clustering
+ * runs of consecutive blocks.
+ */
+int
+sfs_buf_sync(struct sfs_fs *sfs)
+{
+	struct sfs_buf **dirty, *b;
+	char *staging;
+	unsigned i, j, k, ndirty;
+	int result, ret;
+
+	dirty = kmalloc(sfs_nbufs * sizeof(*dirty));
+	staging = kmalloc(SFS_CLUSTER * SFS_BLOCKSIZE);
+	if (dirty == NULL || staging == NULL) {
+		kfree(dirty);
+		kfree(staging);
+		return sfs_buf_syncslow(sfs);
+	}
+
+	/* Collect the dirty buffers; a reference pins each identity. */
+	ndirty = 0;
+	spinlock_acquire(&sfs_bufspin);
+	for (i=0; i<sfs_nbufs; i++) {
+		b = &sfs_bufs[i];
+		if (b->b_fs == sfs && b->b_dirty) {
+			b->b_refcount++;
+			dirty[ndirty++] = b;
+		}
+	}
+	spinlock_release(&sfs_bufspin);
+
+	/* Sort by block number (insertion sort; usually nearly sorted). */
+	for (i=1; i<ndirty; i++) {
+		b = dirty[i];
+		for (j=i; j>0 && dirty[j-1]->b_block > b->b_block; j--) {
+			dirty[j] = dirty[j-1];
+		}
+		dirty[j] = b;
+	}
+
+	ret = 0;
+	for (i=0; i<ndirty; i=j) {
+		/* Find the run of consecutive blocks starting here. */
+		for (j=i+1; j<ndirty && j-i < SFS_CLUSTER; j++) {
+			if (dirty[j]->b_block != dirty[i]->b_block + (j-i)) {
+				break;
+			}
+		}
+		result = sfs_buf_writerun(sfs, &dirty[i], j-i, staging);
+		if (result) {
+			ret = result;
+		}
+		for (k=i; k<j; k++) {
+			sfs_buf_unref(dirty[k]);
+		}
+	}
+
+	kfree(staging);
+	kfree(dirty);
+	return ret;
+}
+
+/*
+ * Drop all the buffers for SFS, which is being unmounted. It's just
+ * been synced and nothing on it is open, so none should be dirty or
+ * in use.
+ */
+void
+sfs_buf_purge(struct sfs_fs *sfs)
+{
+	struct sfs_buf *b;
+	unsigned i, n, from, to;
+
+	spinlock_acquire(&sfs_bufspin);
+
+	/* Cancel any queued read-ahead and wait out one in progress. */
+	n = sfs_racount;
+	sfs_racount = 0;
+	for (i=0; i<n; i++) {
+		from = (sfs_rahead + i) % SFS_RAQUEUE;
+		if (sfs_raq[from].ra_fs != sfs) {
+			to = (sfs_rahead + sfs_racount) % SFS_RAQUEUE;
+			sfs_raq[to] = sfs_raq[from];
+			sfs_racount++;
+		}
+	}
+	while (sfs_rabusy == sfs) {
+		wchan_sleep(sfs_radonewchan, &sfs_bufspin);
+	}
+
+	for (i=0; i<sfs_nbufs; i++) {
+		b = &sfs_bufs[i];
+		if (b->b_fs == sfs) {
+			KASSERT(b->b_refcount == 0);
+			if (b->b_dirty) {
+				kprintf("sfs: %s: dropping dirty block %u "
+					"at unmount\n",
+					sfs->sfs_sb.sb_volname, b->b_block);
+			}
+			sfs_buf_unhash(b);
+			b->b_valid = false;
+			b->b_dirty = false;
+			sfs_lru_remove(b);
+			sfs_lru_addhead(b);
+		}
+	}
+	spinlock_release(&sfs_bufspin);
+}
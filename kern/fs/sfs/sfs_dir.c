@@ -35,26 +35,12 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <array.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
-/*
- * Read the directory entry out of slot SLOT of a directory vnode.
- * The "slot" is the index of the directory entry, starting at 0.
- */
-static
-int
-sfs_readdir(struct sfs_vnode *sv, int slot, struct sfs_direntry *sd)
-{
-	off_t actualpos;
-
-	/* Compute the actual position in the directory to read. */
-	actualpos = slot * sizeof(struct sfs_direntry);
-
-	return sfs_metaio(sv, actualpos, sd, sizeof(*sd), UIO_READ);
-}
-
 /*
  * Write (overwrite) the directory entry in slot SLOT of a directory
  * vnode.
@@ -84,6 +70,7 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	off_t size;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
 
 	size = sv->sv_i.sfi_size;
@@ -96,54 +83,295 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 }
 
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * In-memory directory index.
+ *
+ * The first time a directory is searched, all its slots are read and
+ * entered into a hash table keyed by name; empty slots go on a free
+ * list. After that sfs_dir_link and sfs_dir_unlink keep the index in
+ * step with the disk, so looking up, adding or removing a name doesn't
+ * scan the directory. There is one sfs_dirslot per slot on disk, and
+ * it moves between a hash chain and the free list as the slot is used
+ * and freed. The index lives as long as the vnode and is covered by
+ * its sv_lock.
+ */
+struct sfs_dirslot {
+	struct sfs_dirslot *ds_next;	/* Next in hash chain or free list */
+	int ds_slot;			/* Slot number */
+	uint32_t ds_ino;		/* Inode number, or SFS_NOINO */
+	char ds_name[SFS_NAMELEN];	/* Filename, if in use */
+};
+DECLARRAY(sfs_dirslot, static __UNUSED inline);
+DEFARRAY(sfs_dirslot, static __UNUSED inline);
+
+struct sfs_dirindex {
+	struct sfs_dirslot **di_hash;	/* Hash chains of used slots */
+	unsigned di_hashsize;		/* Number of chains; a power of 2 */
+	unsigned di_used;		/* Number of used slots */
+	struct sfs_dirslot *di_free;	/* List of empty slots */
+	struct sfs_dirslotarray di_slots; /* All slots, by slot number */
+};
+
+/* Initial number of hash chains; doubled as the directory grows. */
+#define SFS_DIRHASH_MIN 16
+
+static
+unsigned
+sfs_dir_hashname(const char *name)
+{
+	unsigned h = 5381;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h;
+}
+
+static
+void
+sfs_dirindex_hash(struct sfs_dirindex *di, struct sfs_dirslot *ds)
+{
+	unsigned h;
+
+	h = sfs_dir_hashname(ds->ds_name) & (di->di_hashsize - 1);
+	ds->ds_next = di->di_hash[h];
+	di->di_hash[h] = ds;
+}
+
+/*
+ * Double the number of hash chains once they average more than two
+ * entries. If we can't get the memory, just live with longer chains.
  */
+static
+void
+sfs_dirindex_grow(struct sfs_dirindex *di)
+{
+	struct sfs_dirslot **oldhash, *ds, *next;
+	unsigned oldsize, i;
+
+	if (di->di_used <= 2 * di->di_hashsize) {
+		return;
+	}
+
+	oldhash = di->di_hash;
+	oldsize = di->di_hashsize;
+	di->di_hash = kmalloc(2 * oldsize * sizeof(*di->di_hash));
+	if (di->di_hash == NULL) {
+		di->di_hash = oldhash;
+		return;
+	}
+	di->di_hashsize = 2 * oldsize;
+	for (i=0; i<di->di_hashsize; i++) {
+		di->di_hash[i] = NULL;
+	}
+	for (i=0; i<oldsize; i++) {
+		for (ds = oldhash[i]; ds != NULL; ds = next) {
+			next = ds->ds_next;
+			sfs_dirindex_hash(di, ds);
+		}
+	}
+	kfree(oldhash);
+}
+
+static
+struct sfs_dirslot *
+sfs_dirindex_find(struct sfs_dirindex *di, const char *name)
+{
+	struct sfs_dirslot *ds;
+	unsigned h;
+
+	h = sfs_dir_hashname(name) & (di->di_hashsize - 1);
+	for (ds = di->di_hash[h]; ds != NULL; ds = ds->ds_next) {
+		if (!strcmp(ds->ds_name, name)) {
+			return ds;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_dirindex_unhash(struct sfs_dirindex *di, struct sfs_dirslot *ds)
+{
+	struct sfs_dirslot **dsp;
+	unsigned h;
+
+	h = sfs_dir_hashname(ds->ds_name) & (di->di_hashsize - 1);
+	for (dsp = &di->di_hash[h]; *dsp != ds; dsp = &(*dsp)->ds_next) {
+		KASSERT(*dsp != NULL);
+	}
+	*dsp = ds->ds_next;
+	ds->ds_next = NULL;
+}
+
+/*
+ * Free a directory's index. Called from sfs_reclaim.
+ */
+void
+sfs_dir_dropindex(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	unsigned i, num;
+
+	if (di == NULL) {
+		return;
+	}
+
+	num = sfs_dirslotarray_num(&di->di_slots);
+	for (i=0; i<num; i++) {
+		kfree(sfs_dirslotarray_get(&di->di_slots, i));
+	}
+	sfs_dirslotarray_setsize(&di->di_slots, 0);
+	sfs_dirslotarray_cleanup(&di->di_slots);
+	kfree(di->di_hash);
+	kfree(di);
+	sv->sv_dirindex = NULL;
+}
+
+/*
+ * Build the index for a directory if it doesn't have one yet. The
+ * directory is read a block at a time rather than an entry at a time.
+ */
+static
 int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
-		uint32_t *ino, int *slot, int *emptyslot)
+sfs_dir_getindex(struct sfs_vnode *sv, struct sfs_dirindex **ret)
 {
-	struct sfs_direntry tsd;
-	int found, nentries, i, result;
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dirindex *di;
+	struct sfs_direntry *sds;
+	struct sfs_dirslot *ds;
+	int nentries, perblock, slot, i, n;
+	unsigned h;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_dirindex != NULL) {
+		*ret = sv->sv_dirindex;
+		return 0;
+	}
 
 	nentries = sfs_dir_nentries(sv);
+	perblock = SFS_BLOCKSIZE / sizeof(struct sfs_direntry);
 
-	/* For each slot... */
-	found = 0;
-	for (i=0; i<nentries; i++) {
+	di = kmalloc(sizeof(*di));
+	if (di == NULL) {
+		return ENOMEM;
+	}
+	di->di_hashsize = SFS_DIRHASH_MIN;
+	while (di->di_hashsize < (unsigned)nentries / 2) {
+		di->di_hashsize *= 2;
+	}
+	di->di_hash = kmalloc(di->di_hashsize * sizeof(*di->di_hash));
+	if (di->di_hash == NULL) {
+		kfree(di);
+		return ENOMEM;
+	}
+	for (h=0; h<di->di_hashsize; h++) {
+		di->di_hash[h] = NULL;
+	}
+	di->di_used = 0;
+	di->di_free = NULL;
+	sfs_dirslotarray_init(&di->di_slots);
+	sv->sv_dirindex = di;
+
+	sds = kmalloc(SFS_BLOCKSIZE);
+	if (sds == NULL) {
+		sfs_dir_dropindex(sv);
+		return ENOMEM;
+	}
 
-		/* Read the entry from that slot */
-		result = sfs_readdir(sv, i, &tsd);
+	for (slot=0; slot<nentries; slot += n) {
+		n = nentries - slot;
+		if (n > perblock) {
+			n = perblock;
+		}
+		result = sfs_metaio(sv, slot * sizeof(struct sfs_direntry),
+				    sds, n * sizeof(struct sfs_direntry),
+				    UIO_READ);
 		if (result) {
-			return result;
+			goto fail;
 		}
-		if (tsd.sfd_ino == SFS_NOINO) {
-			/* Free slot - report it back if one was requested */
-			if (emptyslot != NULL) {
-				*emptyslot = i;
+
+		for (i=0; i<n; i++) {
+			ds = kmalloc(sizeof(*ds));
+			if (ds == NULL) {
+				result = ENOMEM;
+				goto fail;
 			}
-		}
-		else {
+			ds->ds_slot = slot + i;
+			ds->ds_ino = sds[i].sfd_ino;
+			result = sfs_dirslotarray_add(&di->di_slots, ds, NULL);
+			if (result) {
+				kfree(ds);
+				goto fail;
+			}
+			if (ds->ds_ino == SFS_NOINO) {
+				ds->ds_name[0] = 0;
+				ds->ds_next = di->di_free;
+				di->di_free = ds;
+				continue;
+			}
+
 			/* Ensure null termination, just in case */
-			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
-			if (!strcmp(tsd.sfd_name, name)) {
-
-				/* Each name may legally appear only once... */
-				KASSERT(found==0);
-
-				found = 1;
-				if (slot != NULL) {
-					*slot = i;
-				}
-				if (ino != NULL) {
-					*ino = tsd.sfd_ino;
-				}
+			memcpy(ds->ds_name, sds[i].sfd_name,
+			       sizeof(ds->ds_name));
+			ds->ds_name[sizeof(ds->ds_name)-1] = 0;
+
+			/* Each name may legally appear only once... */
+			if (sfs_dirindex_find(di, ds->ds_name) != NULL) {
+				panic("sfs: %s: directory %u: duplicate "
+				      "name %s\n", sfs->sfs_sb.sb_volname,
+				      sv->sv_ino, ds->ds_name);
 			}
+			sfs_dirindex_hash(di, ds);
+			di->di_used++;
 		}
 	}
 
-	return found ? 0 : ENOENT;
+	kfree(sds);
+	*ret = di;
+	return 0;
+
+ fail:
+	kfree(sds);
+	sfs_dir_dropindex(sv);
+	return result;
+}
+
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found.
+ */
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		uint32_t *ino, int *slot, int *emptyslot)
+{
+	struct sfs_dirindex *di;
+	struct sfs_dirslot *ds;
+	int result;
+
+	result = sfs_dir_getindex(sv, &di);
+	if (result) {
+		return result;
+	}
+
+	/* Report back a free slot if one was requested */
+	if (emptyslot != NULL && di->di_free != NULL) {
+		*emptyslot = di->di_free->ds_slot;
+	}
+
+	ds = sfs_dirindex_find(di, name);
+	if (ds == NULL) {
+		return ENOENT;
+	}
+	if (slot != NULL) {
+		*slot = ds->ds_slot;
+	}
+	if (ino != NULL) {
+		*ino = ds->ds_ino;
+	}
+	return 0;
 }
 
 /*
@@ -153,16 +381,19 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 int
 sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 {
-	int emptyslot = -1;
+	struct sfs_dirindex *di;
+	struct sfs_dirslot *ds;
+	bool newslot;
 	int result;
 	struct sfs_direntry sd;
 
-	/* Look up the name. We want to make sure it *doesn't* exist. */
-	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
-	if (result!=0 && result!=ENOENT) {
+	result = sfs_dir_getindex(sv, &di);
+	if (result) {
 		return result;
 	}
-	if (result==0) {
+
+	/* Look up the name. We want to make sure it *doesn't* exist. */
+	if (sfs_dirindex_find(di, name) != NULL) {
 		return EEXIST;
 	}
 
@@ -170,9 +401,30 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return ENAMETOOLONG;
 	}
 
-	/* If we didn't get an empty slot, add the entry at the end. */
-	if (emptyslot < 0) {
-		emptyslot = sfs_dir_nentries(sv);
+	/*
+	 * Take an empty slot, or if there isn't one, add the entry at
+	 * the end. Get the index memory first so that once the entry
+	 * is on disk we can't fail to record it.
+	 */
+	if (di->di_free != NULL) {
+		ds = di->di_free;
+		di->di_free = ds->ds_next;
+		newslot = false;
+	}
+	else {
+		ds = kmalloc(sizeof(*ds));
+		if (ds == NULL) {
+			return ENOMEM;
+		}
+		ds->ds_slot = sfs_dir_nentries(sv);
+		KASSERT((unsigned)ds->ds_slot ==
+			sfs_dirslotarray_num(&di->di_slots));
+		result = sfs_dirslotarray_add(&di->di_slots, ds, NULL);
+		if (result) {
+			kfree(ds);
+			return result;
+		}
+		newslot = true;
 	}
 
 	/* Set up the entry. */
@@ -180,13 +432,33 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	sd.sfd_ino = ino;
 	strcpy(sd.sfd_name, name);
 
+	/* Write the entry. */
+	result = sfs_writedir(sv, ds->ds_slot, &sd);
+	if (result) {
+		if (newslot) {
+			sfs_dirslotarray_setsize(&di->di_slots, ds->ds_slot);
+			kfree(ds);
+		}
+		else {
+			ds->ds_next = di->di_free;
+			di->di_free = ds;
+		}
+		return result;
+	}
+
+	/* Update the index. */
+	ds->ds_ino = ino;
+	strcpy(ds->ds_name, name);
+	sfs_dirindex_hash(di, ds);
+	di->di_used++;
+	sfs_dirindex_grow(di);
+
 	/* Hand back the slot, if so requested. */
 	if (slot) {
-		*slot = emptyslot;
+		*slot = ds->ds_slot;
 	}
 
-	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	return 0;
 }
 
 /*
@@ -195,14 +467,39 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
+	struct sfs_dirindex *di;
+	struct sfs_dirslot *ds;
 	struct sfs_direntry sd;
+	int result;
+
+	result = sfs_dir_getindex(sv, &di);
+	if (result) {
+		return result;
+	}
+	KASSERT(slot >= 0 &&
+		(unsigned)slot < sfs_dirslotarray_num(&di->di_slots));
+	ds = sfs_dirslotarray_get(&di->di_slots, slot);
+	KASSERT(ds->ds_ino != SFS_NOINO);
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* Move the slot over to the free list. */
+	sfs_dirindex_unhash(di, ds);
+	di->di_used--;
+	ds->ds_ino = SFS_NOINO;
+	ds->ds_name[0] = 0;
+	ds->ds_next = di->di_free;
+	di->di_free = ds;
+
+	return 0;
 }
 
 /*
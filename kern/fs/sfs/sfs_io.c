@@ -36,6 +36,7 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -46,6 +47,10 @@
 // Basic block-level I/O routines
 
 /*
+ * These go straight to the disk. Most things should use the buffer
+ * cache (sfs_buf.c) instead; these are for the cache itself and for
+ * the superblock and freemap, which are kept in memory whole.
+ *
  * Note: sfs_readblock is used to read the superblock
  * early in mount, before sfs is fully (or even mostly)
  * initialized, and so may not use anything from sfs
@@ -62,8 +67,6 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -116,6 +119,49 @@ sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 	return sfs_rwblock(sfs, &ku);
 }
 
+/*
+ * Read NBLOCKS consecutive blocks starting at BLOCK in one request,
+ * scattering them into DATAS[0..NBLOCKS).
+ */
+int
+sfs_readblocks(struct sfs_fs *sfs, daddr_t block, void **datas,
+	       unsigned nblocks)
+{
+	struct iovec iov[SFS_CLUSTER];
+	struct uio ku;
+	unsigned i;
+
+	KASSERT(nblocks > 0 && nblocks <= SFS_CLUSTER);
+
+	for (i=0; i<nblocks; i++) {
+		iov[i].iov_kbase = datas[i];
+		iov[i].iov_len = SFS_BLOCKSIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = nblocks;
+	ku.uio_offset = ((off_t)block) * SFS_BLOCKSIZE;
+	ku.uio_resid = nblocks * SFS_BLOCKSIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_READ;
+	ku.uio_space = NULL;
+	return sfs_rwblock(sfs, &ku);
+}
+
+/*
+ * Write NBLOCKS consecutive blocks starting at BLOCK in one request.
+ */
+int
+sfs_writeblocks(struct sfs_fs *sfs, daddr_t block, void *data,
+		unsigned nblocks)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	uio_kinit(&iov, &ku, data, nblocks * SFS_BLOCKSIZE,
+		  ((off_t)block) * SFS_BLOCKSIZE, UIO_WRITE);
+	return sfs_rwblock(sfs, &ku);
+}
+
 /*
  * Write a block.
  */
@@ -136,47 +182,55 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 // File-level I/O
 
 /*
- * Do I/O to a block of a file that doesn't cover the whole block.  We
- * need to read in the original block first, even if we're writing, so
- * we don't clobber the portion of the block we're not intending to
- * write over.
+ * Do I/O to one block of a file, through the buffer cache.
  *
  * SKIPSTART is the number of bytes to skip past at the beginning of
- * the sector; LEN is the number of bytes to actually read or write.
+ * the block; LEN is the number of bytes to actually read or write.
  * UIO is the area to do the I/O into.
  */
 static
 int
-sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
-	      uint32_t skipstart, uint32_t len)
+sfs_blockio(struct sfs_vnode *sv, struct uio *uio,
+	    uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
+	bool fresh = false;
 	int result;
 
 	/* Allocate missing blocks if and only if we're writing */
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
 
-	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
+	/* Are we about to overwrite the whole block? */
+	bool whole = doalloc && len == SFS_BLOCKSIZE;
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
-	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/*
+	 * Get the disk block number. A block we're going to overwrite
+	 * entirely doesn't need zeroing first, but then we have to know
+	 * if it's new so we can clean up if the copy fails.
+	 */
+	if (whole) {
+		result = sfs_bmap(sv, fileblock, SFS_BMAP_NOALLOC,
+				  &diskblock);
+		if (result == 0 && diskblock == 0) {
+			result = sfs_bmap(sv, fileblock, SFS_BMAP_ALLOCRAW,
+					  &diskblock);
+			fresh = true;
+		}
+	}
+	else {
+		result = sfs_bmap(sv, fileblock,
+				  doalloc ? SFS_BMAP_ALLOC : SFS_BMAP_NOALLOC,
+				  &diskblock);
+	}
 	if (result) {
 		return result;
 	}
@@ -184,105 +238,110 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * We must be reading, or sfs_bmap would have allocated
+		 * one for us.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block. If we're going to overwrite all of it,
+	 * there's no need to read it first.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	if (whole) {
+		result = sfs_buf_get(sfs, diskblock, &buf);
+	}
+	else {
+		result = sfs_buf_read(sfs, diskblock, &buf);
+	}
 	if (result) {
+		if (fresh) {
+			/*
+			 * It's in the file already, holding whatever was
+			 * on the disk; take it back out.
+			 */
+			sfs_bunmap(sv, fileblock);
+		}
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
 	 */
-	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+	result = uiomove((char *)sfs_buf_data(buf) + skipstart, len, uio);
+	if (result == 0 && uio->uio_rw == UIO_WRITE) {
+		sfs_buf_markdirty(buf);
+	}
+	else if (result && fresh) {
+		/* It's in the file now; don't expose what was there. */
+		bzero(sfs_buf_data(buf), SFS_BLOCKSIZE);
+		sfs_buf_markdirty(buf);
 	}
 
-	return 0;
+	sfs_buf_release(buf);
+	return result;
 }
 
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Read-ahead window limits, in blocks.
+ */
+#define SFS_RAMIN 4
+#define SFS_RAMAX 32
+
+/*
+ * Called after reading file blocks FIRST through LAST. If reads of
+ * this file have been sequential, queue the blocks after LAST for
+ * read-ahead, doubling the window each time the pattern continues;
+ * otherwise shut it off. Blocks already queued aren't queued again.
+ *
+ * The state is in the vnode, so two readers streaming through the
+ * same file at once will mostly defeat it.
  */
 static
-int
-sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+void
+sfs_readahead(struct sfs_vnode *sv, uint32_t first, uint32_t last)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t fileblock, endblock, nblocks;
 	daddr_t diskblock;
-	uint32_t fileblock;
-	int result;
-	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
-	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
-	if (result) {
-		return result;
+	/* Rereading the last block counts, for small reads. */
+	if (first == sv->sv_ranext || first + 1 == sv->sv_ranext) {
+		if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RAMIN;
+		}
+		else if (sv->sv_rawindow < SFS_RAMAX) {
+			sv->sv_rawindow *= 2;
+		}
 	}
-
-	if (diskblock == 0) {
-		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
-		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+	else {
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
 	}
+	sv->sv_ranext = last + 1;
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-
-	result = sfs_rwblock(sfs, uio);
-
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	if (sv->sv_rawindow == 0) {
+		return;
+	}
 
-	return result;
+	nblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	endblock = last + 1 + sv->sv_rawindow;
+	if (endblock > nblocks) {
+		endblock = nblocks;
+	}
+	fileblock = sv->sv_raend > last + 1 ? sv->sv_raend : last + 1;
+	for (; fileblock < endblock; fileblock++) {
+		if (sfs_bmap(sv, fileblock, SFS_BMAP_NOALLOC, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			sfs_buf_prefetch(sfs, diskblock);
+		}
+	}
+	sv->sv_raend = fileblock;
 }
 
 /*
@@ -291,13 +350,20 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
-	uint32_t blkoff;
-	uint32_t nblocks, i;
+	uint32_t skip, len;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	uint32_t firstblock;
 
 	origresid = uio->uio_resid;
 
+	/* Don't start a write the inode can't map. */
+	if (uio->uio_rw == UIO_WRITE &&
+	    uio->uio_offset >= (off_t)SFS_MAXFILEBLOCKS * SFS_BLOCKSIZE) {
+		return EFBIG;
+	}
+	firstblock = uio->uio_offset / SFS_BLOCKSIZE;
+
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
 	 * remember how much extra there was in EXTRARESID so we can
@@ -320,59 +386,32 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * First, do any leading partial block.
+	 * Go a block at a time. Only the first and last blocks can be
+	 * partial.
 	 */
-	blkoff = uio->uio_offset % SFS_BLOCKSIZE;
-	if (blkoff != 0) {
+	while (uio->uio_resid > 0) {
 		/* Number of bytes at beginning of block to skip */
-		uint32_t skip = blkoff;
+		skip = uio->uio_offset % SFS_BLOCKSIZE;
 
 		/* Number of bytes to read/write after that point */
-		uint32_t len = SFS_BLOCKSIZE - blkoff;
+		len = SFS_BLOCKSIZE - skip;
 
 		/* ...which might be less than the rest of the block */
 		if (len > uio->uio_resid) {
 			len = uio->uio_resid;
 		}
 
-		/* Call sfs_partialio() to do it. */
-		result = sfs_partialio(sv, uio, skip, len);
+		result = sfs_blockio(sv, uio, skip, len);
 		if (result) {
-			goto out;
+			break;
 		}
 	}
 
-	/* If we're done, quit. */
-	if (uio->uio_resid==0) {
-		goto out;
-	}
-
-	/*
-	 * Now we should be block-aligned. Do the remaining whole blocks.
-	 */
-	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
-	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
-		if (result) {
-			goto out;
-		}
+	if (uio->uio_rw == UIO_READ && uio->uio_resid != origresid) {
+		sfs_readahead(sv, firstblock, (uio->uio_offset - 1) /
+			      SFS_BLOCKSIZE);
 	}
 
-	/*
-	 * Now do any remaining partial block at the end.
-	 */
-	KASSERT(uio->uio_resid < SFS_BLOCKSIZE);
-
-	if (uio->uio_resid > 0) {
-		result = sfs_partialio(sv, uio, 0, uio->uio_resid);
-		if (result) {
-			goto out;
-		}
-	}
-
- out:
-
 	/* If writing and we did anything, adjust file length */
 	if (uio->uio_resid != origresid &&
 	    uio->uio_rw == UIO_WRITE &&
@@ -392,14 +431,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 // Metadata I/O
 
 /*
- * This is much the same as sfs_partialio, but intended for use with
+ * This is much the same as sfs_blockio, but intended for use with
  * metadata (e.g. directory entries). It assumes the objects being
  * handled are smaller than whole blocks, do not cross block
  * boundaries, and originate in the kernel.
  *
- * It is separate from sfs_partialio because, although there is no
- * such code in this version of SFS, it is often desirable when doing
- * more advanced things to handle metadata and user data I/O
+ * It is separate from sfs_blockio because it is often desirable when
+ * doing more advanced things to handle metadata and user data I/O
  * differently.
  */
 int
@@ -407,6 +445,8 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	   enum uio_rw rw)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	char *ptr;
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
@@ -414,25 +454,18 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
 	blockoffset = actualpos % SFS_BLOCKSIZE;
+	KASSERT(blockoffset + len <= SFS_BLOCKSIZE);
 
 	/* Get the disk block number */
 	doalloc = (rw == UIO_WRITE);
-	result = sfs_bmap(sv, vnblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, vnblock,
+			  doalloc ? SFS_BMAP_ALLOC : SFS_BMAP_NOALLOC,
+			  &diskblock);
 	if (result) {
 		return result;
 	}
@@ -446,27 +479,25 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block */
+	result = sfs_buf_read(sfs, diskblock, &buf);
 	if (result) {
 		return result;
 	}
+	ptr = sfs_buf_data(buf);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, ptr + blockoffset, len);
 	}
 	else {
 		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		memcpy(ptr + blockoffset, data, len);
+		sfs_buf_markdirty(buf);
+	}
+	sfs_buf_release(buf);
 
+	if (rw == UIO_WRITE) {
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
 		if (endpos > (off_t)sv->sv_i.sfi_size) {
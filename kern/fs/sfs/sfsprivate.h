@@ -33,6 +33,24 @@
 #include <uio.h> /* for uio_rw */
 
 
+/*
+ * Locking. SFS doesn't use the VFS big lock; instead, in the order
+ * they must be taken:
+ *
+ *   1. sv_lock of each vnode. A directory's comes before that of
+ *      anything in it.
+ *   2. sfs_vnlock, the vnode table.
+ *   3. sfs_freemaplock.
+ *   4. Buffers (sfs_buf.c), which are locked while held. An indirect
+ *      block comes before the blocks it points to.
+ *   5. The buffer cache's spinlock.
+ *
+ * Because VOP_DECREF can end up in sfs_reclaim, which takes the
+ * vnode's own lock and the vnode table lock, nothing may drop a
+ * reference to a vnode while holding that vnode's lock. Dropping
+ * one to a file while holding its directory's lock is fine.
+ */
+
 /* ops tables (in sfs_vnops.c) */
 extern const struct vnode_ops sfs_fileops;
 extern const struct vnode_ops sfs_dirops;
@@ -41,15 +59,43 @@ extern const struct vnode_ops sfs_dirops;
 #define SFSUIO(iov, uio, ptr, block, rw) \
     uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
 
+/* Most blocks the buffer cache moves in one device request. */
+#define SFS_CLUSTER 16
+
 
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_balloc(struct sfs_fs *sfs, daddr_t goal, bool zero,
+		daddr_t *diskblock);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
+/* Functions in sfs_buf.c */
+struct sfs_buf;
+int sfs_buf_bootstrap(void);
+int sfs_buf_read(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret);
+int sfs_buf_get(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret);
+void sfs_buf_release(struct sfs_buf *b);
+void *sfs_buf_data(struct sfs_buf *b);
+void sfs_buf_markdirty(struct sfs_buf *b);
+void sfs_buf_invalidate(struct sfs_fs *sfs, daddr_t block);
+void sfs_buf_prefetch(struct sfs_fs *sfs, daddr_t block);
+int sfs_buf_sync(struct sfs_fs *sfs);
+void sfs_buf_purge(struct sfs_fs *sfs);
+
+/* Values for the ALLOC argument of sfs_bmap */
+#define SFS_BMAP_NOALLOC	0	/* Hand back 0 for holes */
+#define SFS_BMAP_ALLOC		1	/* Fill holes with zeroed blocks */
+#define SFS_BMAP_ALLOCRAW	2	/* Same, but don't zero a data block */
+
+/* Number of file blocks the inode's block pointers can map */
+#define SFS_MAXFILEBLOCKS \
+	(SFS_NDIRECT + SFS_DBPERIDB + SFS_DBPERIDB * SFS_DBPERIDB + \
+	 SFS_DBPERIDB * SFS_DBPERIDB * SFS_DBPERIDB)
+
 /* Functions in sfs_bmap.c */
-int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int alloc,
 		daddr_t *diskblock);
+int sfs_bunmap(struct sfs_vnode *sv, uint32_t fileblock);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
 
 /* Functions in sfs_dir.c */
@@ -58,6 +104,7 @@ int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 int sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
 		int *slot);
 int sfs_dir_unlink(struct sfs_vnode *sv, int slot);
+void sfs_dir_dropindex(struct sfs_vnode *sv);
 int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
@@ -73,6 +120,10 @@ int sfs_getroot(struct fs *fs, struct vnode **ret);
 /* Functions in sfs_io.c */
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
+int sfs_writeblocks(struct sfs_fs *sfs, daddr_t block, void *data,
+		    unsigned nblocks);
+int sfs_readblocks(struct sfs_fs *sfs, daddr_t block, void **datas,
+		   unsigned nblocks);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
@@ -40,6 +40,7 @@
 #include "pagetable.h"
 
 struct vnode;
+struct lock;
 
 struct segment {
 	vaddr_t vstart, vend;
@@ -57,7 +58,11 @@ struct segment {
  * Address space - data structure associated with the virtual memory
  * space of a process.
  *
- * You write this.
+ * An address space can be shared by several threads of a process, so
+ * it's reference counted: as_create hands back one reference, each
+ * user thread created in it takes another, and as_destroy drops one.
+ * as_lock serializes changes to the page table and segments (faults,
+ * sbrk, fork copying it) between those threads.
  */
 
 struct addrspace {
@@ -73,6 +78,8 @@ struct addrspace {
 	struct page_directory* pt_dir;
 	struct segment *segments;
 	struct segment *heap;
+	volatile unsigned as_refcount;
+	struct lock *as_lock;
 #endif
 };
 
@@ -97,8 +104,10 @@ struct addrspace {
  *                avoid potentially "seeing" it while it's being
  *                destroyed.
  *
- *    as_destroy - dispose of an address space. You may need to change
- *                the way this works if implementing user-level threads.
+ *    as_incref - add a reference to an address space.
+ *
+ *    as_destroy - drop a reference to an address space, disposing of
+ *                it when the last one goes.
  *
  *    as_define_region - set up a region of memory within the address
  *                space.
@@ -125,6 +134,8 @@ void as_activate(void);
 
 void as_deactivate(void);
 
+void as_incref(struct addrspace *);
+
 void as_destroy(struct addrspace *);
 
 int as_define_region(struct addrspace *as,
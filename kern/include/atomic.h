@@ -0,0 +1,35 @@
+#ifndef _ATOMIC_H_
+#define _ATOMIC_H_
+
+/*
+ * Atomic operations on a 32-bit word, for building lock-free counters
+ * and lock-like objects. Each operation is also a full memory barrier
+ * (see membar.h), so no extra barriers are needed around them.
+ *
+ * atomic_cas	If *P is OLDVAL, set it to NEWVAL. Returns what was
+ *		in *P beforehand, so the swap happened if and only if
+ *		the return value equals OLDVAL.
+ * atomic_add	Add DELTA to *P. Returns the new value.
+ * atomic_casptr Like atomic_cas, for a pointer.
+ *
+ * Plain loads and stores of an aligned word are already atomic, so
+ * there are no special functions for those.
+ */
+
+#include <cdefs.h>
+
+/* Inlining support - for making sure an out-of-line copy gets built */
+#ifndef ATOMIC_INLINE
+#define ATOMIC_INLINE INLINE
+#endif
+
+ATOMIC_INLINE unsigned atomic_cas(volatile unsigned *p,
+				  unsigned oldval, unsigned newval);
+ATOMIC_INLINE unsigned atomic_add(volatile unsigned *p, int delta);
+ATOMIC_INLINE void *atomic_casptr(void *volatile *p,
+				  void *oldval, void *newval);
+
+/* Get the implementation. */
+#include <machine/atomic.h>
+
+#endif /* _ATOMIC_H_ */
@@ -38,19 +38,39 @@
 
 
 /*
- * hardclock() is called on every CPU HZ times a second, possibly only
+ * hardclock() is called on every CPU hz times a second, possibly only
  * when the CPU is not idle, for scheduling.
+ *
+ * hz starts out as HZ and can be changed with hardclock_sethz(), e.g.
+ * from the boot command line with the "hz" menu command.
+ *
+ * If hardclock_tickless is set (the default), an idle CPU stops its
+ * timer altogether, and a busy CPU with nothing else on its run queue
+ * only takes a hardclock once a second or when something is queued to
+ * share the CPU with. hardclock_reload() reprograms the current CPU's
+ * timer to match what it's doing; it must be called with the CPU's
+ * run queue lock held, and is called by the thread code as needed.
+ * hardclock_settickless() switches the mode and reprograms every CPU.
  */
 
-/* hardclocks per second */
-#define HZ  100
+/* hardclocks per second: default, and limits for hardclock_sethz */
+#define HZ      100
+#define HZ_MIN  10
+#define HZ_MAX  1000
+
+extern unsigned hz;
+extern bool hardclock_tickless;
 
 void hardclock_bootstrap(void);
 void hardclock(void);
+void hardclock_reload(void);
+int hardclock_sethz(unsigned newhz);
+void hardclock_settickless(bool tickless);
 
 /*
  * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timed operations. (This is a fairly simpleminded interface; see
+ * timeout.h for something finer-grained.)
  */
 void timerclock(void);
 
@@ -60,8 +60,12 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
-	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_hardclocks;		/* Hardclock periods elapsed */
+	uint64_t c_timercycles;		/* Timer time not yet counted (MD) */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	void *volatile c_softints;	/* Pending softints (see softint.h) */
+	bool c_yieldpending;		/* hardclock wants a thread_yield */
+	struct threadlist c_threadcache; /* Dead threads kept for reuse */
 
 	/*
 	 * Accessed by other cpus.
@@ -69,6 +73,7 @@ struct cpu {
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	unsigned c_timerticks;		/* Hardclocks until timer fires */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -88,11 +93,18 @@ struct cpu {
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	volatile unsigned c_shootdowns_done; /* Bumped after each batch */
 	struct spinlock c_ipi_lock;
 };
 
 #define TLBSHOOTDOWN_ALL  (-1)
 
+/*
+ * Bit for a cpu in a 32-bit cpu set, as used by ipi_send_mask. This
+ * relies on the platform having at most 32 cpus (see MAXCPUS).
+ */
+#define CPUMASK(c)  ((uint32_t)1 << (c)->c_number)
+
 /*
  * Initialization functions.
  *
@@ -152,8 +164,13 @@ void cpu_halt(void);
  * or otherwise needs to be invalidated across all CPUs.
  *
  * ipi_send sends an IPI to one CPU.
+ * ipi_send_mask sends an IPI to each CPU in a CPUMASK() set.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_wait invalidates N mappings on every CPU, this one
+ *    included, and waits until all have done so; use it before reusing
+ *    the pages. Call it with interrupts on: other CPUs may be waiting
+ *    on this one the same way.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,8 +183,10 @@ void cpu_halt(void);
 #define IPI_TLBSHOOTDOWN	3	/* MMU mapping(s) need invalidation */
 
 void ipi_send(struct cpu *target, int code);
+void ipi_send_mask(uint32_t mask, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_wait(const struct tlbshootdown *mappings, unsigned n);
 
 void interprocessor_interrupt(void);
 
@@ -3,32 +3,69 @@
 
 #include <limits.h>
 #include <types.h>
+#include <spinlock.h>
 
+/*
+ * An open file. Shared between fds (dup2) and processes (fork); the
+ * refcount is updated atomically so sharing doesn't take fd_lock,
+ * which only covers the offset.
+ */
 struct fdesc {
     char * fd_path;
     int fd_flags;
     off_t fd_offset;
-    unsigned int fd_ref_count;
+    volatile unsigned int fd_ref_count;
     struct vnode *fd_vnode;
     struct lock *fd_lock;
 };
 
+/* Words in the in-use bitmap; the table never grows past OPEN_MAX. */
+#define FDT_WORDS (OPEN_MAX / 32)
+
+/*
+ * A process's file table. fdt_descs starts small and doubles as needed,
+ * up to OPEN_MAX. fdt_used has a bit per fd that's in use, and fdt_full
+ * a bit per word of fdt_used that has no zeros left, so finding the
+ * lowest free fd is two find-first-zeros.
+ *
+ * fdt_lock is a spinlock; nothing is allocated or freed under it.
+ */
 struct fdtable {
-    struct fdesc *fdt_descs[OPEN_MAX];
+    struct spinlock fdt_lock;
+    struct fdesc **fdt_descs;
+    unsigned fdt_size;
+    uint32_t fdt_used[FDT_WORDS];
+    uint32_t fdt_full;
 };
 
 struct fdtable* fdtable_create(void);
 void fdtable_destroy(struct fdtable *);
 /* copies curproc filetable to */
-void fdtable_copy(struct fdtable * from, struct fdtable * to);
+int fdtable_copy(struct fdtable * from, struct fdtable * to);
 
+/*
+ * Getting at fds.
+ *
+ * fdtable_get	Look up FD, returning a new reference to its fdesc.
+ *		EBADF if it isn't open.
+ * fdtable_add	Install FDESC at the lowest free fd, taking over the
+ *		caller's reference. EMFILE if the table is full.
+ * fdtable_set	Install FDESC at FD, taking over the caller's
+ *		reference, and hand back what was there (or NULL) for
+ *		the caller to release.
+ * fdtable_remove Empty FD, handing back what was there (or NULL).
+ */
+int fdtable_get(struct fdtable *, int fd, struct fdesc **ret);
+int fdtable_add(struct fdtable *, struct fdesc *fdesc, int *ret);
+int fdtable_set(struct fdtable *, int fd, struct fdesc *fdesc,
+		struct fdesc **old);
+struct fdesc *fdtable_remove(struct fdtable *, int fd);
 
 struct fdesc *fdesc_create(struct vnode* vn, const char * path, int flags);
-int find_available_fdesc(void);
-int validate_fdesc(int fd);
 void init_console_fdescs(void);
 
 void fdesc_destroy(struct fdesc *);
+void fdesc_incref(struct fdesc *);
 void release_fdesc(struct fdesc *);
 
 
@@ -0,0 +1,18 @@
+#ifndef _KERN_FUTEX_H_
+#define _KERN_FUTEX_H_
+
+/*
+ * Operations for futex(). Shared with userland.
+ *
+ * FUTEX_WAIT	If *UADDR is still VAL, sleep until woken. Fails with
+ *		EAGAIN if it isn't, so a waiter can't miss a wakeup that
+ *		came between its check and the call.
+ * FUTEX_WAKE	Wake up to VAL threads waiting on UADDR. Returns how
+ *		many were woken.
+ */
+
+#define FUTEX_WAIT	0	/* Sleep if the word is unchanged */
+#define FUTEX_WAKE	1	/* Wake sleepers on the word */
+
+
+#endif /* _KERN_FUTEX_H_ */
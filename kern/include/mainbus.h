@@ -55,6 +55,19 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Set the current cpu's timer to call hardclock() NTICKS hardclocks
+ * (at the current hz) from now, replacing whatever was set before and
+ * acknowledging any pending timer interrupt. 0 stops it.
+ */
+void mainbus_settimer(unsigned nticks);
+
+/*
+ * Return the number of hardclock periods that have elapsed on the
+ * current cpu since the last call, going by its own cycle count.
+ */
+unsigned mainbus_timerelapsed(void);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
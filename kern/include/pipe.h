@@ -0,0 +1,12 @@
+#ifndef _PIPE_H_
+#define _PIPE_H_
+
+struct vnode;
+
+/*
+ * Make a pipe. Hands back a vnode for each end, each with one
+ * reference; closing the last reference to an end closes that end.
+ */
+int pipe_create(struct vnode **rd, struct vnode **wr);
+
+#endif /* _PIPE_H_ */
@@ -42,14 +42,25 @@
 
 struct addrspace;
 struct thread;
+struct uthread;
 struct vnode;
 
+/*
+ * A sleep that _exit should cut short; see proc_intr_enter.
+ */
+struct proc_intr {
+	void (*pi_func)(void *);	/* Wakes the sleeper up */
+	void *pi_arg;
+	struct proc_intr *pi_next;
+};
+
 /*
  * Process structure.
  *
  * Note that we only count the number of threads in each process.
- * (And, unless you implement multithreaded user processes, this
- * number will not exceed 1 except in kproc.) If you want to know
+ * User processes can have several threads (see __thread_create);
+ * those share the address space, file table, and so on, and the
+ * process exits when the last of them does. If you want to know
  * exactly which threads are in the process, e.g. for debugging, add
  * an array and a sleeplock to protect it. (You can't use a spinlock
  * to protect an array because arrays need to be able to call
@@ -78,6 +89,19 @@ struct proc {
 	struct fdtable* p_fdtable;
 
 	pid_t pid, parent_pid;
+
+	/* user threads */
+	struct lock *p_tlock;		/* Protects the fields below */
+	struct cv *p_tcv;		/* Signalled when a thread exits */
+	struct uthread *p_uthreads;	/* Threads not yet joined */
+	unsigned p_nlive;		/* User threads not yet exited */
+	int p_nexttid;			/* Next thread id to hand out */
+	volatile bool p_exiting;	/* Set by _exit; all threads leave */
+	int p_exitcode;			/* Status for the last one out */
+
+	/* sleeps to interrupt on exit */
+	struct spinlock p_intrlock;	/* Protects p_intrs */
+	struct proc_intr *p_intrs;	/* Threads in interruptible sleeps */
 };
 
 /* This is the process structure for the kernel and for kernel-only threads. */
@@ -110,4 +134,43 @@ struct addrspace *proc_setas(struct addrspace *);
 void exit_pid(pid_t pid, int exitcode);
 int wait_pid(pid_t pid, int* exitcode);
 
+/*
+ * User threads.
+ *
+ * proc_thread_add	Count a new thread into the current process and
+ *			give it a thread id, before it's forked.
+ * proc_thread_remove	Undo proc_thread_add if the fork failed.
+ * proc_thread_exit	Exit the current thread with CODE for its joiner.
+ *			If it's the last one, the process exits too.
+ * proc_thread_join	Wait for thread TID of the current process to
+ *			exit and collect its code.
+ * proc_checkexit	On the way back to user mode: if another thread
+ *			has called _exit, leave instead.
+ */
+int proc_thread_add(int *tid);
+void proc_thread_remove(int tid);
+__DEAD void proc_thread_exit(int code);
+int proc_thread_join(int tid, int *code);
+void proc_checkexit(void);
+
+/*
+ * Interruptible sleeps. Once a process starts exiting, its other
+ * threads must not stay asleep waiting for something that may never
+ * happen (a child, input, a timer), or the process never finishes.
+ *
+ * proc_intr_enter	Before such a sleep: have _exit call FUNC(ARG) to
+ *			wake the sleeper. FUNC is called with a spinlock
+ *			held, so it mustn't sleep; it typically does a
+ *			wchan_wakeall. Whatever ARG refers to must stay
+ *			valid until proc_intr_leave. Don't hold the
+ *			spinlock FUNC takes when calling this.
+ * proc_intr_leave	After the sleep, likewise without that spinlock.
+ * proc_exiting		True if the current process is exiting; the sleep
+ *			loop checks it (under the lock FUNC takes) and
+ *			gives up with EINTR.
+ */
+void proc_intr_enter(struct proc_intr *pi, void (*func)(void *), void *arg);
+void proc_intr_leave(struct proc_intr *pi);
+bool proc_exiting(void);
+
 #endif /* _PROC_H_ */
@@ -48,25 +48,48 @@
  */
 #include <kern/sfs.h>
 
+/* Number of vnode table hash chains. A power of 2. */
+#define SFS_VNHASH 128
+
 /*
  * In-memory inode
+ *
+ * sv_lock covers sv_i, sv_dirty, sv_dirindex, the read-ahead and
+ * bmap state, and the file's or directory's contents. sv_ino and
+ * the inode's type never change.
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
+	struct lock *sv_lock;           /* lock for the following */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct sfs_vnode *sv_hashnext;  /* next in vnode hash chain */
+	struct sfs_dirindex *sv_dirindex; /* name index, for directories */
+	uint32_t sv_ranext;             /* read-ahead: block after last read */
+	uint32_t sv_raend;              /* read-ahead: first block not queued */
+	unsigned sv_rawindow;           /* read-ahead: blocks to stay ahead */
+	uint32_t sv_bmbase;             /* bmap: 1st file block in sv_bmleaf */
+	daddr_t sv_bmleaf;              /* bmap: last indirect block used */
+	unsigned sv_tableix;            /* our index in sfs_vnodes */
 };
 
 /*
  * In-memory info for a whole fs volume
+ *
+ * sfs_vnlock covers sfs_vnodes and sfs_vnhash, along with sv_hashnext
+ * and sv_tableix in each loaded vnode; sfs_freemaplock covers sfs_freemap
+ * and sfs_freemapdirty. See sfsprivate.h for the lock order.
  */
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
+	struct lock *sfs_vnlock;        /* lock for sfs_vnodes */
 	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASH]; /* same, by inode number */
+	struct lock *sfs_freemaplock;   /* lock for freemap */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
 };
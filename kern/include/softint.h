@@ -0,0 +1,45 @@
+#ifndef _SOFTINT_H_
+#define _SOFTINT_H_
+
+/*
+ * Software interrupts: work that an interrupt handler wants done soon,
+ * but not at high IPL, such as waking up the thread waiting for an
+ * I/O to finish.
+ *
+ * Each cpu has a queue of pending softints. It's lock-free: anyone on
+ * the cpu (including interrupt handlers) can push onto it with an
+ * atomic operation, and only the cpu itself takes things off, all at
+ * once. The queue is run just before returning from an interrupt to
+ * a thread that had interrupts on, with interrupts back on, and from
+ * the idle loop.
+ *
+ * Softint functions run in interrupt context: they must not sleep,
+ * but they can V semaphores, wake wchans, take spinlocks, and so on.
+ *
+ * The struct softint is supplied by the caller, like a spinlock, and
+ * must stay put while pending. The fields are private.
+ */
+
+struct softint {
+	struct softint *si_next;	/* Next on the cpu's queue */
+	volatile unsigned si_pending;	/* Nonzero while queued */
+	void (*si_func)(void *);	/* Function to call */
+	void *si_arg;			/* Argument for function */
+};
+
+/*
+ * Softint functions.
+ *
+ * init		Set up a softint to call FUNC(ARG).
+ * schedule	Arrange for the softint to run on the current cpu. If
+ *		it's already pending, does nothing; the function gets
+ *		called once. Cheap enough to call at any IPL. From a
+ *		thread with interrupts on, runs it right away.
+ * run		Run everything queued on the current cpu. Called by
+ *		the interrupt and idle code.
+ */
+void softint_init(struct softint *si, void (*func)(void *), void *arg);
+void softint_schedule(struct softint *si);
+void softint_run(void);
+
+#endif /* _SOFTINT_H_ */
@@ -55,14 +55,22 @@
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
-	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
+	volatile unsigned splk_next;	    /* Next ticket to hand out. */
+	volatile unsigned splk_serving;	    /* Ticket allowed in now. */
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
+
+	/* Statistics; updated only by the holder. */
+	unsigned splk_acquires;		    /* Times acquired. */
+	unsigned splk_contended;	    /* Times we had to wait. */
+	uint64_t splk_spincycles;	    /* Cycles spent waiting. */
+	vaddr_t splk_where;		    /* Caller the first time we waited. */
+	bool splk_listed;		    /* In the contended-locks list. */
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER	{ 0, 0, NULL, 0, 0, 0, 0, false }
 
 /*
  * Spinlock functions.
@@ -74,6 +82,15 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * These are ticket locks: each acquirer takes a number and waits for
+ * it to come up, so CPUs get the lock in the order they asked for it
+ * and nobody can be starved.
+ *
+ * spinlock_dumpstats prints the (up to) MAX most contended locks,
+ * with how often they were acquired, how often that meant waiting,
+ * and how many cycles were spent waiting. Locks are identified by
+ * address and by the caller the first time they were contended.
  */
 
 void spinlock_init(struct spinlock *lk);
@@ -84,5 +101,7 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+void spinlock_dumpstats(unsigned max);
+
 
 #endif /* _SPINLOCK_H_ */
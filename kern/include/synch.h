@@ -62,6 +62,13 @@ void sem_destroy(struct semaphore *);
 void P(struct semaphore *);
 void V(struct semaphore *);
 
+/*
+ * P_intr is P for user processes' sleeps that may never end, such as
+ * waiting for a child or for input: it gives up with EINTR if the
+ * process starts exiting instead (see proc_intr_enter in proc.h).
+ */
+int P_intr(struct semaphore *);
+
 
 /*
  * Simple lock for mutual exclusion.
@@ -85,7 +92,8 @@ void lock_destroy(struct lock *);
 /*
  * Operations:
  *    lock_acquire - Get the lock. Only one thread can hold the lock at the
- *                   same time.
+ *                   same time. If the holder is running on another cpu,
+ *                   spins for a little while before going to sleep.
  *    lock_release - Free the lock. Only the thread holding the lock may do
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock;
@@ -146,13 +154,32 @@ void cv_broadcast(struct cv *cv, struct lock *lock);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * rw_state packs the whole lock into one word so readers can get in
+ * and out with a single atomic operation when nobody is waiting: the
+ * reader count, a bit for a writer holding it, and bits saying that
+ * readers or writers are waiting. rw_lock is only for going to sleep
+ * and waking up, and protects the waiter counts.
+ *
+ * Writers are preferred: once a writer is waiting, new readers wait
+ * behind it. When the lock is let go and a writer is waiting, it's
+ * handed straight to that writer rather than being put up for grabs.
  */
 
+#define RW_WRITER	0x80000000	/* held by a writer */
+#define RW_WWAIT	0x40000000	/* writers waiting */
+#define RW_RWAIT	0x20000000	/* readers waiting */
+#define RW_READERS	0x1fffffff	/* number of readers holding it */
+
 struct rwlock {
 	char *rwlock_name;
-	struct cv *rwlock_cv;
-	struct lock *rwlock_lock;
-	volatile unsigned active_reader_count, active_writer_count, write_request_count;
+	volatile unsigned rw_state;
+	struct spinlock rw_lock;
+	struct wchan *rw_rwchan;	/* readers sleep here */
+	struct wchan *rw_wwchan;	/* writers sleep here */
+	unsigned rw_wwaiters;		/* writers in the slow path */
+	unsigned rw_handoffs;		/* handed to writers not yet awake */
+	volatile struct thread *rw_writer;
 };
 
 struct rwlock * rwlock_create(const char *);
@@ -33,6 +33,7 @@
 
 #include <cdefs.h> /* for __DEAD */
 struct trapframe; /* from <machine/trapframe.h> */
+struct addrspace;
 
 /*
  * The system call dispatcher.
@@ -47,6 +48,9 @@ void syscall(struct trapframe *tf);
 /* Helper for fork(). You write this. */
 void enter_forked_process(struct trapframe *tf);
 
+/* Start a thread made by __thread_create, from a copy of its trapframe. */
+__DEAD void enter_new_thread(struct trapframe *tf);
+
 /* Enter user mode. Does not return. */
 __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 		       vaddr_t stackptr, vaddr_t entrypoint);
@@ -58,11 +62,23 @@ __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(const_userptr_t req, userptr_t rem);
 
 int sys_open(userptr_t filename, int flags, int *retval);
 int sys_close(int fd, int *retval);
 int sys_read(int fd, const_userptr_t buff, size_t buflen, int *retval);
 int sys_write(int fd, const_userptr_t buff, size_t nbytes, int *retval);
+int sys_pread(int fd, const_userptr_t buff, size_t buflen, off_t offset,
+	      int *retval);
+int sys_pwrite(int fd, const_userptr_t buff, size_t nbytes, off_t offset,
+	       int *retval);
+int sys_readv(int fd, const_userptr_t iov, int iovcnt, int *retval);
+int sys_writev(int fd, const_userptr_t iov, int iovcnt, int *retval);
+int sys_preadv(int fd, const_userptr_t iov, int iovcnt, off_t offset,
+	       int *retval);
+int sys_pwritev(int fd, const_userptr_t iov, int iovcnt, off_t offset,
+		int *retval);
+int sys_pipe(userptr_t fds, int *retval);
 int sys_dup2(int oldfd, int newfd, int *retval);
 int sys_lseek(int fd, off_t pos, int whence, off_t *retval);
 int sys_chdir(const_userptr_t pathname, int *retval);
@@ -74,5 +90,15 @@ int sys_getpid(pid_t *retval);
 int sys_fork(struct trapframe *tf, pid_t *retval);
 int sys_execv(userptr_t program, userptr_t args, int *retval);
 int sys_sbrk(intptr_t amount, int *retval);
+int sys_futex(userptr_t uaddr, int op, int val, int *retval);
+int sys___thread_create(struct trapframe *tf, int *retval);
+__DEAD void sys_thread_exit(int code);
+int sys_thread_join(int tid, userptr_t code, int *retval);
+
+/* Set up the futex hash table. Called from boot(). */
+void futex_bootstrap(void);
+
+/* Wake every futex sleeper in AS, because its process is exiting. */
+void futex_wakeall(struct addrspace *as);
 
 #endif /* _SYSCALL_H_ */
@@ -57,6 +57,8 @@ int threadlisttest(int, char **);
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int timeouttest(int, char **);
+int timeouttest2(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int locktest2(int, char **);
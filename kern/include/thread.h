@@ -116,6 +116,7 @@ struct thread {
 	 */
 
 	/* add more here as needed */
+	int t_tid;			/* User thread id within t_proc */
 };
 
 /*
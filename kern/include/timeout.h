@@ -0,0 +1,68 @@
+#ifndef _TIMEOUT_H_
+#define _TIMEOUT_H_
+
+/*
+ * Timeouts: callbacks that run at (or shortly after) a given time.
+ *
+ * Timeouts are kept on a hierarchical timer wheel with TIMEOUT_TICK_NSEC
+ * resolution, driven by a one-shot hardware timer that is always set
+ * for the next thing on the wheel. Callbacks are run from the timer
+ * interrupt, so they must not sleep; waking threads up is fine.
+ *
+ * The struct timeout is supplied by the caller, like a spinlock, and
+ * must stay put while it's pending. The fields are private.
+ */
+
+#include <kern/time.h>
+
+/* Wheel resolution: 100 microseconds. */
+#define TIMEOUT_TICK_NSEC	100000
+
+struct timeout {
+	struct timeout *to_next;	/* Next on wheel slot or expired list */
+	struct timeout **to_prevp;	/* Link to us; NULL if not on wheel */
+	uint64_t to_expires;		/* Deadline, in wheel ticks */
+	void (*to_func)(void *);	/* Callback */
+	void *to_arg;			/* Argument for callback */
+};
+
+/*
+ * Timeout functions.
+ *
+ * init		Set up a timeout to call FUNC(ARG) when it goes off.
+ * add		Arrange for the timeout to go off at absolute time
+ *		DEADLINE (as returned by gettime()). If it was already
+ *		pending, it's moved. Deadlines in the past go off right
+ *		away (from the timer interrupt, not inside timeout_add).
+ * cancel	Take the timeout off the wheel. Returns true if it was
+ *		pending; false if it wasn't, in which case the callback
+ *		may have already run or may be running on another cpu.
+ * pending	Return true if the timeout hasn't gone off yet.
+ */
+void timeout_init(struct timeout *to, void (*func)(void *), void *arg);
+void timeout_add(struct timeout *to, const struct timespec *deadline);
+bool timeout_cancel(struct timeout *to);
+bool timeout_pending(struct timeout *to);
+
+/*
+ * Put the current thread to sleep until absolute time DEADLINE.
+ * Returns EINTR if the thread's process starts exiting first.
+ */
+int timeout_sleepuntil(const struct timespec *deadline);
+
+/*
+ * Setup. timeout_bootstrap is called once during system startup.
+ *
+ * The timer driver calls timeout_setclock when it attaches, handing
+ * over functions for reading the time and for setting its one-shot
+ * countdown (in microseconds), and then calls timeout_interrupt each
+ * time the countdown runs out. This also takes over calling
+ * timerclock() once a second.
+ */
+void timeout_bootstrap(void);
+void timeout_setclock(void *devdata,
+		      void (*gettime)(void *devdata, struct timespec *ts),
+		      void (*settimer)(void *devdata, uint32_t usecs));
+void timeout_interrupt(void);
+
+#endif /* _TIMEOUT_H_ */
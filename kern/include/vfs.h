@@ -81,6 +81,27 @@ int vfs_lookup(char *path, struct vnode **result);
 int vfs_lookparent(char *path, struct vnode **result,
 		   char *buf, size_t buflen);
 
+/*
+ * Name cache (vfscache.c), used by the above.
+ *
+ *    vfs_ncache_ok         - true if NAME in DIR is cacheable: a single,
+ *                            ordinary component on a filesystem.
+ *    vfs_ncache_lookup     - look up NAME in DIR; true on a hit, with
+ *                            the vnode or NULL for "no such file".
+ *    vfs_ncache_enter      - record the result of a lookup that missed.
+ *    vfs_ncache_invalidate - forget NAME on FS after it may have
+ *                            been created, removed, or renamed.
+ *    vfs_ncache_purgefs    - forget everything on FS, before unmount.
+ */
+
+bool vfs_ncache_ok(struct vnode *dir, const char *name);
+bool vfs_ncache_lookup(struct vnode *dir, const char *name,
+		       struct vnode **ret, unsigned *gen);
+void vfs_ncache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		      unsigned gen);
+void vfs_ncache_invalidate(struct fs *fs, const char *name);
+void vfs_ncache_purgefs(struct fs *fs);
+
 /*
  * VFS layer high-level operations on pathnames
  * Because lookup may destroy pathnames, these all may too.
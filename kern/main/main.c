@@ -38,6 +38,7 @@
 #include <lib.h>
 #include <spl.h>
 #include <clock.h>
+#include <timeout.h>
 #include <thread.h>
 #include <proc.h>
 #include <current.h>
@@ -113,6 +114,7 @@ boot(void)
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
+	timeout_bootstrap();
 	vfs_bootstrap();
 	kheap_nextgeneration();
 
@@ -128,6 +130,7 @@ boot(void)
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
+	futex_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
 	test161_bootstrap();
@@ -42,6 +42,7 @@
 #include <syscall.h>
 #include <test.h>
 #include <prompt.h>
+#include <spinlock.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include "opt-synchprobs.h"
@@ -371,6 +372,49 @@ cmd_bootfs(int nargs, char **args)
 	return vfs_setbootfs(device);
 }
 
+/*
+ * Command to show or set the hardclock rate. This can be given on the
+ * boot command line, e.g. "hz 250; s".
+ */
+static
+int
+cmd_hz(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2) {
+		result = hardclock_sethz(atoi(args[1]));
+		if (result) {
+			kprintf("hz: must be between %d and %d\n",
+				HZ_MIN, HZ_MAX);
+			return result;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: hz [hardclocks-per-second]\n");
+		return EINVAL;
+	}
+
+	kprintf("hz: %u%s\n", hz, hardclock_tickless ? " (tickless)" : "");
+	return 0;
+}
+
+/*
+ * Command to turn tickless mode on or off.
+ */
+static
+int
+cmd_tickless(int nargs, char **args)
+{
+	if (nargs != 2 || (strcmp(args[1], "on") && strcmp(args[1], "off"))) {
+		kprintf("Usage: tickless on|off\n");
+		return EINVAL;
+	}
+
+	hardclock_settickless(!strcmp(args[1], "on"));
+	return 0;
+}
+
 static
 int
 cmd_kheapstats(int nargs, char **args)
@@ -424,6 +468,28 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command for showing the most contended spinlocks.
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	int max;
+
+	max = 10;
+	if (nargs == 2) {
+		max = atoi(args[1]);
+	}
+	if (nargs > 2 || max <= 0) {
+		kprintf("Usage: lockstat [count]\n");
+		return EINVAL;
+	}
+
+	spinlock_dumpstats(max);
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -463,6 +529,8 @@ static const char *opsmenu[] = {
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+	"[hz]      Show/set hardclock rate   ",
+	"[tickless] Tickless mode on/off     ",
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
 	NULL
@@ -492,6 +560,8 @@ static const char *testmenu[] = {
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[tot1] Timeout test                 ",
+	"[tot2] Timeout sleep test           ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
@@ -571,6 +641,7 @@ static const char *mainmenu[] = {
 	"[khu] Kernel heap usage             ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[lockstat] Contended spinlocks      ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -614,6 +685,8 @@ static struct {
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+	{ "hz",		cmd_hz },
+	{ "tickless",	cmd_tickless },
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
@@ -624,6 +697,7 @@ static struct {
 	{ "khu",        cmd_kheapused },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "lockstat",   cmd_lockstat },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -641,6 +715,8 @@ static struct {
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "tot1",	timeouttest },
+	{ "tot2",	timeouttest2 },
 
 	/* synchronization assignment tests */
 	{ "sem1",	semtest },
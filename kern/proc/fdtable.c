@@ -8,6 +8,49 @@
 #include <kern/unistd.h>
 #include <kern/fcntl.h>
 #include <vfs.h>
+#include <atomic.h>
+
+/* Starting size of a file table. */
+#define FDT_INIT 16
+
+#if OPEN_MAX % 32 != 0 || FDT_WORDS > 32
+#error "fdtable bitmaps assume OPEN_MAX is a multiple of 32, at most 1024"
+#endif
+
+#define FDT_ALLFULL ((uint32_t)(((uint64_t)1 << FDT_WORDS) - 1))
+
+/* Index of the lowest zero bit in X, which must have one. */
+static unsigned first_zero(uint32_t x)
+{
+	unsigned n = 0;
+
+	x = ~x;
+	KASSERT(x != 0);
+	if ((x & 0xffff) == 0) { n += 16; x >>= 16; }
+	if ((x & 0xff) == 0) { n += 8; x >>= 8; }
+	if ((x & 0xf) == 0) { n += 4; x >>= 4; }
+	if ((x & 0x3) == 0) { n += 2; x >>= 2; }
+	if ((x & 0x1) == 0) { n += 1; }
+	return n;
+}
+
+static void fdt_markused(struct fdtable *fdt, int fd)
+{
+	unsigned w = fd / 32;
+
+	fdt->fdt_used[w] |= (uint32_t)1 << (fd % 32);
+	if (fdt->fdt_used[w] == 0xffffffff) {
+		fdt->fdt_full |= (uint32_t)1 << w;
+	}
+}
+
+static void fdt_markfree(struct fdtable *fdt, int fd)
+{
+	unsigned w = fd / 32;
+
+	fdt->fdt_used[w] &= ~((uint32_t)1 << (fd % 32));
+	fdt->fdt_full &= ~((uint32_t)1 << w);
+}
 
 struct fdtable *fdtable_create(void)
 {
@@ -17,10 +60,21 @@ struct fdtable *fdtable_create(void)
 	if (fdtable == NULL) {
 		return NULL;
 	}
+	fdtable->fdt_descs = kmalloc(FDT_INIT * sizeof(struct fdesc *));
+	if (fdtable->fdt_descs == NULL) {
+		kfree(fdtable);
+		return NULL;
+	}
 
-	for (int i = 0; i < OPEN_MAX; ++i) {
+	spinlock_init(&fdtable->fdt_lock);
+	fdtable->fdt_size = FDT_INIT;
+	for (unsigned i = 0; i < FDT_INIT; ++i) {
 		fdtable->fdt_descs[i] = NULL;
 	}
+	for (unsigned i = 0; i < FDT_WORDS; ++i) {
+		fdtable->fdt_used[i] = 0;
+	}
+	fdtable->fdt_full = 0;
 
 	return fdtable;
 }
@@ -28,31 +82,189 @@ struct fdtable *fdtable_create(void)
 void fdtable_destroy(struct fdtable *fdtable)
 {
 	KASSERT(fdtable != NULL);
-	for (int i = 0; i < OPEN_MAX; i++) {
+	for (unsigned i = 0; i < fdtable->fdt_size; i++) {
 		struct fdesc *fdesc = fdtable->fdt_descs[i];
 		if (fdesc != NULL) {
 			release_fdesc(fdesc);
 		}
 	}
+	spinlock_cleanup(&fdtable->fdt_lock);
+	kfree(fdtable->fdt_descs);
 	kfree(fdtable);
 }
 
-void fdtable_copy(struct fdtable *from, struct fdtable *to)
+/*
+ * Make the table at least MINSIZE entries (doubling), unless someone
+ * else already did.
+ */
+static int fdtable_grow(struct fdtable *fdt, unsigned minsize)
+{
+	struct fdesc **newdescs, **olddescs;
+	unsigned newsize;
+
+	spinlock_acquire(&fdt->fdt_lock);
+	newsize = fdt->fdt_size;
+	spinlock_release(&fdt->fdt_lock);
+
+	if (newsize >= minsize) {
+		/* Already big enough; the usual case. */
+		return 0;
+	}
+	while (newsize < minsize) {
+		newsize *= 2;
+	}
+	if (newsize > OPEN_MAX) {
+		newsize = OPEN_MAX;
+	}
+
+	newdescs = kmalloc(newsize * sizeof(struct fdesc *));
+	if (newdescs == NULL) {
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&fdt->fdt_lock);
+	if (fdt->fdt_size >= newsize) {
+		/* Somebody beat us to it. */
+		spinlock_release(&fdt->fdt_lock);
+		kfree(newdescs);
+		return 0;
+	}
+	for (unsigned i = 0; i < newsize; ++i) {
+		newdescs[i] = i < fdt->fdt_size ? fdt->fdt_descs[i] : NULL;
+	}
+	olddescs = fdt->fdt_descs;
+	fdt->fdt_descs = newdescs;
+	fdt->fdt_size = newsize;
+	spinlock_release(&fdt->fdt_lock);
+
+	kfree(olddescs);
+	return 0;
+}
+
+int fdtable_copy(struct fdtable *from, struct fdtable *to)
 {
 	KASSERT(from != NULL);
 	KASSERT(to != NULL);
 
-	for (int i = 0; i < OPEN_MAX; ++i) {
+	unsigned size;
+	int result;
+
+	/* TO is new, so nobody else is looking at it. */
+	do {
+		spinlock_acquire(&from->fdt_lock);
+		size = from->fdt_size;
+		spinlock_release(&from->fdt_lock);
+		if ((result = fdtable_grow(to, size))) {
+			return result;
+		}
+		spinlock_acquire(&from->fdt_lock);
+		if (from->fdt_size <= to->fdt_size) {
+			break;
+		}
+		spinlock_release(&from->fdt_lock);
+	} while (1);
+
+	for (unsigned i = 0; i < from->fdt_size; ++i) {
 		if (from->fdt_descs[i] != NULL) {
 			to->fdt_descs[i] = from->fdt_descs[i];
+			fdesc_incref(to->fdt_descs[i]);
+		}
+	}
+	for (unsigned i = 0; i < FDT_WORDS; ++i) {
+		to->fdt_used[i] = from->fdt_used[i];
+	}
+	to->fdt_full = from->fdt_full;
+	spinlock_release(&from->fdt_lock);
 
-			lock_acquire(to->fdt_descs[i]->fd_lock);
-			++(to->fdt_descs[i]->fd_ref_count);
-			lock_release(to->fdt_descs[i]->fd_lock);
+	return 0;
+}
+
+int fdtable_get(struct fdtable *fdt, int fd, struct fdesc **ret)
+{
+	struct fdesc *fdesc = NULL;
+
+	spinlock_acquire(&fdt->fdt_lock);
+	if (fd >= 0 && (unsigned) fd < fdt->fdt_size) {
+		fdesc = fdt->fdt_descs[fd];
+	}
+	if (fdesc != NULL) {
+		fdesc_incref(fdesc);
+	}
+	spinlock_release(&fdt->fdt_lock);
+
+	if (fdesc == NULL) {
+		return EBADF;
+	}
+	*ret = fdesc;
+	return 0;
+}
+
+int fdtable_add(struct fdtable *fdt, struct fdesc *fdesc, int *ret)
+{
+	unsigned w, size;
+	int fd, result;
+
+	while (1) {
+		spinlock_acquire(&fdt->fdt_lock);
+		if (fdt->fdt_full == FDT_ALLFULL) {
+			spinlock_release(&fdt->fdt_lock);
+			return EMFILE;
+		}
+		w = first_zero(fdt->fdt_full);
+		fd = w * 32 + first_zero(fdt->fdt_used[w]);
+		if ((unsigned) fd < fdt->fdt_size) {
+			KASSERT(fdt->fdt_descs[fd] == NULL);
+			fdt->fdt_descs[fd] = fdesc;
+			fdt_markused(fdt, fd);
+			spinlock_release(&fdt->fdt_lock);
+			*ret = fd;
+			return 0;
+		}
+		size = fdt->fdt_size;
+		spinlock_release(&fdt->fdt_lock);
+
+		if ((result = fdtable_grow(fdt, size + 1))) {
+			return result;
 		}
 	}
 }
 
+int fdtable_set(struct fdtable *fdt, int fd, struct fdesc *fdesc,
+		struct fdesc **old)
+{
+	int result;
+
+	if (fd < 0 || fd >= OPEN_MAX) {
+		return EBADF;
+	}
+	if ((result = fdtable_grow(fdt, fd + 1))) {
+		return result;
+	}
+
+	spinlock_acquire(&fdt->fdt_lock);
+	*old = fdt->fdt_descs[fd];
+	fdt->fdt_descs[fd] = fdesc;
+	fdt_markused(fdt, fd);
+	spinlock_release(&fdt->fdt_lock);
+
+	return 0;
+}
+
+struct fdesc *fdtable_remove(struct fdtable *fdt, int fd)
+{
+	struct fdesc *fdesc = NULL;
+
+	spinlock_acquire(&fdt->fdt_lock);
+	if (fd >= 0 && (unsigned) fd < fdt->fdt_size) {
+		fdesc = fdt->fdt_descs[fd];
+		fdt->fdt_descs[fd] = NULL;
+		fdt_markfree(fdt, fd);
+	}
+	spinlock_release(&fdt->fdt_lock);
+
+	return fdesc;
+}
+
 struct fdesc *fdesc_create(struct vnode *vn, const char *path, int flags)
 {
 	struct fdesc *fdesc;
@@ -93,40 +305,23 @@ void fdesc_destroy(struct fdesc *fdesc)
 	kfree(fdesc);
 }
 
+void fdesc_incref(struct fdesc *fdesc)
+{
+	KASSERT(fdesc != NULL);
+	atomic_add(&fdesc->fd_ref_count, 1);
+}
+
 void release_fdesc(struct fdesc *fdesc)
 {
 	KASSERT(fdesc != NULL);
 
-	lock_acquire(fdesc->fd_lock);
-	fdesc->fd_ref_count--;
-	if (fdesc->fd_ref_count == 0) {
+	if (atomic_add(&fdesc->fd_ref_count, -1) == 0) {
 		vfs_close(fdesc->fd_vnode);
-		lock_release(fdesc->fd_lock);
 		fdesc_destroy(fdesc);
-	} else {
-		lock_release(fdesc->fd_lock);
 	}
 }
 
 
-int find_available_fdesc(void)
-{
-	for (int i = 3; i < OPEN_MAX; ++i) {
-		if ((curproc->p_fdtable)->fdt_descs[i] == NULL) {
-			return i;
-		}
-	}
-	return -1;
-}
-
-int validate_fdesc(int fd)
-{
-	if (fd < 0 || fd >= OPEN_MAX || curproc->p_fdtable->fdt_descs[fd] == NULL) {
-		return EBADF;
-	}
-	return 0;
-}
-
 void init_console_fdescs(void)
 {
 	kprintf("Creating console from proc:thread %s:%s...\n", curproc->p_name, curthread->t_name);
@@ -139,17 +334,23 @@ void init_console_fdescs(void)
 	char *stderr = kstrdup("con:");
 	struct vnode *v_stderr;
 
+	struct fdtable *fdt = curproc->p_fdtable;
+	struct fdesc *old;
+
 	result = vfs_open(stdin, O_RDONLY, 0, &v_stdin);
 	KASSERT(result == 0);
-	curproc->p_fdtable->fdt_descs[STDIN_FILENO] = fdesc_create(v_stdin, stdin, O_RDONLY);
+	result = fdtable_set(fdt, STDIN_FILENO, fdesc_create(v_stdin, stdin, O_RDONLY), &old);
+	KASSERT(result == 0 && old == NULL);
 
 	result = vfs_open(stdout, O_WRONLY, 0, &v_stdout);
 	KASSERT(result == 0);
-	curproc->p_fdtable->fdt_descs[STDOUT_FILENO] = fdesc_create(v_stdout, stdout, O_WRONLY);
+	result = fdtable_set(fdt, STDOUT_FILENO, fdesc_create(v_stdout, stdout, O_WRONLY), &old);
+	KASSERT(result == 0 && old == NULL);
 
 	result = vfs_open(stderr, O_WRONLY, 0, &v_stderr);
-	curproc->p_fdtable->fdt_descs[STDERR_FILENO] = fdesc_create(v_stderr, stderr, O_WRONLY);
 	KASSERT(result == 0);
+	result = fdtable_set(fdt, STDERR_FILENO, fdesc_create(v_stderr, stderr, O_WRONLY), &old);
+	KASSERT(result == 0 && old == NULL);
 
 	kfree(stdin);
 	kfree(stdout);
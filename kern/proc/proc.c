@@ -38,8 +38,10 @@
  * things they point to. Rearrange this (and/or change it to be a
  * regular lock) as needed.
  *
- * Unless you're implementing multithreaded user processes, the only
- * process that will have more than one thread is the kernel process.
+ * User processes can have more than one thread. Each thread other than
+ * the first has an id and a struct uthread, which holds its exit code
+ * until somebody joins it; p_tlock covers those and the live-thread
+ * count. Whichever thread leaves last does the process exit.
  */
 
 #include <types.h>
@@ -53,26 +55,65 @@
 #include <kern/fcntl.h>
 #include <kern/errno.h>
 #include <synch.h>
+#include <syscall.h>
 #include <kern/wait.h>
+#include <limits.h>
 
-#define MAX_RUNNING_PROCS 120 // 256
+/* Initial size of the process table; it doubles from there. */
+#define PROC_TABLE_INIT 64
 
 struct proc_meta {
 	pid_t parent_pid, pid;
 	volatile bool exited;
 	volatile int exit_code;
+	bool waiting;			/* A thread of the parent is waiting */
 	struct semaphore *wait_sem;
+	struct proc_meta *children;	/* Our children that are still ours */
+	struct proc_meta *next_sibling, *prev_sibling;
 };
 
 static struct proc_meta *proc_meta_create(void);
 
 static void proc_meta_destroy(unsigned int pid);
 
-static struct lock *proc_table_lock;
-static struct proc_meta *proc_table[MAX_RUNNING_PROCS];
+/*
+ * The process table: proc_table[pid] is the proc_meta for pid, or NULL.
+ *
+ * Free pids wait in a FIFO threaded through proc_freenext, so a pid
+ * that was just released goes to the back of the line. The table
+ * doubles (up to PID_MAX) whenever fewer than a quarter of its slots
+ * are free, so there are always plenty of pids ahead of a released
+ * one and it isn't handed out again soon. Allocating and releasing
+ * are both O(1) apart from the occasional doubling.
+ *
+ * Readers (looking up a pid) take proc_table_lock for reading; anything
+ * that adds, removes, or reparents entries, or grows the table, takes
+ * it for writing.
+ */
+static struct rwlock *proc_table_lock;
+static struct proc_meta **proc_table;
+static pid_t *proc_freenext;		/* Next free pid, or -1 */
+static unsigned proc_table_size;
+static unsigned proc_nfree;
+static pid_t proc_freehead = -1, proc_freetail = -1;
 
 static int assign_pid(struct proc *proc);
 
+/*
+ * A user thread that can be joined.
+ */
+struct uthread {
+	struct uthread *ut_next;
+	int ut_tid;
+	bool ut_exited;
+	bool ut_joining;
+	int ut_code;
+};
+
+static __DEAD void proc_exit(pid_t pid, int exitcode);
+static int proc_table_grow(void);
+static void proc_pid_release(pid_t pid);
+
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
@@ -99,6 +140,8 @@ proc_create(const char *name)
 
 	proc->p_numthreads = 0;
 	spinlock_init(&proc->p_lock);
+	spinlock_init(&proc->p_intrlock);
+	proc->p_intrs = NULL;
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -114,6 +157,28 @@ proc_create(const char *name)
 		return NULL;
 	}
 
+	/* user threads */
+	proc->p_tlock = lock_create("proc_threads");
+	if (proc->p_tlock == NULL) {
+		fdtable_destroy(proc->p_fdtable);
+		kfree(proc->p_name);
+		kfree(proc);
+		return NULL;
+	}
+	proc->p_tcv = cv_create("proc_threads");
+	if (proc->p_tcv == NULL) {
+		lock_destroy(proc->p_tlock);
+		fdtable_destroy(proc->p_fdtable);
+		kfree(proc->p_name);
+		kfree(proc);
+		return NULL;
+	}
+	proc->p_uthreads = NULL;
+	proc->p_nlive = 0;
+	proc->p_nexttid = 1;
+	proc->p_exiting = false;
+	proc->p_exitcode = _MKWAIT_EXIT(0);
+
 	return proc;
 }
 
@@ -199,10 +264,21 @@ proc_destroy(struct proc *proc)
 
 	KASSERT(proc->p_numthreads == 0);
 	spinlock_cleanup(&proc->p_lock);
+	KASSERT(proc->p_intrs == NULL);
+	spinlock_cleanup(&proc->p_intrlock);
 
 	/* file table */
 	fdtable_destroy(proc->p_fdtable);
 
+	/* user threads */
+	while (proc->p_uthreads != NULL) {
+		struct uthread *ut = proc->p_uthreads;
+		proc->p_uthreads = ut->ut_next;
+		kfree(ut);
+	}
+	cv_destroy(proc->p_tcv);
+	lock_destroy(proc->p_tlock);
+
 	kfree(proc->p_name);
 	kfree(proc);
 }
@@ -217,7 +293,17 @@ proc_bootstrap(void)
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
 	}
-	proc_table_lock = lock_create("proc_table_lock");
+	/* Not in the table, and never a parent anyone can wait for. */
+	kproc->pid = PID_MIN - 1;
+	kproc->parent_pid = -1;
+
+	proc_table_lock = rwlock_create("proc_table_lock");
+	if (proc_table_lock == NULL) {
+		panic("rwlock_create for proc_table_lock failed\n");
+	}
+	if (proc_table_grow()) {
+		panic("proc_bootstrap: no memory for the process table\n");
+	}
 }
 
 /*
@@ -242,6 +328,7 @@ struct proc *proc_create_fork(int *errcode)
 		*errcode = result;
 		return NULL;
 	}
+	newproc->p_nlive = 1;
 
 
 	spinlock_acquire(&curproc->p_lock);
@@ -251,7 +338,11 @@ struct proc *proc_create_fork(int *errcode)
 	}
 	spinlock_release(&curproc->p_lock);
 
-	fdtable_copy(curproc->p_fdtable, newproc->p_fdtable);
+	if ((result = fdtable_copy(curproc->p_fdtable, newproc->p_fdtable))) {
+		proc_destroy(newproc);
+		*errcode = result;
+		return NULL;
+	}
 
 	if ((result = as_copy(curproc->p_addrspace, &newproc->p_addrspace))) {
 		proc_destroy(newproc);
@@ -300,7 +391,11 @@ proc_create_runprogram(const char *name)
 		proc_destroy(newproc);
 		return NULL;
 	}
-	fdtable_copy(curproc->p_fdtable, newproc->p_fdtable);
+	newproc->p_nlive = 1;
+	if (fdtable_copy(curproc->p_fdtable, newproc->p_fdtable)) {
+		proc_destroy(newproc);
+		return NULL;
+	}
 
 	return newproc;
 }
@@ -363,10 +458,10 @@ proc_remthread(struct thread *t)
 /*
  * Fetch the address space of (the current) process.
  *
- * Caution: address spaces aren't refcounted. If you implement
- * multithreaded processes, make sure to set up a refcount scheme or
- * some other method to make this safe. Otherwise the returned address
- * space might disappear under you.
+ * Every thread running in an address space holds a reference to it
+ * (the first through the process), and execv refuses to replace it
+ * while there are other threads, so the one returned stays valid for
+ * as long as the calling thread is around.
  */
 struct addrspace *
 proc_getas(void)
@@ -403,31 +498,136 @@ proc_setas(struct addrspace *newas)
 	return oldas;
 }
 
+////////////////////////////////////////////////////////////
+// Interruptible sleeps
+
+/*
+ * The sleepers are on a list in the process, each entry on its own
+ * thread's stack. Kernel threads never exit this way, so they don't
+ * bother.
+ */
+void
+proc_intr_enter(struct proc_intr *pi, void (*func)(void *), void *arg)
+{
+	struct proc *proc = curproc;
+
+	pi->pi_func = func;
+	pi->pi_arg = arg;
+	pi->pi_next = NULL;
+	if (proc == NULL || proc == kproc) {
+		return;
+	}
+
+	spinlock_acquire(&proc->p_intrlock);
+	pi->pi_next = proc->p_intrs;
+	proc->p_intrs = pi;
+	spinlock_release(&proc->p_intrlock);
+}
+
+void
+proc_intr_leave(struct proc_intr *pi)
+{
+	struct proc *proc = curproc;
+	struct proc_intr **pip;
+
+	if (proc == NULL || proc == kproc) {
+		return;
+	}
+
+	spinlock_acquire(&proc->p_intrlock);
+	for (pip = &proc->p_intrs; *pip != pi; pip = &(*pip)->pi_next) {
+		KASSERT(*pip != NULL);
+	}
+	*pip = pi->pi_next;
+	spinlock_release(&proc->p_intrlock);
+}
+
+bool
+proc_exiting(void)
+{
+	struct proc *proc = curproc;
+
+	return proc != NULL && proc != kproc && proc->p_exiting;
+}
+
+/*
+ * Wake up everyone in PROC who's in an interruptible sleep. Call
+ * after setting p_exiting. A sleeper registered after we look has
+ * yet to check p_exiting, and will see it set.
+ */
+static
+void
+proc_intr_all(struct proc *proc)
+{
+	struct proc_intr *pi;
+
+	spinlock_acquire(&proc->p_intrlock);
+	for (pi = proc->p_intrs; pi != NULL; pi = pi->pi_next) {
+		pi->pi_func(pi->pi_arg);
+	}
+	spinlock_release(&proc->p_intrlock);
+}
+
+/*
+ * _exit, or a fatal fault: the whole process goes, with EXITCODE.
+ * The other threads notice p_exiting on their way back to user mode
+ * (or when woken from a join, a futex wait, or an interruptible sleep)
+ * and leave; the last one out finishes up.
+ */
 void exit_pid(pid_t pid, int exitcode)
+{
+	struct proc *proc = curproc;
+	bool others;
+
+	KASSERT(pid == proc->pid);
+
+	lock_acquire(proc->p_tlock);
+	if (!proc->p_exiting) {
+		proc->p_exiting = true;
+		proc->p_exitcode = exitcode;
+	}
+	others = proc->p_nlive > 1;
+	cv_broadcast(proc->p_tcv, proc->p_tlock);
+	lock_release(proc->p_tlock);
+
+	if (others) {
+		futex_wakeall(proc->p_addrspace);
+		proc_intr_all(proc);
+	}
+
+	proc_thread_exit(exitcode);
+}
+
+/*
+ * The process is done: all its threads have left but the current one.
+ * Reparent the children, post the exit code, and go.
+ */
+static
+void
+proc_exit(pid_t pid, int exitcode)
 {
 //	kprintf("S exit_pid pid:%d\n", pid);
 
-	lock_acquire(proc_table_lock);
+	rwlock_acquire_write(proc_table_lock);
 
 	KASSERT(pid >= PID_MIN);
 	KASSERT(proc_table[pid] != NULL);
 	KASSERT(proc_table[pid]->exited == false);
 
-	for (unsigned i = PID_MIN; i < MAX_RUNNING_PROCS; i++) {
-		if (proc_table[i] == NULL) {
-			continue;
-		}
-		if (proc_table[i]->parent_pid == curproc->pid) {
-			proc_table[i]->parent_pid = -1;
-			if (proc_table[i]->exited) {
-				proc_meta_destroy(i);
-			}
-		}
-	}
-
 	struct proc *proc = curproc;
 	struct proc_meta *pm = proc_table[pid];
 
+	/* Orphan the children; nobody will wait for the ones done already. */
+	while (pm->children != NULL) {
+		struct proc_meta *child = pm->children;
+		pm->children = child->next_sibling;
+		child->parent_pid = -1;
+		child->next_sibling = child->prev_sibling = NULL;
+		if (child->exited) {
+			proc_meta_destroy((unsigned int) child->pid);
+		}
+	}
+
 	KASSERT(pm != NULL);
 	pm->exited = true;
 	pm->exit_code = (exitcode);
@@ -439,16 +639,180 @@ void exit_pid(pid_t pid, int exitcode)
 	if (pm->parent_pid == -1) {
 		proc_meta_destroy((unsigned int) pid);
 	}
-	lock_release(proc_table_lock);
+	rwlock_release_write(proc_table_lock);
 
 //	kprintf("E exit_pid pid:%d\n", pid);
 
 	thread_exit(); // does not return
 }
 
+int
+proc_thread_add(int *tid)
+{
+	struct proc *proc = curproc;
+	struct uthread *ut;
+
+	ut = kmalloc(sizeof(*ut));
+	if (ut == NULL) {
+		return ENOMEM;
+	}
+	ut->ut_exited = false;
+	ut->ut_joining = false;
+	ut->ut_code = 0;
+
+	lock_acquire(proc->p_tlock);
+	if (proc->p_exiting) {
+		lock_release(proc->p_tlock);
+		kfree(ut);
+		return EINTR;
+	}
+	ut->ut_tid = proc->p_nexttid++;
+	ut->ut_next = proc->p_uthreads;
+	proc->p_uthreads = ut;
+	proc->p_nlive++;
+	lock_release(proc->p_tlock);
+
+	/* The new thread's reference to the address space. */
+	as_incref(proc->p_addrspace);
+
+	*tid = ut->ut_tid;
+	return 0;
+}
+
+void
+proc_thread_remove(int tid)
+{
+	struct proc *proc = curproc;
+	struct uthread **utp, *ut;
+
+	lock_acquire(proc->p_tlock);
+	for (utp = &proc->p_uthreads; (*utp)->ut_tid != tid;
+	     utp = &(*utp)->ut_next) {
+		KASSERT((*utp)->ut_next != NULL);
+	}
+	ut = *utp;
+	*utp = ut->ut_next;
+	KASSERT(proc->p_nlive > 1);
+	proc->p_nlive--;
+	lock_release(proc->p_tlock);
+
+	kfree(ut);
+	as_destroy(proc->p_addrspace);
+}
+
+void
+proc_thread_exit(int code)
+{
+	struct proc *proc = curproc;
+	struct uthread *ut;
+	bool last;
+	unsigned n;
+
+	lock_acquire(proc->p_tlock);
+	for (ut = proc->p_uthreads; ut != NULL; ut = ut->ut_next) {
+		if (ut->ut_tid == curthread->t_tid) {
+			ut->ut_exited = true;
+			ut->ut_code = code;
+			cv_broadcast(proc->p_tcv, proc->p_tlock);
+			break;
+		}
+	}
+	KASSERT(proc->p_nlive > 0);
+	proc->p_nlive--;
+	last = proc->p_nlive == 0;
+	lock_release(proc->p_tlock);
+
+	if (curthread->t_tid != 0) {
+		/* Drop our reference; the process still has its own. */
+		as_destroy(proc->p_addrspace);
+	}
+
+	if (!last) {
+		/* Detaches us from the process; don't touch it after. */
+		thread_exit();
+	}
+
+	/*
+	 * The others are on their way out; wait for them to detach
+	 * before tearing the process down.
+	 */
+	for (;;) {
+		spinlock_acquire(&proc->p_lock);
+		n = proc->p_numthreads;
+		spinlock_release(&proc->p_lock);
+		if (n == 1) {
+			break;
+		}
+		thread_yield();
+	}
+
+	proc_exit(proc->pid, proc->p_exitcode);
+}
+
+int
+proc_thread_join(int tid, int *code)
+{
+	struct proc *proc = curproc;
+	struct uthread **utp, *ut;
+
+	if (tid == curthread->t_tid) {
+		return EINVAL;
+	}
+
+	lock_acquire(proc->p_tlock);
+	for (utp = &proc->p_uthreads; *utp != NULL; utp = &(*utp)->ut_next) {
+		if ((*utp)->ut_tid == tid) {
+			break;
+		}
+	}
+	ut = *utp;
+	if (ut == NULL) {
+		lock_release(proc->p_tlock);
+		return ESRCH;
+	}
+	if (ut->ut_joining) {
+		lock_release(proc->p_tlock);
+		return EINVAL;
+	}
+
+	ut->ut_joining = true;
+	while (!ut->ut_exited && !proc->p_exiting) {
+		cv_wait(proc->p_tcv, proc->p_tlock);
+	}
+	if (!ut->ut_exited) {
+		/* We're on our way out too. */
+		ut->ut_joining = false;
+		lock_release(proc->p_tlock);
+		return EINTR;
+	}
+
+	/* Others may have been added in front of it meanwhile. */
+	utp = &proc->p_uthreads;
+	while (*utp != ut) {
+		utp = &(*utp)->ut_next;
+	}
+	*utp = ut->ut_next;
+	lock_release(proc->p_tlock);
+
+	*code = ut->ut_code;
+	kfree(ut);
+	return 0;
+}
+
+void
+proc_checkexit(void)
+{
+	struct proc *proc = curproc;
+
+	if (proc != NULL && proc != kproc && proc->p_exiting) {
+		proc_thread_exit(proc->p_exitcode);
+	}
+}
+
 int wait_pid(pid_t pid, int *exitcode)
 {
 //	kprintf("S wait_pid pid:%d\n", pid);
+	int result;
 
 	KASSERT(pid >= PID_MIN);
 
@@ -456,43 +820,166 @@ int wait_pid(pid_t pid, int *exitcode)
 		return ESRCH;
 	}
 
-	struct proc_meta *pm = proc_table[pid];
+	/*
+	 * Claim the child, so that if another of our threads waits for
+	 * it too, only one of them collects it and frees pm.
+	 */
+	rwlock_acquire_write(proc_table_lock);
+	struct proc_meta *pm = NULL;
+	if ((unsigned) pid < proc_table_size) {
+		pm = proc_table[pid];
+	}
 	if (pm == NULL) {
+		rwlock_release_write(proc_table_lock);
 		return ESRCH;
 	}
 
-	if (pm->parent_pid != curproc->pid) {
+	if (pm->parent_pid != curproc->pid || pm->waiting) {
+		rwlock_release_write(proc_table_lock);
 		return ECHILD;
 	}
+	pm->waiting = true;
+	rwlock_release_write(proc_table_lock);
 
-	P(pm->wait_sem);
+	/*
+	 * Having claimed it, we're the only ones who free pm while we're
+	 * alive (the process can't finish exiting while we're in here),
+	 * so it stays put.
+	 */
+	result = P_intr(pm->wait_sem);
+	if (result) {
+		/* We're exiting; let go. */
+		rwlock_acquire_write(proc_table_lock);
+		pm->waiting = false;
+		rwlock_release_write(proc_table_lock);
+		return result;
+	}
 	KASSERT(pm->exited == true);
 	*exitcode = pm->exit_code;
+
+	rwlock_acquire_write(proc_table_lock);
 	proc_meta_destroy((unsigned int) pid);
+	rwlock_release_write(proc_table_lock);
 //	kprintf("E wait_pid pid:%d\n", pid);
 
 	return 0;
 }
 
+/*
+ * Double the process table, or create it, putting the new pids on the
+ * back of the free list. Call with proc_table_lock held for writing
+ * (or during bootstrap).
+ */
+static int proc_table_grow(void)
+{
+	struct proc_meta **newtable;
+	pid_t *newfree;
+	unsigned newsize, i;
+
+	if (proc_table_size > PID_MAX) {
+		return ENPROC;
+	}
+	newsize = proc_table_size == 0 ? PROC_TABLE_INIT : proc_table_size * 2;
+	if (newsize > PID_MAX + 1) {
+		newsize = PID_MAX + 1;
+	}
+
+	newtable = kmalloc(newsize * sizeof(*newtable));
+	if (newtable == NULL) {
+		return ENOMEM;
+	}
+	newfree = kmalloc(newsize * sizeof(*newfree));
+	if (newfree == NULL) {
+		kfree(newtable);
+		return ENOMEM;
+	}
+	for (i = 0; i < proc_table_size; i++) {
+		newtable[i] = proc_table[i];
+		newfree[i] = proc_freenext[i];
+	}
+	for (; i < newsize; i++) {
+		newtable[i] = NULL;
+		newfree[i] = -1;
+	}
+	kfree(proc_table);
+	kfree(proc_freenext);
+	proc_table = newtable;
+	proc_freenext = newfree;
+
+	i = proc_table_size < PID_MIN ? PID_MIN : proc_table_size;
+	proc_table_size = newsize;
+	for (; i < newsize; i++) {
+		proc_pid_release(i);
+	}
+	return 0;
+}
+
+/*
+ * Put PID on the back of the free list. Call with proc_table_lock held
+ * for writing.
+ */
+static void proc_pid_release(pid_t pid)
+{
+	KASSERT(proc_table[pid] == NULL);
+	proc_freenext[pid] = -1;
+	if (proc_freetail < 0) {
+		proc_freehead = pid;
+	}
+	else {
+		proc_freenext[proc_freetail] = pid;
+	}
+	proc_freetail = pid;
+	proc_nfree++;
+}
+
 static int assign_pid(struct proc *proc)
 {
-	lock_acquire(proc_table_lock);
 	KASSERT(proc != NULL);
-	for (int i = PID_MIN; i <= MAX_RUNNING_PROCS; ++i) {
-		if (proc_table[i] == NULL) {
-			struct proc_meta *pm = proc_meta_create();
-			if (pm != NULL) {
-				pm->pid = i;
-				proc->pid = i;
-				proc->parent_pid = curproc->pid;
-				proc_table[i] = pm;
-				lock_release(proc_table_lock);
-				return 0;
-			}
+
+	struct proc_meta *pm = proc_meta_create();
+	if (pm == NULL) {
+		return ENOMEM;
+	}
+
+	rwlock_acquire_write(proc_table_lock);
+
+	/* Keep a quarter free, so released pids age before reuse. */
+	if (proc_nfree < proc_table_size / 4) {
+		/* Failing is fine as long as there's something left. */
+		proc_table_grow();
+	}
+	if (proc_freehead < 0) {
+		rwlock_release_write(proc_table_lock);
+		sem_destroy(pm->wait_sem);
+		kfree(pm);
+		return ENPROC;
+	}
+
+	pid_t pid = proc_freehead;
+	proc_freehead = proc_freenext[pid];
+	if (proc_freehead < 0) {
+		proc_freetail = -1;
+	}
+	proc_nfree--;
+
+	pm->pid = pid;
+	proc->pid = pid;
+	proc->parent_pid = curproc->pid;
+	proc_table[pid] = pm;
+
+	/* The kernel isn't in the table; its children are nobody's. */
+	if (curproc != kproc) {
+		struct proc_meta *parent = proc_table[curproc->pid];
+		KASSERT(parent != NULL);
+		pm->next_sibling = parent->children;
+		if (parent->children != NULL) {
+			parent->children->prev_sibling = pm;
 		}
+		parent->children = pm;
 	}
-	lock_release(proc_table_lock);
-	return ENPROC;
+
+	rwlock_release_write(proc_table_lock);
+	return 0;
 }
 
 struct proc_meta *proc_meta_create(void)
@@ -508,17 +995,36 @@ struct proc_meta *proc_meta_create(void)
 	}
 
 	procm->exited = false;
+	procm->waiting = false;
 	procm->parent_pid = curproc->pid;
+	procm->children = NULL;
+	procm->next_sibling = procm->prev_sibling = NULL;
 
 	return procm;
 }
 
 void proc_meta_destroy(unsigned int pid)
 {
-	KASSERT(proc_table[pid] != NULL);
-	KASSERT(proc_table[pid]->exited == true);
+	struct proc_meta *pm = proc_table[pid];
+
+	KASSERT(pm != NULL);
+	KASSERT(pm->exited == true);
+	KASSERT(pm->children == NULL);
+
+	/* Off the parent's list, if it still has one. */
+	if (pm->prev_sibling != NULL) {
+		pm->prev_sibling->next_sibling = pm->next_sibling;
+	}
+	else if (pm->parent_pid >= PID_MIN) {
+		KASSERT(proc_table[pm->parent_pid]->children == pm);
+		proc_table[pm->parent_pid]->children = pm->next_sibling;
+	}
+	if (pm->next_sibling != NULL) {
+		pm->next_sibling->prev_sibling = pm->prev_sibling;
+	}
 
-	sem_destroy(proc_table[pid]->wait_sem);
-	kfree(proc_table[pid]);
+	sem_destroy(pm->wait_sem);
+	kfree(pm);
 	proc_table[pid] = NULL;
+	proc_pid_release(pid);
 }
\ No newline at end of file
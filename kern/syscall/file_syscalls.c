@@ -1,5 +1,6 @@
 #include <limits.h>
 #include <types.h>
+#include <lib.h>
 #include <copyinout.h>
 #include <syscall.h>
 #include <kern/errno.h>
@@ -13,6 +14,7 @@
 #include <kern/fcntl.h>
 #include <uio.h>
 #include <kern/seek.h>
+#include <pipe.h>
 
 int sys_open(userptr_t filename, int flags, int *retval)
 {
@@ -37,19 +39,12 @@ int sys_open(userptr_t filename, int flags, int *retval)
 	struct vnode *vn;
 
 	if ((result = vfs_open(path, flags, 0, &vn))) {
-		kfree(vn);
 		return result;
 	}
 
-	int fd = find_available_fdesc();
-	if (fd < 0) {
-		kfree(vn);
-		return EMFILE;
-	}
-
 	struct fdesc *pfd = fdesc_create(vn, path, flags);
 	if (pfd == NULL) {
-		kfree(vn);
+		vfs_close(vn);
 		return ENOMEM;
 	}
 	pfd->fd_vnode = vn;
@@ -65,7 +60,12 @@ int sys_open(userptr_t filename, int flags, int *retval)
 			lock_release(pfd->fd_lock);
 		}
 	}
-	curproc->p_fdtable->fdt_descs[fd] = pfd;
+
+	int fd;
+	if ((result = fdtable_add(curproc->p_fdtable, pfd, &fd))) {
+		release_fdesc(pfd);
+		return result;
+	}
 	*retval = fd;
 
 	return 0;
@@ -74,82 +74,257 @@ int sys_open(userptr_t filename, int flags, int *retval)
 int sys_close(int fd, int *retval)
 {
 	*retval = -1;
-	int result;
-	if ((result = validate_fdesc(fd))) {
-		return result;
+	struct fdesc *fdsc = fdtable_remove(curproc->p_fdtable, fd);
+	if (fdsc == NULL) {
+		return EBADF;
 	}
-	struct fdesc *fdsc = curproc->p_fdtable->fdt_descs[fd];
 	release_fdesc(fdsc);
-	curproc->p_fdtable->fdt_descs[fd] = NULL;
 	*retval = 0;
 	return 0;
 }
 
 
-int sys_read(int fd, const_userptr_t buff, size_t buflen, int *retval)
+/*
+ * The guts of all the read and write calls: transfer between FD and the
+ * user buffers in IOV. With POS negative, the transfer is at the fd's
+ * offset, which is advanced, under fd_lock. Otherwise it's at POS, and
+ * neither the offset nor fd_lock is touched; that only makes sense on
+ * something seekable.
+ */
+static
+int
+file_rw(int fd, struct iovec *iov, unsigned iovcnt, off_t pos,
+	enum uio_rw rw, int *retval)
 {
-	*retval = -1;
+	struct fdesc *fdsc;
+	struct uio u;
+	size_t total;
+	unsigned i;
+	int how;
 	int result;
-	if ((result = validate_fdesc(fd))) {
+
+	*retval = -1;
+
+	total = 0;
+	for (i=0; i<iovcnt; i++) {
+		/* The count has to fit in the (signed) return value. */
+		if (iov[i].iov_len > (size_t)0x7fffffff - total) {
+			return EINVAL;
+		}
+		total += iov[i].iov_len;
+	}
+
+	if ((result = fdtable_get(curproc->p_fdtable, fd, &fdsc))) {
 		return result;
 	}
 
-	struct fdesc *fdsc = curproc->p_fdtable->fdt_descs[fd];
-	if (fdsc->fd_flags & O_WRONLY) {
+	how = fdsc->fd_flags & O_ACCMODE;
+	if ((rw == UIO_READ && how == O_WRONLY) ||
+	    (rw == UIO_WRITE && how == O_RDONLY)) {
+		release_fdesc(fdsc);
 		return EBADF;
 	}
+	if (pos >= 0 && !VOP_ISSEEKABLE(fdsc->fd_vnode)) {
+		release_fdesc(fdsc);
+		return ESPIPE;
+	}
 
-	struct iovec iov;
-	struct uio u;
+	u.uio_iov = iov;
+	u.uio_iovcnt = iovcnt;
+	u.uio_resid = total;
+	u.uio_segflg = UIO_USERSPACE;
+	u.uio_rw = rw;
+	u.uio_space = proc_getas();
 
-	lock_acquire(fdsc->fd_lock);
-	uio_uinit(&iov, &u, (userptr_t) buff, buflen, fdsc->fd_offset, UIO_READ);
+	if (pos < 0) {
+		lock_acquire(fdsc->fd_lock);
+		u.uio_offset = fdsc->fd_offset;
+	}
+	else {
+		u.uio_offset = pos;
+	}
 
-	result = VOP_READ(fdsc->fd_vnode, &u);
-	if (result) {
+	if (rw == UIO_READ) {
+		result = VOP_READ(fdsc->fd_vnode, &u);
+	}
+	else {
+		result = VOP_WRITE(fdsc->fd_vnode, &u);
+	}
+
+	if (pos < 0) {
+		if (!result) {
+			fdsc->fd_offset = u.uio_offset;
+		}
 		lock_release(fdsc->fd_lock);
+	}
+	release_fdesc(fdsc);
+	if (result) {
 		return result;
 	}
 
-	fdsc->fd_offset = u.uio_offset;
-	lock_release(fdsc->fd_lock);
-
-	*retval = buflen - u.uio_resid;
+	*retval = total - u.uio_resid;
 	return 0;
 }
 
-
-int sys_write(int fd, const_userptr_t buff, size_t nbytes, int *retval)
+/*
+ * Vectored versions: bring in the user's iovec array first.
+ */
+static
+int
+file_rwv(int fd, const_userptr_t uiov, int iovcnt, off_t pos,
+	 enum uio_rw rw, int *retval)
 {
-	*retval = -1;
+	struct iovec *iov;
 	int result;
-	if ((result = validate_fdesc(fd))) {
+
+	*retval = -1;
+	if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+		return EINVAL;
+	}
+
+	iov = kmalloc(iovcnt * sizeof(*iov));
+	if (iov == NULL) {
+		return ENOMEM;
+	}
+	result = copyin(uiov, iov, iovcnt * sizeof(*iov));
+	if (result) {
+		kfree(iov);
 		return result;
 	}
 
-	struct fdesc *fdsc = curproc->p_fdtable->fdt_descs[fd];
+	result = file_rw(fd, iov, iovcnt, pos, rw, retval);
+	kfree(iov);
+	return result;
+}
+
 
-	if (fdsc->fd_flags == O_RDONLY || fdsc->fd_flags == O_CREAT) {
-		return EBADF;
+int sys_read(int fd, const_userptr_t buff, size_t buflen, int *retval)
+{
+	struct iovec iov;
+
+	iov.iov_ubase = (userptr_t) buff;
+	iov.iov_len = buflen;
+	return file_rw(fd, &iov, 1, -1, UIO_READ, retval);
+}
+
+
+int sys_write(int fd, const_userptr_t buff, size_t nbytes, int *retval)
+{
+	struct iovec iov;
+
+	iov.iov_ubase = (userptr_t) buff;
+	iov.iov_len = nbytes;
+	return file_rw(fd, &iov, 1, -1, UIO_WRITE, retval);
+}
+
+
+int sys_pread(int fd, const_userptr_t buff, size_t buflen, off_t offset,
+	      int *retval)
+{
+	struct iovec iov;
+
+	if (offset < 0) {
+		*retval = -1;
+		return EINVAL;
 	}
+	iov.iov_ubase = (userptr_t) buff;
+	iov.iov_len = buflen;
+	return file_rw(fd, &iov, 1, offset, UIO_READ, retval);
+}
 
+
+int sys_pwrite(int fd, const_userptr_t buff, size_t nbytes, off_t offset,
+	       int *retval)
+{
 	struct iovec iov;
-	struct uio u;
 
-	lock_acquire(fdsc->fd_lock);
-	uio_uinit(&iov, &u, (userptr_t) buff, nbytes, fdsc->fd_offset, UIO_WRITE);
+	if (offset < 0) {
+		*retval = -1;
+		return EINVAL;
+	}
+	iov.iov_ubase = (userptr_t) buff;
+	iov.iov_len = nbytes;
+	return file_rw(fd, &iov, 1, offset, UIO_WRITE, retval);
+}
 
-	result = VOP_WRITE(fdsc->fd_vnode, &u);
-	if (result) {
-		lock_release(fdsc->fd_lock);
+
+int sys_readv(int fd, const_userptr_t iov, int iovcnt, int *retval)
+{
+	return file_rwv(fd, iov, iovcnt, -1, UIO_READ, retval);
+}
+
+
+int sys_writev(int fd, const_userptr_t iov, int iovcnt, int *retval)
+{
+	return file_rwv(fd, iov, iovcnt, -1, UIO_WRITE, retval);
+}
+
+
+int sys_preadv(int fd, const_userptr_t iov, int iovcnt, off_t offset,
+	       int *retval)
+{
+	if (offset < 0) {
+		*retval = -1;
+		return EINVAL;
+	}
+	return file_rwv(fd, iov, iovcnt, offset, UIO_READ, retval);
+}
+
+
+int sys_pwritev(int fd, const_userptr_t iov, int iovcnt, off_t offset,
+		int *retval)
+{
+	if (offset < 0) {
+		*retval = -1;
+		return EINVAL;
+	}
+	return file_rwv(fd, iov, iovcnt, offset, UIO_WRITE, retval);
+}
+
+
+int sys_pipe(userptr_t fds, int *retval)
+{
+	*retval = -1;
+	int result;
+	int kfds[2];
+	struct vnode *rd, *wr;
+	struct fdesc *rfdsc, *wfdsc;
+
+	if ((result = pipe_create(&rd, &wr))) {
 		return result;
 	}
 
-	fdsc->fd_offset = u.uio_offset;
-	lock_release(fdsc->fd_lock);
+	rfdsc = fdesc_create(rd, "pipe", O_RDONLY);
+	if (rfdsc == NULL) {
+		vfs_close(rd);
+		vfs_close(wr);
+		return ENOMEM;
+	}
+	wfdsc = fdesc_create(wr, "pipe", O_WRONLY);
+	if (wfdsc == NULL) {
+		release_fdesc(rfdsc);
+		vfs_close(wr);
+		return ENOMEM;
+	}
 
-	*retval = nbytes - u.uio_resid;
+	if ((result = fdtable_add(curproc->p_fdtable, rfdsc, &kfds[0]))) {
+		release_fdesc(rfdsc);
+		release_fdesc(wfdsc);
+		return result;
+	}
+	if ((result = fdtable_add(curproc->p_fdtable, wfdsc, &kfds[1]))) {
+		release_fdesc(fdtable_remove(curproc->p_fdtable, kfds[0]));
+		release_fdesc(wfdsc);
+		return result;
+	}
 
+	if ((result = copyout(kfds, fds, sizeof(kfds)))) {
+		release_fdesc(fdtable_remove(curproc->p_fdtable, kfds[0]));
+		release_fdesc(fdtable_remove(curproc->p_fdtable, kfds[1]));
+		return result;
+	}
+
+	*retval = 0;
 	return 0;
 }
 
@@ -158,27 +333,28 @@ int sys_dup2(int oldfd, int newfd, int *retval)
 {
 	*retval = -1;
 	int result;
-	if ((result = validate_fdesc(oldfd))) {
+	struct fdesc *old_fdsc, *new_fdsc;
+	if ((result = fdtable_get(curproc->p_fdtable, oldfd, &old_fdsc))) {
 		return result;
 	}
 	if (newfd < 0 || newfd >= OPEN_MAX) {
+		release_fdesc(old_fdsc);
 		return EBADF;
 	}
 	if (oldfd == newfd) {
+		release_fdesc(old_fdsc);
 		*retval = oldfd;
 		return 0;
 	}
-	struct fdesc *old_fdsc = curproc->p_fdtable->fdt_descs[oldfd];
-	struct fdesc *new_fdsc = curproc->p_fdtable->fdt_descs[newfd];
+
+	/* Our reference from fdtable_get goes to the table. */
+	if ((result = fdtable_set(curproc->p_fdtable, newfd, old_fdsc, &new_fdsc))) {
+		release_fdesc(old_fdsc);
+		return result;
+	}
 	if (new_fdsc != NULL) {
-		sys_close(newfd, &result);
+		release_fdesc(new_fdsc);
 	}
-	new_fdsc = old_fdsc;
-
-	lock_acquire(new_fdsc->fd_lock);
-	new_fdsc->fd_ref_count++;
-	curproc->p_fdtable->fdt_descs[newfd] = new_fdsc;
-	lock_release(new_fdsc->fd_lock);
 
 	*retval = newfd;
 	return 0;
@@ -188,12 +364,13 @@ int sys_lseek(int fd, off_t pos, int whence, off_t *retval)
 {
 	*retval = -1;
 	int result;
-	if ((result = validate_fdesc(fd))) {
+	struct fdesc *fdsc;
+	if ((result = fdtable_get(curproc->p_fdtable, fd, &fdsc))) {
 		return result;
 	}
 
-	struct fdesc *fdsc = curproc->p_fdtable->fdt_descs[fd];
 	if (!VOP_ISSEEKABLE(fdsc->fd_vnode)) {
+		release_fdesc(fdsc);
 		return ESPIPE;
 	}
 	lock_acquire(fdsc->fd_lock);
@@ -209,6 +386,8 @@ int sys_lseek(int fd, off_t pos, int whence, off_t *retval)
 		case SEEK_END: {
 			struct stat s;
 			if ((result = VOP_STAT(fdsc->fd_vnode, &s))) {
+				lock_release(fdsc->fd_lock);
+				release_fdesc(fdsc);
 				return result;
 			} else {
 				*retval = pos + s.st_size;
@@ -217,17 +396,20 @@ int sys_lseek(int fd, off_t pos, int whence, off_t *retval)
 		}
 		default: {
 			lock_release(fdsc->fd_lock);
+			release_fdesc(fdsc);
 			return EINVAL;
 		}
 	}
 
 	if (*retval < 0) {
 		lock_release(fdsc->fd_lock);
+		release_fdesc(fdsc);
 		return EINVAL;
 	}
 
 	fdsc->fd_offset = *retval;
 	lock_release(fdsc->fd_lock);
+	release_fdesc(fdsc);
 
 	return 0;
 }
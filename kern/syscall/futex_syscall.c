@@ -0,0 +1,239 @@
+/*
+ * futex: sleep and wake on a word of user memory.
+ *
+ * This is what lets user-level locks stay in userland when they aren't
+ * contended: the lock word is manipulated with atomic instructions,
+ * and the kernel is only asked to put a thread to sleep (FUTEX_WAIT)
+ * or wake one up (FUTEX_WAKE) when somebody actually has to wait.
+ *
+ * Sleepers are found by (address space, user address). Those keys
+ * hash into a fixed table of buckets; each bucket has a sleep lock and
+ * a short list of queues, one per key that currently has sleepers.
+ * A queue is made by the first sleeper and freed by the last one.
+ *
+ * The user word is read with the bucket lock held, and wakers take the
+ * same lock, so a wakeup can't slip in between a waiter checking the
+ * word and going to sleep.
+ *
+ * When a multithreaded process exits, futex_wakeall kicks its sleepers
+ * out so they can leave too.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/futex.h>
+#include <lib.h>
+#include <synch.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/* Number of buckets. A power of 2. */
+#define FUTEX_HASHSIZE 64
+
+struct futexq {
+	struct futexq *fq_next;		/* Next queue in bucket */
+	struct addrspace *fq_as;	/* Key: address space */
+	vaddr_t fq_addr;		/* Key: user address */
+	struct cv *fq_cv;		/* Where the sleepers sleep */
+	unsigned fq_waiters;		/* Threads sleeping here */
+	unsigned fq_wakeups;		/* Wakeups not yet taken */
+};
+
+struct futexbucket {
+	struct lock *fb_lock;
+	struct futexq *fb_queues;
+};
+
+static struct futexbucket futex_table[FUTEX_HASHSIZE];
+
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_HASHSIZE; i++) {
+		futex_table[i].fb_lock = lock_create("futex");
+		if (futex_table[i].fb_lock == NULL) {
+			panic("futex_bootstrap: lock_create failed\n");
+		}
+		futex_table[i].fb_queues = NULL;
+	}
+}
+
+static
+struct futexbucket *
+futex_bucket(struct addrspace *as, vaddr_t addr)
+{
+	uint32_t h;
+
+	/* The words are aligned; the low bits of both carry nothing. */
+	h = (addr >> 2) ^ ((uintptr_t)as >> 4);
+	h *= 0x9e3779b1;
+	return &futex_table[(h >> 16) % FUTEX_HASHSIZE];
+}
+
+/*
+ * Find the queue for a key in a bucket. The bucket must be locked.
+ */
+static
+struct futexq *
+futexq_find(struct futexbucket *fb, struct addrspace *as, vaddr_t addr)
+{
+	struct futexq *fq;
+
+	for (fq = fb->fb_queues; fq != NULL; fq = fq->fq_next) {
+		if (fq->fq_as == as && fq->fq_addr == addr) {
+			return fq;
+		}
+	}
+	return NULL;
+}
+
+static
+int
+futex_wait(struct futexbucket *fb, struct addrspace *as, vaddr_t addr,
+	   int val)
+{
+	struct futexq *fq, **fqp;
+	int cur;
+	int result;
+
+	lock_acquire(fb->fb_lock);
+
+	result = copyin((const_userptr_t)addr, &cur, sizeof(cur));
+	if (result) {
+		lock_release(fb->fb_lock);
+		return result;
+	}
+	if (cur != val) {
+		lock_release(fb->fb_lock);
+		return EAGAIN;
+	}
+
+	fq = futexq_find(fb, as, addr);
+	if (fq == NULL) {
+		fq = kmalloc(sizeof(*fq));
+		if (fq == NULL) {
+			lock_release(fb->fb_lock);
+			return ENOMEM;
+		}
+		fq->fq_cv = cv_create("futex");
+		if (fq->fq_cv == NULL) {
+			kfree(fq);
+			lock_release(fb->fb_lock);
+			return ENOMEM;
+		}
+		fq->fq_as = as;
+		fq->fq_addr = addr;
+		fq->fq_waiters = 0;
+		fq->fq_wakeups = 0;
+		fq->fq_next = fb->fb_queues;
+		fb->fb_queues = fq;
+	}
+
+	fq->fq_waiters++;
+	while (fq->fq_wakeups == 0 && !curproc->p_exiting) {
+		cv_wait(fq->fq_cv, fb->fb_lock);
+	}
+	if (fq->fq_wakeups > 0) {
+		fq->fq_wakeups--;
+	}
+	else {
+		/* The process is exiting. */
+		result = EINTR;
+	}
+	fq->fq_waiters--;
+
+	if (fq->fq_waiters == 0) {
+		KASSERT(fq->fq_wakeups == 0);
+		for (fqp = &fb->fb_queues; *fqp != fq; fqp = &(*fqp)->fq_next) {
+			KASSERT(*fqp != NULL);
+		}
+		*fqp = fq->fq_next;
+		cv_destroy(fq->fq_cv);
+		kfree(fq);
+	}
+
+	lock_release(fb->fb_lock);
+	return result;
+}
+
+static
+int
+futex_wake(struct futexbucket *fb, struct addrspace *as, vaddr_t addr,
+	   unsigned max, int *retval)
+{
+	struct futexq *fq;
+	unsigned n;
+
+	lock_acquire(fb->fb_lock);
+
+	n = 0;
+	fq = futexq_find(fb, as, addr);
+	if (fq != NULL) {
+		/* Don't count the ones already woken but not yet out. */
+		while (n < max && fq->fq_wakeups < fq->fq_waiters) {
+			fq->fq_wakeups++;
+			cv_signal(fq->fq_cv, fb->fb_lock);
+			n++;
+		}
+	}
+
+	lock_release(fb->fb_lock);
+	*retval = n;
+	return 0;
+}
+
+void
+futex_wakeall(struct addrspace *as)
+{
+	struct futexq *fq;
+	unsigned i;
+
+	if (as == NULL) {
+		return;
+	}
+
+	for (i=0; i<FUTEX_HASHSIZE; i++) {
+		lock_acquire(futex_table[i].fb_lock);
+		for (fq = futex_table[i].fb_queues; fq != NULL;
+		     fq = fq->fq_next) {
+			if (fq->fq_as == as) {
+				cv_broadcast(fq->fq_cv, futex_table[i].fb_lock);
+			}
+		}
+		lock_release(futex_table[i].fb_lock);
+	}
+}
+
+int
+sys_futex(userptr_t uaddr, int op, int val, int *retval)
+{
+	struct addrspace *as;
+	struct futexbucket *fb;
+	vaddr_t addr;
+
+	*retval = 0;
+	addr = (vaddr_t)uaddr;
+	if (addr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+
+	as = proc_getas();
+	KASSERT(as != NULL);
+	fb = futex_bucket(as, addr);
+
+	switch (op) {
+	    case FUTEX_WAIT:
+		return futex_wait(fb, as, addr, val);
+	    case FUTEX_WAKE:
+		if (val < 0) {
+			return EINVAL;
+		}
+		return futex_wake(fb, as, addr, val, retval);
+	}
+	return EINVAL;
+}
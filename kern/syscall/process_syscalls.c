@@ -89,11 +89,72 @@ int sys_fork(struct trapframe *tf, pid_t *retval)
 	return 0;
 }
 
+static void thread_entry(void *data1, unsigned long data2)
+{
+	struct trapframe ctf = *(struct trapframe *) data1;
+	kfree(data1);
+	curthread->t_tid = (int) data2;
+	enter_new_thread(&ctf);
+}
+
+int sys___thread_create(struct trapframe *tf, int *retval)
+{
+	*retval = -1;
+	int result, tid;
+
+	struct trapframe *ktf = kmalloc(sizeof(struct trapframe));
+	if (ktf == NULL) {
+		return ENOMEM;
+	}
+	*ktf = *tf;
+
+	if ((result = proc_thread_add(&tid))) {
+		kfree(ktf);
+		return result;
+	}
+	if ((result = thread_fork(curproc->p_name, curproc, thread_entry, ktf, tid))) {
+		kfree(ktf);
+		proc_thread_remove(tid);
+		return result;
+	}
+	*retval = tid;
+	return 0;
+}
+
+void sys_thread_exit(int code)
+{
+	proc_thread_exit(code);
+}
+
+int sys_thread_join(int tid, userptr_t code, int *retval)
+{
+	*retval = -1;
+	int result, exitcode;
+
+	if ((result = proc_thread_join(tid, &exitcode))) {
+		return result;
+	}
+	if (code != NULL && (result = copyout(&exitcode, code, sizeof(int)))) {
+		return result;
+	}
+	*retval = 0;
+	return 0;
+}
+
 int sys_execv(userptr_t program, userptr_t args, int *retval)
 {
 	*retval = -1;
 	int result;
 	char *pad_null = NULL;
+
+	/* The other threads would be left running in the old image. */
+	lock_acquire(curproc->p_tlock);
+	if (curproc->p_nlive > 1) {
+		lock_release(curproc->p_tlock);
+		return EBUSY;
+	}
+	lock_release(curproc->p_tlock);
+
 	char *path = kmalloc(PATH_MAX);
 	size_t actual;
 
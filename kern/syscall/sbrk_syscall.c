@@ -5,8 +5,9 @@
 #include <current.h>
 #include <addrspace.h>
 #include <kern/errno.h>
-#include <mips/tlb.h>
-#include <spl.h>
+#include <cpu.h>
+#include <vm.h>
+#include <synch.h>
 
 int sys_sbrk(intptr_t amount, int *retval)
 {
@@ -15,43 +16,57 @@ int sys_sbrk(intptr_t amount, int *retval)
 	KASSERT(as != NULL);
 	KASSERT(as->heap != NULL);
 
+	/* Other threads may be faulting in or moving the heap too. */
+	lock_acquire(as->as_lock);
+
 	if (amount == 0) {
 		*retval = as->heap->vend;
+		lock_release(as->as_lock);
 		return 0;
 	}
 
 	vaddr_t new_heap_vend = (as->heap->vend + (vaddr_t) amount) & PAGE_FRAME;
 
 	if (new_heap_vend < as->heap->vstart || (amount <= (-4096 * 1024 * 256))) { // TODO: replace magic number!
+		lock_release(as->as_lock);
 		return EINVAL;
 	}
 	if (new_heap_vend >= (USERSTACK - STACKPAGES * PAGE_SIZE) || new_heap_vend > USERSPACETOP) {
+		lock_release(as->as_lock);
 		return ENOMEM;
 	}
 
 	if (new_heap_vend < as->heap->vend) {
+		/*
+		 * Unmap the pages a batch at a time. Other threads of
+		 * this process may have them in other cpus' TLBs, so
+		 * shoot those down and wait before freeing the frames.
+		 */
+		struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+		paddr_t frames[TLBSHOOTDOWN_MAX];
+		unsigned n = 0;
 		int size = ((as->heap->vend - new_heap_vend) & PAGE_FRAME) / PAGE_SIZE;
 		for (int j = 0; j < size; ++j) {
 			vaddr_t free = new_heap_vend + j * PAGE_SIZE;
 			struct page_table_entry *pte = find_pte(as->pt_dir, free);
-			if (pte != NULL) {
-				if (pte->valid) {
-					vaddr_t pvaddr = PADDR_TO_KVADDR(pte->pbase);
-					free_kpages(pvaddr);
-					pte->valid = 0;
-					pte->pbase = 0;
-//					vm_tlbshootdown_all();
-					int spl = splhigh();
-					int i = tlb_probe(free, 0);
-					if (i >= 0) {
-						tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-					}
-					splx(spl);
+			if (pte != NULL && pte->valid) {
+				ts[n].ts_vaddr = free;
+				frames[n] = pte->pbase;
+				n++;
+				pte->valid = 0;
+				pte->pbase = 0;
+			}
+			if (n == TLBSHOOTDOWN_MAX || (n > 0 && j == size - 1)) {
+				ipi_tlbshootdown_wait(ts, n);
+				for (unsigned k = 0; k < n; k++) {
+					free_kpages(PADDR_TO_KVADDR(frames[k]));
 				}
+				n = 0;
 			}
 		}
 	}
 	*retval = as->heap->vend;
 	as->heap->vend = new_heap_vend;
+	lock_release(as->as_lock);
 	return 0;
 }
\ No newline at end of file
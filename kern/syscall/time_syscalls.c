@@ -28,7 +28,9 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <clock.h>
+#include <timeout.h>
 #include <copyinout.h>
 #include <syscall.h>
 
@@ -56,3 +58,30 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Sleep for the requested interval. There are no signals, so the only
+ * thing that can cut the sleep short is the process exiting, and then
+ * nobody is going to look at REM; it's left alone.
+ */
+int
+sys_nanosleep(const_userptr_t user_req, userptr_t user_rem)
+{
+	struct timespec req, deadline;
+	int result;
+
+	(void)user_rem;
+
+	result = copyin(user_req, &req, sizeof(req));
+	if (result) {
+		return result;
+	}
+
+	if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	gettime(&deadline);
+	timespec_add(&deadline, &req, &deadline);
+	return timeout_sleepuntil(&deadline);
+}
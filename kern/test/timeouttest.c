@@ -0,0 +1,171 @@
+/*
+ * Timeout tests.
+ *
+ * tot1 checks that timeouts go off in deadline order, never early,
+ * and that cancelled ones don't go off at all. tot2 checks that
+ * timeout_sleepuntil doesn't come back early, across intervals that
+ * land on different levels of the wheel.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <timeout.h>
+#include <test.h>
+
+#define NTIMEOUTS 16
+
+static struct semaphore *tot_sem;
+static struct timespec tot_deadlines[NTIMEOUTS];
+static volatile unsigned tot_order[NTIMEOUTS];
+static volatile unsigned tot_fired;
+static volatile bool tot_early;
+
+static
+void
+tot_callback(void *arg)
+{
+	unsigned n = (uintptr_t)arg;
+	struct timespec now;
+
+	gettime(&now);
+	if (now.tv_sec < tot_deadlines[n].tv_sec ||
+	    (now.tv_sec == tot_deadlines[n].tv_sec &&
+	     now.tv_nsec < tot_deadlines[n].tv_nsec)) {
+		tot_early = true;
+	}
+	tot_order[tot_fired++] = n;
+	V(tot_sem);
+}
+
+/*
+ * Deadline of timeout N, as an offset from the start: shuffled so they
+ * aren't added in order, spread from 1ms to 1.5s.
+ */
+static
+void
+tot_offset(unsigned n, struct timespec *ts)
+{
+	unsigned ms;
+
+	ms = 1 + ((n * 7) % NTIMEOUTS) * 100;
+	ts->tv_sec = ms / 1000;
+	ts->tv_nsec = (ms % 1000) * 1000000;
+}
+
+int
+timeouttest(int nargs, char **args)
+{
+	struct timeout tos[NTIMEOUTS];
+	struct timespec start, offset;
+	unsigned i, prev;
+	bool ok;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting timeout test...\n");
+
+	tot_sem = sem_create("timeouttest", 0);
+	if (tot_sem == NULL) {
+		panic("timeouttest: sem_create failed\n");
+	}
+	tot_fired = 0;
+	tot_early = false;
+
+	gettime(&start);
+	for (i=0; i<NTIMEOUTS; i++) {
+		tot_offset(i, &offset);
+		timespec_add(&start, &offset, &tot_deadlines[i]);
+		timeout_init(&tos[i], tot_callback, (void *)(uintptr_t)i);
+		timeout_add(&tos[i], &tot_deadlines[i]);
+	}
+
+	/* Cancel the odd ones. */
+	for (i=1; i<NTIMEOUTS; i+=2) {
+		if (!timeout_cancel(&tos[i])) {
+			panic("timeouttest: timeout %u went off too soon\n", i);
+		}
+	}
+
+	for (i=0; i<NTIMEOUTS; i+=2) {
+		P(tot_sem);
+	}
+
+	/* Give any stray cancelled ones a chance to show up. */
+	clocksleep(2);
+
+	ok = true;
+	if (tot_early) {
+		kprintf("timeouttest: a timeout went off early\n");
+		ok = false;
+	}
+	if (tot_fired != NTIMEOUTS / 2) {
+		kprintf("timeouttest: %u timeouts went off; expected %u\n",
+			tot_fired, NTIMEOUTS / 2);
+		ok = false;
+	}
+	for (i=1; i<tot_fired && ok; i++) {
+		prev = tot_order[i-1];
+		if (tot_deadlines[tot_order[i]].tv_sec <
+		    tot_deadlines[prev].tv_sec ||
+		    (tot_deadlines[tot_order[i]].tv_sec ==
+		     tot_deadlines[prev].tv_sec &&
+		     tot_deadlines[tot_order[i]].tv_nsec <
+		     tot_deadlines[prev].tv_nsec)) {
+			kprintf("timeouttest: timeout %u went off before %u\n",
+				tot_order[i], prev);
+			ok = false;
+		}
+	}
+
+	sem_destroy(tot_sem);
+	tot_sem = NULL;
+
+	kprintf("Timeout test %s\n", ok ? "done." : "FAILED.");
+	return ok ? 0 : 1;
+}
+
+int
+timeouttest2(int nargs, char **args)
+{
+	static const uint32_t usecs[] = {
+		50, 150, 1000, 3300, 20000, 105000, 700000,
+	};
+	struct timespec start, offset, deadline, now, late;
+	unsigned i;
+	bool ok;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting timeout sleep test...\n");
+
+	ok = true;
+	for (i=0; i<sizeof(usecs)/sizeof(usecs[0]); i++) {
+		offset.tv_sec = 0;
+		offset.tv_nsec = usecs[i] * 1000;
+
+		gettime(&start);
+		timespec_add(&start, &offset, &deadline);
+		timeout_sleepuntil(&deadline);
+		gettime(&now);
+
+		if (now.tv_sec < deadline.tv_sec ||
+		    (now.tv_sec == deadline.tv_sec &&
+		     now.tv_nsec < deadline.tv_nsec)) {
+			kprintf("timeouttest2: %u usec sleep came back early\n",
+				(unsigned)usecs[i]);
+			ok = false;
+			continue;
+		}
+		timespec_sub(&now, &deadline, &late);
+		kprintf("  %7u usec sleep: %lu.%09lu late\n",
+			(unsigned)usecs[i], (unsigned long)late.tv_sec,
+			(unsigned long)late.tv_nsec);
+	}
+
+	kprintf("Timeout sleep test %s\n", ok ? "done." : "FAILED.");
+	return ok ? 0 : 1;
+}
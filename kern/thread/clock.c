@@ -28,12 +28,15 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <mainbus.h>
 
 /*
  * Time handling.
@@ -53,6 +56,12 @@
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
+/*
+ * Hardclock rate and mode. See clock.h.
+ */
+unsigned hz = HZ;
+bool hardclock_tickless = true;
+
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
  */
@@ -86,24 +95,141 @@ timerclock(void)
 }
 
 /*
- * This is called HZ times a second (on each processor) by the timer
- * code.
+ * Figure out how many hardclocks from now the current cpu next needs
+ * to be interrupted. Zero means not at all.
+ *
+ * Without tickless mode, always every hardclock. Otherwise, an idle
+ * cpu doesn't need any; it'll be woken by an interrupt (an IPI, if
+ * somebody gives it a thread) and come back here. A cpu with threads
+ * waiting on its run queue needs one at the end of the current
+ * quantum. A cpu running the only thread it has can let it run; but
+ * don't go longer than a second, so the hardclock bookkeeping still
+ * ticks over now and then. If another thread gets queued here in the
+ * meantime, whoever queued it sends an IPI and we come back here to
+ * cut the wait short.
+ */
+static
+unsigned
+hardclock_wanted(void)
+{
+	if (!hardclock_tickless) {
+		return 1;
+	}
+	if (curcpu->c_isidle) {
+		return 0;
+	}
+	if (!threadlist_isempty(&curcpu->c_runqueue)) {
+		return 1;
+	}
+	return hz;
+}
+
+/*
+ * Reprogram the current cpu's timer, if what it ought to be doing has
+ * changed. Leave it alone otherwise, so as not to restart the current
+ * quantum on every context switch.
+ *
+ * c_timerticks is protected by the run queue lock so that other cpus
+ * queueing threads here can tell reliably whether they need to send
+ * an IPI to get us to notice.
+ */
+void
+hardclock_reload(void)
+{
+	unsigned nticks;
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	nticks = hardclock_wanted();
+	if (nticks != curcpu->c_timerticks) {
+		curcpu->c_timerticks = nticks;
+		mainbus_settimer(nticks);
+	}
+}
+
+/*
+ * Change hz. Each cpu picks up the new rate the next time it
+ * reprograms its timer.
+ */
+int
+hardclock_sethz(unsigned newhz)
+{
+	if (newhz < HZ_MIN || newhz > HZ_MAX) {
+		return EINVAL;
+	}
+	hz = newhz;
+	return 0;
+}
+
+/*
+ * Turn tickless mode on or off. Every cpu's timer has to be redone to
+ * match: this one directly, the others by poking them with an IPI,
+ * which makes them call hardclock_reload.
+ */
+void
+hardclock_settickless(bool tickless)
+{
+	hardclock_tickless = tickless;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	hardclock_reload();
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	ipi_broadcast(IPI_UNIDLE);
+}
+
+/*
+ * This is called by the timer code when the current cpu's timer goes
+ * off: ordinarily hz times a second (on each processor), but see
+ * above. Note that a single call may stand in for several hardclocks'
+ * worth of time, or for none if the timer was reprogrammed to fire
+ * early, so the periodic jobs below run whenever a multiple of their
+ * period has gone by.
  */
 void
 hardclock(void)
 {
+	unsigned then, now;
+
 	/*
 	 * Collect statistics here as desired.
 	 */
 
-	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
+	/*
+	 * Count what's actually gone by rather than what the timer
+	 * was set for: in tickless mode a single interrupt may stand
+	 * in for many periods, and whenever the timer is reprogrammed
+	 * partway through a period (by hardclock_reload, or on an
+	 * IPI) the next interrupt comes later than first planned.
+	 */
+	then = curcpu->c_hardclocks;
+	now = then + mainbus_timerelapsed();
+	curcpu->c_hardclocks = now;
+
+	/*
+	 * Set up the next interrupt. This must always rewrite the
+	 * timer, as that's what acknowledges the interrupt.
+	 */
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	curcpu->c_timerticks = hardclock_wanted();
+	mainbus_settimer(curcpu->c_timerticks);
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (then / MIGRATE_HARDCLOCKS != now / MIGRATE_HARDCLOCKS) {
 		thread_consider_migration();
 	}
-	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
+	if (then / SCHEDULE_HARDCLOCKS != now / SCHEDULE_HARDCLOCKS) {
 		schedule();
 	}
-	thread_yield();
+
+	/*
+	 * Ask the trap code to yield on the way out, after it's run
+	 * whatever softints this interrupt queued (at spl0). Yielding
+	 * here would leave them until we got back, or until the next
+	 * interrupt or idle spell, which for the disk is up to a
+	 * quantum of latency per request.
+	 */
+	curcpu->c_yieldpending = true;
 }
 
 /*
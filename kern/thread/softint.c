@@ -0,0 +1,113 @@
+/*
+ * Software interrupts. See softint.h.
+ *
+ * Each cpu's queue is a singly-linked stack, c_softints. Pushing is a
+ * compare-and-swap on the head. The cpu empties it by swapping the
+ * head for NULL and then reverses what it got, so things run in the
+ * order they were queued. Since nothing is ever popped singly there's
+ * no ABA problem.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <atomic.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <spl.h>
+#include <softint.h>
+
+void
+softint_init(struct softint *si, void (*func)(void *), void *arg)
+{
+	si->si_next = NULL;
+	si->si_pending = 0;
+	si->si_func = func;
+	si->si_arg = arg;
+}
+
+void
+softint_schedule(struct softint *si)
+{
+	struct cpu *c;
+	void *head;
+	int spl;
+
+	if (atomic_cas(&si->si_pending, 0, 1) != 0) {
+		/* Already queued. */
+		return;
+	}
+
+	/* Stay on one cpu while reading curcpu and pushing. */
+	spl = splhigh();
+	c = curcpu->c_self;
+	do {
+		head = c->c_softints;
+		si->si_next = head;
+	} while (atomic_casptr(&c->c_softints, head, si) != head);
+	splx(spl);
+
+	if (curthread->t_in_interrupt || spl != 0) {
+		/* The interrupt return or spl0 path will get to it. */
+		return;
+	}
+
+	/*
+	 * No interrupt return coming to do it for us, so run it now,
+	 * at spl0. If we've been moved to another cpu since the push,
+	 * poke the old one instead; the IPI's return (or its idle
+	 * loop) runs the queue.
+	 */
+	if (c != curcpu->c_self) {
+		ipi_send(c, IPI_UNIDLE);
+		return;
+	}
+	softint_run();
+}
+
+void
+softint_run(void)
+{
+	struct softint *list, *si, *next, *prev;
+	struct cpu *c;
+	bool old_in;
+	void *head;
+	int spl;
+
+	/* Softints count as interrupt handlers; they mustn't sleep. */
+	old_in = curthread->t_in_interrupt;
+	curthread->t_in_interrupt = true;
+
+	for (;;) {
+		/* Take the whole queue, all from the same cpu. */
+		spl = splhigh();
+		c = curcpu->c_self;
+		do {
+			head = c->c_softints;
+		} while (head != NULL &&
+			 atomic_casptr(&c->c_softints, head, NULL) != head);
+		splx(spl);
+		if (head == NULL) {
+			break;
+		}
+
+		/* It's newest first; turn it around. */
+		prev = NULL;
+		for (si = head; si != NULL; si = next) {
+			next = si->si_next;
+			si->si_next = prev;
+			prev = si;
+		}
+		list = prev;
+
+		for (si = list; si != NULL; si = next) {
+			next = si->si_next;
+			si->si_next = NULL;
+			/* Clear first, so the function can requeue it. */
+			atomic_cas(&si->si_pending, 1, 0);
+			si->si_func(si->si_arg);
+		}
+	}
+
+	curthread->t_in_interrupt = old_in;
+}
@@ -30,6 +30,7 @@
 /* Make sure to build out-of-line versions of inline functions */
 #define SPINLOCK_INLINE   /* empty */
 #define MEMBAR_INLINE     /* empty */
+#define ATOMIC_INLINE     /* empty */
 
 #include <types.h>
 #include <lib.h>
@@ -37,12 +38,70 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <membar.h>
+#include <atomic.h>
 #include <current.h>	/* for curcpu */
 
 /*
  * Spinlocks.
  */
 
+/*
+ * Locks that have ever been contended, for spinlock_dumpstats. Slots
+ * are claimed with atomic_cas rather than under a lock, since we get
+ * here from inside spinlock_acquire. Entries come out again in
+ * spinlock_cleanup, under spinlock_listlock; spinlock_dumpstats holds
+ * that while it looks at the listed locks, so none of them can be
+ * destroyed and freed out from under it.
+ */
+#define SPINLOCK_NLISTED 128
+
+static volatile unsigned spinlock_listed[SPINLOCK_NLISTED];
+static struct spinlock spinlock_listlock = SPINLOCK_INITIALIZER;
+
+/* What spinlock_dumpstats copies out of each lock. */
+struct spinlock_stats {
+	struct spinlock *ss_lock;
+	vaddr_t ss_where;
+	unsigned ss_acquires;
+	unsigned ss_contended;
+	uint64_t ss_spincycles;
+};
+
+static
+void
+spinlock_list(struct spinlock *splk)
+{
+	unsigned i;
+
+	splk->splk_listed = true;
+
+	/* A lock that was re-initialized may still be listed. */
+	for (i=0; i<SPINLOCK_NLISTED; i++) {
+		if (spinlock_listed[i] == (uintptr_t)splk) {
+			return;
+		}
+	}
+	for (i=0; i<SPINLOCK_NLISTED; i++) {
+		if (atomic_cas(&spinlock_listed[i], 0, (uintptr_t)splk) == 0) {
+			return;
+		}
+	}
+	/* Full; this one just doesn't get reported. */
+}
+
+static
+void
+spinlock_unlist(struct spinlock *splk)
+{
+	unsigned i;
+
+	spinlock_acquire(&spinlock_listlock);
+	for (i=0; i<SPINLOCK_NLISTED; i++) {
+		atomic_cas(&spinlock_listed[i], (uintptr_t)splk, 0);
+	}
+	spinlock_release(&spinlock_listlock);
+	splk->splk_listed = false;
+}
 
 /*
  * Initialize spinlock.
@@ -50,8 +109,14 @@
 void
 spinlock_init(struct spinlock *splk)
 {
-	spinlock_data_set(&splk->splk_lock, 0);
+	splk->splk_next = 0;
+	splk->splk_serving = 0;
 	splk->splk_holder = NULL;
+	splk->splk_acquires = 0;
+	splk->splk_contended = 0;
+	splk->splk_spincycles = 0;
+	splk->splk_where = 0;
+	splk->splk_listed = false;
 }
 
 /*
@@ -61,20 +126,25 @@ void
 spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
-	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	KASSERT(splk->splk_next == splk->splk_serving);
+	if (splk->splk_listed) {
+		spinlock_unlist(splk);
+	}
 }
 
 /*
  * Get the lock.
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
- * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * might come back to this lock and deadlock), then take a ticket and
+ * wait for it to come up.
  */
 void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	unsigned ticket;
+	uint32_t start, spun;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -90,28 +160,34 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
+	/*
+	 * atomic_add hands back the incremented value, so our ticket
+	 * is one less. Spinning only reads splk_serving, so waiters
+	 * don't fight over the cache line the way test-and-set does.
+	 */
+	ticket = atomic_add(&splk->splk_next, 1) - 1;
+	spun = 0;
+	if (splk->splk_serving != ticket) {
+		start = spinlock_cycles();
+		while (splk->splk_serving != ticket) {
+			/* spin */
 		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
-		}
-		break;
+		spun = spinlock_cycles() - start;
 	}
 
 	membar_store_any();
 	splk->splk_holder = mycpu;
+
+	splk->splk_acquires++;
+	if (spun > 0) {
+		splk->splk_contended++;
+		splk->splk_spincycles += spun;
+		if (!splk->splk_listed) {
+			splk->splk_where =
+				(vaddr_t)__builtin_return_address(0);
+			spinlock_list(splk);
+		}
+	}
 }
 
 /*
@@ -129,7 +205,8 @@ spinlock_release(struct spinlock *splk)
 
 	splk->splk_holder = NULL;
 	membar_any_store();
-	spinlock_data_set(&splk->splk_lock, 0);
+	/* Only the holder writes splk_serving, so this needn't be atomic. */
+	splk->splk_serving = splk->splk_serving + 1;
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -146,3 +223,61 @@ spinlock_do_i_hold(struct spinlock *splk)
 	/* Assume we can read splk_holder atomically enough for this to work */
 	return (splk->splk_holder == curcpu->c_self);
 }
+
+/*
+ * Print the most contended locks, worst first. The numbers are copied
+ * out under spinlock_listlock (but not the locks themselves), so they
+ * may be a little stale; printing is done from the copy afterwards.
+ */
+void
+spinlock_dumpstats(unsigned max)
+{
+	struct spinlock_stats *top, ss;
+	struct spinlock *splk;
+	unsigned i, j, n;
+
+	top = kmalloc(SPINLOCK_NLISTED * sizeof(*top));
+	if (top == NULL) {
+		kprintf("spinlock_dumpstats: Out of memory\n");
+		return;
+	}
+
+	n = 0;
+	spinlock_acquire(&spinlock_listlock);
+	for (i=0; i<SPINLOCK_NLISTED; i++) {
+		splk = (struct spinlock *)spinlock_listed[i];
+		if (splk == NULL) {
+			continue;
+		}
+		ss.ss_lock = splk;
+		ss.ss_where = splk->splk_where;
+		ss.ss_acquires = splk->splk_acquires;
+		ss.ss_contended = splk->splk_contended;
+		ss.ss_spincycles = splk->splk_spincycles;
+		/* insertion sort by number of contended acquires */
+		for (j=n; j>0 && top[j-1].ss_contended < ss.ss_contended;
+		     j--) {
+			top[j] = top[j-1];
+		}
+		top[j] = ss;
+		n++;
+	}
+	spinlock_release(&spinlock_listlock);
+
+	if (max > n) {
+		max = n;
+	}
+
+	kprintf("%-10s %-10s %10s %10s %14s\n",
+		"lock", "first at", "acquires", "contended", "spin cycles");
+	for (i=0; i<max; i++) {
+		kprintf("%p 0x%08x %10u %10u %14llu\n",
+			top[i].ss_lock, top[i].ss_where, top[i].ss_acquires,
+			top[i].ss_contended,
+			(unsigned long long)top[i].ss_spincycles);
+	}
+	if (n == 0) {
+		kprintf("No contended spinlocks.\n");
+	}
+	kfree(top);
+}
@@ -33,12 +33,15 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <atomic.h>
 #include <synch.h>
+#include <proc.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -120,6 +123,48 @@ P(struct semaphore *sem)
 	spinlock_release(&sem->sem_lock);
 }
 
+/*
+ * Process-exit hook for P_intr: get the sleepers to look again.
+ */
+static
+void
+sem_intr(void *vsem)
+{
+	struct semaphore *sem = vsem;
+
+	spinlock_acquire(&sem->sem_lock);
+	wchan_wakeall(sem->sem_wchan, &sem->sem_lock);
+	spinlock_release(&sem->sem_lock);
+}
+
+int
+P_intr(struct semaphore *sem)
+{
+	struct proc_intr pi;
+	int result = 0;
+
+	KASSERT(sem != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	proc_intr_enter(&pi, sem_intr, sem);
+	spinlock_acquire(&sem->sem_lock);
+	while (sem->sem_count == 0) {
+		if (proc_exiting()) {
+			result = EINTR;
+			break;
+		}
+		wchan_sleep(sem->sem_wchan, &sem->sem_lock);
+	}
+	if (result == 0) {
+		KASSERT(sem->sem_count > 0);
+		sem->sem_count--;
+	}
+	spinlock_release(&sem->sem_lock);
+	proc_intr_leave(&pi);
+
+	return result;
+}
+
 void
 V(struct semaphore *sem)
 {
@@ -183,9 +228,38 @@ lock_destroy(struct lock *lock)
 	kfree(lock);
 }
 
+/*
+ * Spin, without lk_lock, while HOLDER still has the lock and is running
+ * on some other cpu, on the theory that it will let go soon and that
+ * watching for that is cheaper than a trip through the scheduler.
+ * Give up after LOCK_SPIN_MAX tries.
+ *
+ * HOLDER can't go away while it holds the lock; once it lets go we
+ * might peek at its t_state one last time, but thread structures
+ * aren't freed until well after the thread stops running, so that's
+ * harmless.
+ */
+#define LOCK_SPIN_MAX	1000
+
+static
+void
+lock_spin(struct lock *lock, volatile struct thread *holder)
+{
+	unsigned i;
+
+	for (i = 0; i < LOCK_SPIN_MAX; i++) {
+		if (lock->lk_holder != holder || holder->t_state != S_RUN) {
+			return;
+		}
+	}
+}
+
 void
 lock_acquire(struct lock *lock)
 {
+	volatile struct thread *holder;
+	bool spun = false;
+
 	KASSERT(lock != NULL);
 
 	/* May not block in an interrupt handler. */
@@ -194,10 +268,24 @@ lock_acquire(struct lock *lock)
 	/* curthread must not be locked already, support Reentrant locking in future? */
 	KASSERT(!lock_do_i_hold(lock));
 
-	/* Sleep on wc until lock becomes available*/
+	/*
+	 * Adaptive: if the holder is running on another cpu, spin
+	 * (once) until it lets go; otherwise sleep on wc until lock
+	 * becomes available.
+	 */
 	spinlock_acquire(&lock->lk_lock);
 
-	while (lock->lk_holder != NULL) {
+	while ((holder = lock->lk_holder) != NULL) {
+		if (!spun && holder->t_state == S_RUN) {
+			spun = true;
+			spinlock_release(&lock->lk_lock);
+			lock_spin(lock, holder);
+			spinlock_acquire(&lock->lk_lock);
+			if (lock->lk_holder != holder) {
+				/* It let go; see if we can have it. */
+				continue;
+			}
+		}
 		wchan_sleep(lock->lk_wchan, &lock->lk_lock);
 	}
 	lock->lk_holder = curthread;
@@ -221,20 +309,17 @@ lock_release(struct lock *lock)
 	spinlock_release(&lock->lk_lock);
 }
 
+/*
+ * No need for lk_lock here: only the current thread can set lk_holder
+ * to itself or clear it while it's set to itself, so whatever we read,
+ * the answer for curthread is right.
+ */
 bool
 lock_do_i_hold(struct lock *lock)
 {
 	KASSERT(lock != NULL);
 
-	bool is_held = false;
-
-	spinlock_acquire(&lock->lk_lock);
-
-	is_held = lock->lk_holder == curthread;
-
-	spinlock_release(&lock->lk_lock);
-
-	return is_held;
+	return lock->lk_holder == curthread;
 }
 
 ////////////////////////////////////////////////////////////
@@ -357,11 +442,26 @@ rwlock_create(const char *name) {
 		return NULL;
 	}
 
-	rwlock->rwlock_cv = cv_create("rwlock_cv");
-	rwlock->rwlock_lock = lock_create("rwlock_lock");
-	rwlock->active_reader_count = 0;
-	rwlock->active_writer_count = 0;
-	rwlock->write_request_count = 0;
+	rwlock->rw_rwchan = wchan_create(rwlock->rwlock_name);
+	if (rwlock->rw_rwchan == NULL) {
+		kfree(rwlock->rwlock_name);
+		kfree(rwlock);
+		return NULL;
+	}
+
+	rwlock->rw_wwchan = wchan_create(rwlock->rwlock_name);
+	if (rwlock->rw_wwchan == NULL) {
+		wchan_destroy(rwlock->rw_rwchan);
+		kfree(rwlock->rwlock_name);
+		kfree(rwlock);
+		return NULL;
+	}
+
+	spinlock_init(&rwlock->rw_lock);
+	rwlock->rw_state = 0;
+	rwlock->rw_wwaiters = 0;
+	rwlock->rw_handoffs = 0;
+	rwlock->rw_writer = NULL;
 
 	return rwlock;
 }
@@ -369,73 +469,184 @@ rwlock_create(const char *name) {
 void
 rwlock_destroy(struct rwlock *rwlock) {
 	KASSERT(rwlock != NULL);
-	KASSERT(rwlock->active_reader_count == 0);
-	KASSERT(rwlock->active_writer_count == 0);
-	KASSERT(rwlock->write_request_count == 0);
+	KASSERT(rwlock->rw_state == 0);
+	KASSERT(rwlock->rw_wwaiters == 0);
 
-	cv_destroy(rwlock->rwlock_cv);
-	lock_destroy(rwlock->rwlock_lock);
+	spinlock_cleanup(&rwlock->rw_lock);
+	wchan_destroy(rwlock->rw_rwchan);
+	wchan_destroy(rwlock->rw_wwchan);
 
 	kfree(rwlock->rwlock_name);
 	kfree(rwlock);
 }
 
+/*
+ * Let go of SHARE (RW_WRITER, or 1 for a reader) when someone might be
+ * waiting. Called with rw_lock held. If that leaves the lock free, it
+ * goes to a sleeping writer if there is one, and otherwise all the
+ * sleeping readers get woken up to come get it.
+ */
+static
+void
+rwlock_wakeup(struct rwlock *rwlock, unsigned share)
+{
+	unsigned old, rest, new, sleepers;
+
+	KASSERT(spinlock_do_i_hold(&rwlock->rw_lock));
+
+	for (;;) {
+		old = rwlock->rw_state;
+		rest = old - share;
+
+		if (rest & (RW_WRITER | RW_READERS)) {
+			/* Other readers still have it; nothing to do yet. */
+			if (atomic_cas(&rwlock->rw_state, old, rest) == old) {
+				return;
+			}
+			continue;
+		}
+
+		sleepers = rwlock->rw_wwaiters - rwlock->rw_handoffs;
+		if (sleepers > 0) {
+			new = RW_WRITER | (rest & RW_RWAIT);
+			if (sleepers > 1) {
+				new |= RW_WWAIT;
+			}
+			if (atomic_cas(&rwlock->rw_state, old, new) == old) {
+				rwlock->rw_handoffs++;
+				wchan_wakeone(rwlock->rw_wwchan,
+					      &rwlock->rw_lock);
+				return;
+			}
+			continue;
+		}
+
+		new = rest & ~(RW_RWAIT | RW_WWAIT);
+		if (atomic_cas(&rwlock->rw_state, old, new) == old) {
+			if (rest & RW_RWAIT) {
+				wchan_wakeall(rwlock->rw_rwchan,
+					      &rwlock->rw_lock);
+			}
+			return;
+		}
+	}
+}
+
 void
 rwlock_acquire_read(struct rwlock *rwlock) {
+	unsigned old;
+
 	KASSERT(rwlock != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
 
-	lock_acquire(rwlock->rwlock_lock);
+	for (;;) {
+		old = rwlock->rw_state;
+		if ((old & (RW_WRITER | RW_WWAIT)) == 0) {
+			KASSERT((old & RW_READERS) != RW_READERS);
+			if (atomic_cas(&rwlock->rw_state, old, old+1) == old) {
+				return;
+			}
+			continue;
+		}
 
-	/* wait until active writers and all waiting writers complete */
-	while (rwlock->write_request_count) {
-		cv_wait(rwlock->rwlock_cv, rwlock->rwlock_lock);
+		/*
+		 * A writer has it or wants it. Flag that we're waiting
+		 * (under rw_lock, so whoever lets go will see it when
+		 * they get there) and sleep; then try again.
+		 */
+		spinlock_acquire(&rwlock->rw_lock);
+		old = rwlock->rw_state;
+		if ((old & (RW_WRITER | RW_WWAIT)) != 0 &&
+		    atomic_cas(&rwlock->rw_state, old, old | RW_RWAIT) == old) {
+			wchan_sleep(rwlock->rw_rwchan, &rwlock->rw_lock);
+		}
+		spinlock_release(&rwlock->rw_lock);
 	}
-
-	rwlock->active_reader_count++;
-
-	lock_release(rwlock->rwlock_lock);
 }
 
 void
 rwlock_release_read(struct rwlock *rwlock) {
-	KASSERT(rwlock != NULL);
-	KASSERT(rwlock->active_reader_count > 0);
-
-	lock_acquire(rwlock->rwlock_lock);
+	unsigned old;
 
-	rwlock->active_reader_count--;
-	cv_broadcast(rwlock->rwlock_cv, rwlock->rwlock_lock);
+	KASSERT(rwlock != NULL);
 
-	lock_release(rwlock->rwlock_lock);
+	for (;;) {
+		old = rwlock->rw_state;
+		KASSERT((old & RW_READERS) > 0);
+		KASSERT((old & RW_WRITER) == 0);
+
+		if ((old & RW_READERS) == 1 &&
+		    (old & (RW_RWAIT | RW_WWAIT)) != 0) {
+			/* Last one out, and someone is waiting. */
+			spinlock_acquire(&rwlock->rw_lock);
+			rwlock_wakeup(rwlock, 1);
+			spinlock_release(&rwlock->rw_lock);
+			return;
+		}
+		if (atomic_cas(&rwlock->rw_state, old, old-1) == old) {
+			return;
+		}
+	}
 }
 
 void
 rwlock_acquire_write(struct rwlock *rwlock) {
-	KASSERT(rwlock != NULL);
+	unsigned old, new;
 
-	lock_acquire(rwlock->rwlock_lock);
-
-	rwlock->write_request_count++;
-	/* wait until active writers & readers complete */
-	while (rwlock->active_writer_count && rwlock->active_reader_count ) {
-		cv_wait(rwlock->rwlock_cv, rwlock->rwlock_lock);
+	KASSERT(rwlock != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rwlock->rw_writer != curthread);
+
+	if (atomic_cas(&rwlock->rw_state, 0, RW_WRITER) != 0) {
+		spinlock_acquire(&rwlock->rw_lock);
+		rwlock->rw_wwaiters++;
+		for (;;) {
+			if (rwlock->rw_handoffs > 0) {
+				/* It was handed to us, already marked held. */
+				rwlock->rw_handoffs--;
+				break;
+			}
+
+			old = rwlock->rw_state;
+			if ((old & (RW_WRITER | RW_READERS)) == 0) {
+				/* Free; take it. */
+				new = RW_WRITER | (old & RW_RWAIT);
+				if (rwlock->rw_wwaiters - rwlock->rw_handoffs > 1) {
+					new |= RW_WWAIT;
+				}
+				if (atomic_cas(&rwlock->rw_state, old, new) == old) {
+					break;
+				}
+				continue;
+			}
+
+			if ((old & RW_WWAIT) == 0 &&
+			    atomic_cas(&rwlock->rw_state, old,
+				       old | RW_WWAIT) != old) {
+				continue;
+			}
+			wchan_sleep(rwlock->rw_wwchan, &rwlock->rw_lock);
+		}
+		rwlock->rw_wwaiters--;
+		spinlock_release(&rwlock->rw_lock);
 	}
-	rwlock->write_request_count--;
-
-	rwlock->active_writer_count++;
 
-	lock_release(rwlock->rwlock_lock);
+	KASSERT(rwlock->rw_state & RW_WRITER);
+	rwlock->rw_writer = curthread;
 }
 
 void
 rwlock_release_write(struct rwlock *rwlock) {
 	KASSERT(rwlock != NULL);
-	KASSERT(rwlock->active_writer_count > 0);
+	KASSERT(rwlock->rw_writer == curthread);
 
-	lock_acquire(rwlock->rwlock_lock);
+	rwlock->rw_writer = NULL;
 
-	rwlock->active_writer_count--;
-	cv_broadcast(rwlock->rwlock_cv, rwlock->rwlock_lock);
+	if (atomic_cas(&rwlock->rw_state, RW_WRITER, 0) == RW_WRITER) {
+		return;
+	}
 
-	lock_release(rwlock->rwlock_lock);
-}
\ No newline at end of file
+	spinlock_acquire(&rwlock->rw_lock);
+	rwlock_wakeup(rwlock, RW_WRITER);
+	spinlock_release(&rwlock->rw_lock);
+}
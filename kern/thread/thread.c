@@ -47,6 +47,8 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <clock.h>
+#include <softint.h>
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
@@ -70,6 +72,12 @@ unsigned num_cpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/*
+ * Dead threads (with their stacks) kept per cpu for thread_fork to
+ * reuse, so forking doesn't have to allocate and set them up again.
+ */
+#define THREAD_CACHE_MAX 8
+
 /* Used to synchronize exit cleanup. */
 unsigned thread_count = 0;
 static struct spinlock thread_count_lock = SPINLOCK_INITIALIZER;
@@ -119,21 +127,9 @@ thread_checkstack(struct thread *thread)
  * for each CPU and to create subsequent forked threads.
  */
 static
-struct thread *
-thread_create(const char *name)
+void
+thread_init(struct thread *thread, const char *name)
 {
-	struct thread *thread;
-
-	DEBUGASSERT(name != NULL);
-	if (strlen(name) > MAX_NAME_LENGTH) {
-		return NULL;
-	}
-
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
-	}
-
 	strcpy(thread->t_name, name);
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
@@ -141,7 +137,6 @@ thread_create(const char *name)
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
@@ -151,7 +146,30 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Public fields */
+	thread->t_tid = 0;
+
 	/* If you add to struct thread, be sure to initialize here */
+}
+
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	DEBUGASSERT(name != NULL);
+	if (strlen(name) > MAX_NAME_LENGTH) {
+		return NULL;
+	}
+
+	thread = kmalloc(sizeof(*thread));
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	thread_init(thread, name);
+	thread->t_stack = NULL;
 
 	return thread;
 }
@@ -182,14 +200,20 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_timercycles = 0;
 	c->c_spinlocks = 0;
+	c->c_softints = NULL;
+	c->c_yieldpending = false;
+	threadlist_init(&c->c_threadcache);
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
+	c->c_timerticks = 1;
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdowns_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -286,9 +310,70 @@ thread_destroy(struct thread *thread)
 	kfree(thread);
 }
 
+/*
+ * Put a dead thread in the current cpu's cache for reuse, or destroy
+ * it if the cache is full (or it has no stack of its own to reuse).
+ * The cache is only touched by its own cpu, so turning interrupts
+ * off is enough to protect it.
+ */
+static
+void
+thread_cache_put(struct thread *thread)
+{
+	int spl;
+
+	KASSERT(thread->t_proc == NULL);
+
+	if (thread->t_stack != NULL) {
+		thread_checkstack(thread);
+		thread->t_wchan_name = "CACHED";
+
+		spl = splhigh();
+		if (curcpu->c_threadcache.tl_count < THREAD_CACHE_MAX) {
+			threadlist_addhead(&curcpu->c_threadcache, thread);
+			splx(spl);
+			return;
+		}
+		splx(spl);
+	}
+	thread_destroy(thread);
+}
+
+/*
+ * Get a thread from the current cpu's cache, set up as if by
+ * thread_create but with a stack already. Returns NULL if the cache
+ * is empty.
+ */
+static
+struct thread *
+thread_cache_get(const char *name)
+{
+	struct thread *thread;
+	int spl;
+
+	DEBUGASSERT(name != NULL);
+	if (strlen(name) > MAX_NAME_LENGTH) {
+		return NULL;
+	}
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadcache);
+	splx(spl);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	/* The stack magic was checked going in and is still there. */
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+	thread_init(thread, name);
+	return thread;
+}
+
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them.) Those with stacks
+ * that can be reused go into the thread cache instead.
  *
  * The list of zombies is per-cpu.
  */
@@ -301,7 +386,7 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		thread_cache_put(z);
 	}
 }
 
@@ -452,6 +537,20 @@ thread_start_cpus(void)
 	thread_count = 1;
 }
 
+/*
+ * Check if a cpu we just put a thread on the run queue of needs an IPI
+ * to notice: either it's idle, or it's busy but its timer isn't set
+ * for the end of the current quantum (see hardclock_reload). Call
+ * with the target cpu's run queue locked.
+ */
+static
+bool
+thread_cpu_needs_unidle(struct cpu *c)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	return c->c_isidle || c->c_timerticks != 1;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -478,10 +577,15 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	target->t_state = S_READY;
 	threadlist_addtail(&targetcpu->c_runqueue, target);
 
-	if (targetcpu->c_isidle) {
+	if (targetcpu == curcpu->c_self) {
+		/* Make sure our own timer is set for the quantum. */
+		hardclock_reload();
+	}
+	else if (thread_cpu_needs_unidle(targetcpu)) {
 		/*
-		 * Other processor is idle; send interrupt to make
-		 * sure it unidles.
+		 * Other processor is idle, or not expecting to
+		 * switch threads soon; send interrupt to make sure it
+		 * notices.
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
@@ -491,6 +595,99 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 }
 
+/*
+ * Wakeup placement.
+ *
+ * A thread coming off a wait channel goes back to the cpu it last ran
+ * on if that cpu is idle, since that's where its cache footprint (such
+ * as it is) lives. Otherwise, if some other cpu is idle, it goes there
+ * instead of waiting behind whatever the busy cpu is doing. If nobody
+ * is idle it goes back on its previous cpu's run queue.
+ *
+ * CLAIMED is a mask of cpus (by c_number) that have already been
+ * handed a thread during the current batch of wakeups; they're not
+ * considered idle any more even though c_isidle won't change until
+ * they actually get around to running something. This spreads a
+ * wchan_wakeall across the idle cpus instead of piling everyone onto
+ * the first one.
+ *
+ * c_isidle is read without the runqueue lock; it's only a hint. If it
+ * turns out to be stale the thread still runs, just not as soon.
+ */
+static
+struct cpu *
+thread_wakeup_cpu(struct thread *target, uint32_t claimed)
+{
+	struct cpu *prev, *c;
+	unsigned i, numcpus;
+
+	prev = target->t_cpu;
+	if (prev->c_isidle && (claimed & CPUMASK(prev)) == 0) {
+		return prev;
+	}
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=1; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, (prev->c_number + i) % numcpus);
+		if (c->c_isidle && (claimed & CPUMASK(c)) == 0) {
+			break;
+		}
+	}
+	if (i == numcpus) {
+		return prev;
+	}
+
+	/*
+	 * If the thread went to sleep and its cpu then went idle with
+	 * nothing else to run, the idle loop is still running on the
+	 * thread's stack and it is still that cpu's curthread. Moving
+	 * it elsewhere would have two cpus on one stack; leave it be.
+	 * (See also the comments in thread_consider_migration.)
+	 */
+	spinlock_acquire(&prev->c_runqueue_lock);
+	if (prev->c_curthread == target) {
+		c = prev;
+	}
+	spinlock_release(&prev->c_runqueue_lock);
+
+	return c;
+}
+
+/*
+ * Make a thread that was sleeping runnable, choosing a cpu for it with
+ * thread_wakeup_cpu. Rather than sending IPI_UNIDLE right away, add
+ * the chosen cpu to *IPIS if it needs one; the caller sends them all
+ * at once with ipi_send_mask when it's done waking threads up.
+ */
+static
+void
+thread_wakeup(struct thread *target, uint32_t *claimed, uint32_t *ipis)
+{
+	struct cpu *targetcpu;
+
+	targetcpu = thread_wakeup_cpu(target, *claimed);
+
+	spinlock_acquire(&targetcpu->c_runqueue_lock);
+	if (targetcpu != target->t_cpu) {
+		DEBUG(DB_THREADS, "Woke thread %s: cpu %u -> %u",
+		      target->t_name, target->t_cpu->c_number,
+		      targetcpu->c_number);
+		target->t_cpu = targetcpu;
+	}
+	target->t_state = S_READY;
+	threadlist_addtail(&targetcpu->c_runqueue, target);
+	if (targetcpu->c_isidle) {
+		*claimed |= CPUMASK(targetcpu);
+	}
+	if (targetcpu == curcpu->c_self) {
+		hardclock_reload();
+	}
+	else if (thread_cpu_needs_unidle(targetcpu)) {
+		*ipis |= CPUMASK(targetcpu);
+	}
+	spinlock_release(&targetcpu->c_runqueue_lock);
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -510,18 +707,22 @@ thread_fork(const char *name,
 	struct thread *newthread;
 	int result;
 
-	newthread = thread_create(name);
+	/* Reuse a dead thread and its stack if we have one handy. */
+	newthread = thread_cache_get(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -659,13 +860,20 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	do {
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
+			/* In tickless mode this stops the timer. */
+			hardclock_reload();
 			spinlock_release(&curcpu->c_runqueue_lock);
 			cpu_idle();
+			/* Whatever woke us may have left work behind. */
+			softint_run();
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
+	/* Set the timer for next's quantum, if it isn't already. */
+	hardclock_reload();
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -954,10 +1162,12 @@ thread_consider_migration(void)
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
 			to_send--;
-			if (c->c_isidle) {
+			if (thread_cpu_needs_unidle(c)) {
 				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
+				 * Other processor is idle, or not
+				 * expecting to switch threads soon;
+				 * send interrupt to make sure it
+				 * notices.
 				 */
 				ipi_send(c, IPI_UNIDLE);
 			}
@@ -1052,6 +1262,7 @@ void
 wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *target;
+	uint32_t claimed = 0, ipis = 0;
 
 	KASSERT(spinlock_do_i_hold(lk));
 
@@ -1064,14 +1275,15 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	}
 
 	/*
-	 * Note that thread_make_runnable acquires a runqueue lock
-	 * while we're holding LK. This is ok; all spinlocks
-	 * associated with wchans must come before the runqueue locks,
-	 * as we also bridge from the wchan lock to the runqueue lock
-	 * in thread_switch.
+	 * Note that thread_wakeup acquires a runqueue lock while
+	 * we're holding LK. This is ok; all spinlocks associated with
+	 * wchans must come before the runqueue locks, as we also
+	 * bridge from the wchan lock to the runqueue lock in
+	 * thread_switch.
 	 */
 
-	thread_make_runnable(target, false);
+	thread_wakeup(target, &claimed, &ipis);
+	ipi_send_mask(ipis, IPI_UNIDLE);
 }
 
 /*
@@ -1082,6 +1294,7 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *target;
 	struct threadlist list;
+	uint32_t claimed = 0, ipis = 0;
 
 	KASSERT(spinlock_do_i_hold(lk));
 
@@ -1096,13 +1309,14 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	}
 
 	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
+	 * Make each thread runnable, spreading them over the idle
+	 * cpus, and then poke each cpu that needs it exactly once
+	 * instead of once per thread.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+		thread_wakeup(target, &claimed, &ipis);
 	}
+	ipi_send_mask(ipis, IPI_UNIDLE);
 
 	threadlist_cleanup(&list);
 }
@@ -1156,28 +1370,103 @@ ipi_broadcast(int code)
 	}
 }
 
+/*
+ * Send an IPI to each cpu whose bit (by c_number) is set in MASK.
+ */
 void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+ipi_send_mask(uint32_t mask, int code)
 {
-	int n;
+	unsigned i;
 
-	spinlock_acquire(&target->c_ipi_lock);
+	for (i=0; mask != 0 && i < cpuarray_num(&allcpus); i++) {
+		if (mask & ((uint32_t)1 << i)) {
+			mask &= ~((uint32_t)1 << i);
+			ipi_send(cpuarray_get(&allcpus, i), code);
+		}
+	}
+}
+
+/*
+ * Queue MAPPING for TARGET's next shootdown. Call with TARGET's IPI
+ * lock held.
+ */
+static
+void
+ipi_queueshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	int n;
 
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	if (n == TLBSHOOTDOWN_ALL) {
+		/* Already flushing everything. */
+	}
+	else if (n == TLBSHOOTDOWN_MAX) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
 	else {
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
-
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
-	mainbus_send_ipi(target);
+}
 
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	spinlock_acquire(&target->c_ipi_lock);
+	ipi_queueshootdown(target, mapping);
+	mainbus_send_ipi(target);
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Each cpu bumps c_shootdowns_done after handling a batch, under its
+ * IPI lock, so once it moves past the value seen when we queued ours,
+ * ours has been done. We go one cpu at a time; if we migrate partway,
+ * whatever cpu we're on when we get to it is flushed directly, and a
+ * cpu we've left behind was flushed while we were on it.
+ */
+void
+ipi_tlbshootdown_wait(const struct tlbshootdown *mappings, unsigned n)
+{
+	struct cpu *target;
+	unsigned i, j, done;
+	int spl;
+
+	KASSERT(curthread->t_curspl == 0);
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		target = cpuarray_get(&allcpus, i);
+
+		spl = splhigh();
+		if (target == curcpu) {
+			if (n > TLBSHOOTDOWN_MAX) {
+				vm_tlbshootdown_all();
+			}
+			else {
+				for (j=0; j<n; j++) {
+					vm_tlbshootdown(&mappings[j]);
+				}
+			}
+			splx(spl);
+			continue;
+		}
+		splx(spl);
+
+		spinlock_acquire(&target->c_ipi_lock);
+		for (j=0; j<n; j++) {
+			ipi_queueshootdown(target, &mappings[j]);
+		}
+		done = target->c_shootdowns_done;
+		mainbus_send_ipi(target);
+		spinlock_release(&target->c_ipi_lock);
+
+		while (target->c_shootdowns_done == done) {
+			/* Spin; it won't be long. */
+		}
+	}
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -1200,13 +1489,17 @@ interprocessor_interrupt(void)
 			kprintf("cpu%d: offline: warning: not idle\n",
 				curcpu->c_number);
 		}
+		/* Don't let wakeups get placed here any more. */
+		curcpu->c_isidle = false;
 		spinlock_release(&curcpu->c_runqueue_lock);
 		cpu_halt();
 	}
 	if (bits & (1U << IPI_UNIDLE)) {
 		/*
 		 * The cpu has already unidled itself to take the
-		 * interrupt; don't need to do anything else.
+		 * interrupt. If it was busy instead, its timer may
+		 * need to be brought in; that's done below, because
+		 * the run queue lock comes before the IPI lock.
 		 */
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
@@ -1219,10 +1512,17 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdowns_done++;
 	}
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	if (bits & (1U << IPI_UNIDLE)) {
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		hardclock_reload();
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
 }
 
 /*
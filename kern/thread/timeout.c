@@ -0,0 +1,566 @@
+/*
+ * Timeouts.
+ *
+ * Pending timeouts live on a hierarchical timer wheel (the scheme
+ * Varghese and Lauck called "hashed and hierarchical timing wheels").
+ * Time is counted in wheel ticks of TIMEOUT_TICK_NSEC. Level 0 has one
+ * slot per tick for the next TW_SIZE ticks; each slot of level 1
+ * covers TW_SIZE ticks, and so on up. When the level 0 index wraps
+ * around, the next slot of level 1 is "cascaded": its timeouts are
+ * re-inserted, which drops each of them down to a lower level, and so
+ * on recursively. So adding and cancelling are O(1) and each timeout
+ * gets moved at most TW_LEVELS-1 times before it goes off.
+ *
+ * The wheel isn't advanced by a periodic tick. Instead the hardware
+ * timer is set to go off at the next tick that has anything to do,
+ * and the interrupt handler processes every tick up to the present,
+ * skipping empty slots. Each level has a bitmap of nonempty slots so
+ * that finding the next thing to do doesn't mean looking at all of
+ * them.
+ *
+ * Everything here is protected by tw_lock. Callbacks are run without
+ * it, so they can add timeouts (including themselves) again.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <clock.h>
+#include <proc.h>
+#include <timeout.h>
+
+/* Wheel geometry: 6 levels of 32 slots covers 2^30 ticks, ~30 hours. */
+#define TW_BITS		5
+#define TW_SIZE		(1U << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1)
+#define TW_LEVELS	6
+#define TW_SPAN		((uint64_t)1 << (TW_BITS * TW_LEVELS))
+
+/* Wheel ticks per second, and microseconds per wheel tick. */
+#define TW_TICKS_PER_SEC	(1000000000 / TIMEOUT_TICK_NSEC)
+#define TW_TICK_USEC		(TIMEOUT_TICK_NSEC / 1000)
+
+/* Never set the hardware timer more than this far out (usec). */
+#define TW_MAXARM_USEC		1000000
+
+#define TW_NEVER	((uint64_t)-1)
+
+static struct spinlock tw_lock = SPINLOCK_INITIALIZER;
+static struct timeout *tw_slots[TW_LEVELS][TW_SIZE];
+static uint32_t tw_bitmap[TW_LEVELS];	/* nonempty slots */
+static unsigned tw_count;		/* number of timeouts on the wheel */
+static uint64_t tw_now;			/* next tick to be processed */
+static uint64_t tw_armed;		/* tick the hardware is set for */
+
+/* The timer device. */
+static void *tw_devdata;
+static void (*tw_gettime)(void *devdata, struct timespec *ts);
+static void (*tw_settimer)(void *devdata, uint32_t usecs);
+
+/* For calling timerclock() once a second. */
+static struct timeout timerclock_timeout;
+static struct timespec timerclock_next;
+
+/*
+ * Sleep queues for timeout_sleepuntil. Sleepers are spread over these
+ * by thread address; sharing one only costs an occasional spurious
+ * wakeup.
+ */
+#define TIMEOUT_NSLEEPQS 16
+
+struct timeout_sleepq {
+	struct spinlock tsq_lock;
+	struct wchan *tsq_wchan;
+};
+
+struct timeout_sleeper {
+	struct timeout_sleepq *ts_q;
+	volatile bool ts_done;
+};
+
+static struct timeout_sleepq timeout_sleepqs[TIMEOUT_NSLEEPQS];
+
+////////////////////////////////////////////////////////////
+//
+// Wheel internals
+
+/*
+ * Convert a time to wheel ticks. Deadlines round up, so nothing goes
+ * off early; the current time rounds down.
+ */
+static
+uint64_t
+timeout_ticks(const struct timespec *ts, bool roundup)
+{
+	uint32_t frac;
+
+	frac = ts->tv_nsec / TIMEOUT_TICK_NSEC;
+	if (roundup && ts->tv_nsec % TIMEOUT_TICK_NSEC != 0) {
+		frac++;
+	}
+	return (uint64_t)ts->tv_sec * TW_TICKS_PER_SEC + frac;
+}
+
+/*
+ * Read the current time, in wheel ticks.
+ */
+static
+uint64_t
+timeout_now(void)
+{
+	struct timespec ts;
+
+	tw_gettime(tw_devdata, &ts);
+	return timeout_ticks(&ts, false);
+}
+
+/*
+ * Put a timeout in the right slot for its deadline, relative to
+ * tw_now. Deadlines already past go in the current slot; deadlines
+ * beyond the end of the wheel go in the farthest slot and get
+ * reinserted when they come down to level 0.
+ */
+static
+void
+timeout_insert(struct timeout *to)
+{
+	uint64_t expires;
+	unsigned level, idx;
+
+	expires = to->to_expires;
+	if (expires < tw_now) {
+		expires = tw_now;
+	}
+	else if (expires - tw_now >= TW_SPAN) {
+		expires = tw_now + TW_SPAN - 1;
+	}
+
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if (expires - tw_now < ((uint64_t)1 << (TW_BITS * (level+1)))) {
+			break;
+		}
+	}
+	idx = (expires >> (TW_BITS * level)) & TW_MASK;
+
+	to->to_next = tw_slots[level][idx];
+	if (to->to_next != NULL) {
+		to->to_next->to_prevp = &to->to_next;
+	}
+	to->to_prevp = &tw_slots[level][idx];
+	tw_slots[level][idx] = to;
+	tw_bitmap[level] |= (uint32_t)1 << idx;
+	tw_count++;
+}
+
+/*
+ * Take a timeout off the wheel.
+ */
+static
+void
+timeout_remove(struct timeout *to)
+{
+	size_t slot;
+
+	KASSERT(to->to_prevp != NULL);
+
+	*to->to_prevp = to->to_next;
+	if (to->to_next != NULL) {
+		to->to_next->to_prevp = to->to_prevp;
+	}
+
+	/* If we were first in a slot and it's now empty, clear its bit. */
+	slot = to->to_prevp - &tw_slots[0][0];
+	if (slot < TW_LEVELS * TW_SIZE && tw_slots[0][slot] == NULL) {
+		tw_bitmap[slot / TW_SIZE] &= ~((uint32_t)1 << (slot % TW_SIZE));
+	}
+
+	to->to_next = NULL;
+	to->to_prevp = NULL;
+	KASSERT(tw_count > 0);
+	tw_count--;
+}
+
+/*
+ * Detach the whole list in a slot and return it.
+ */
+static
+struct timeout *
+timeout_takeslot(unsigned level, unsigned idx)
+{
+	struct timeout *list, *to;
+
+	list = tw_slots[level][idx];
+	tw_slots[level][idx] = NULL;
+	tw_bitmap[level] &= ~((uint32_t)1 << idx);
+	for (to = list; to != NULL; to = to->to_next) {
+		to->to_prevp = NULL;
+		KASSERT(tw_count > 0);
+		tw_count--;
+	}
+	return list;
+}
+
+/*
+ * Move the current slot of LEVEL down to the lower levels.
+ */
+static
+void
+timeout_cascade(unsigned level)
+{
+	struct timeout *to, *next;
+
+	to = timeout_takeslot(level, (tw_now >> (TW_BITS * level)) & TW_MASK);
+	for (; to != NULL; to = next) {
+		next = to->to_next;
+		timeout_insert(to);
+	}
+}
+
+static uint64_t timeout_next(void);
+
+/*
+ * Process wheel ticks up to and including NOW. Timeouts that go off
+ * are moved to the list *EXPIRED, to be called once tw_lock is let go.
+ */
+static
+void
+timeout_advance(uint64_t now, struct timeout **expired)
+{
+	struct timeout *to, *next;
+	unsigned level, idx;
+	uint64_t when;
+
+	while (tw_now <= now) {
+		idx = tw_now & TW_MASK;
+		if (idx == 0) {
+			for (level = 1; level < TW_LEVELS; level++) {
+				timeout_cascade(level);
+				if (((tw_now >> (TW_BITS * level)) & TW_MASK) != 0) {
+					break;
+				}
+			}
+		}
+
+		to = timeout_takeslot(0, idx);
+		for (; to != NULL; to = next) {
+			next = to->to_next;
+			if (to->to_expires > tw_now) {
+				/* Was parked at the far end of the wheel. */
+				timeout_insert(to);
+			}
+			else {
+				to->to_next = *expired;
+				*expired = to;
+			}
+		}
+		tw_now++;
+
+		/*
+		 * Skip straight to the next tick with anything to do,
+		 * or to the present if that's sooner.
+		 */
+		when = timeout_next();
+		if (when > now + 1) {
+			when = now + 1;
+		}
+		if (when > tw_now) {
+			tw_now = when;
+		}
+	}
+}
+
+/*
+ * Find the next tick at which there's something to do: either a
+ * level 0 slot to run or a higher-level slot to cascade.
+ */
+static
+uint64_t
+timeout_next(void)
+{
+	uint64_t best, when;
+	unsigned level, shift, cur, k, first;
+
+	best = TW_NEVER;
+	for (level = 0; level < TW_LEVELS; level++) {
+		if (tw_bitmap[level] == 0) {
+			continue;
+		}
+		shift = TW_BITS * level;
+		cur = (tw_now >> shift) & TW_MASK;
+
+		/*
+		 * The current slot of a higher level has already been
+		 * cascaded this time around, and anything in it now is
+		 * a full turn away - unless tw_now is right at the
+		 * start of the slot, in which case the cascade is
+		 * still to come.
+		 */
+		first = (tw_now & (((uint64_t)1 << shift) - 1)) == 0 ? 0 : 1;
+		for (k = first; k < TW_SIZE + first; k++) {
+			if (tw_bitmap[level] & ((uint32_t)1 << ((cur + k) & TW_MASK))) {
+				break;
+			}
+		}
+		if (level == 0) {
+			when = tw_now + k;
+		}
+		else {
+			when = ((tw_now >> shift) + k) << shift;
+		}
+		if (when < best) {
+			best = when;
+		}
+	}
+	return best;
+}
+
+/*
+ * Set the hardware timer for the next thing on the wheel.
+ */
+static
+void
+timeout_rearm(void)
+{
+	uint64_t next, now;
+	uint32_t usecs;
+
+	KASSERT(spinlock_do_i_hold(&tw_lock));
+
+	next = timeout_next();
+	if (next == TW_NEVER) {
+		tw_armed = TW_NEVER;
+		return;
+	}
+
+	now = timeout_now();
+	if (next <= now) {
+		usecs = 1;
+	}
+	else if (next - now >= TW_MAXARM_USEC / TW_TICK_USEC) {
+		usecs = TW_MAXARM_USEC;
+		next = now + TW_MAXARM_USEC / TW_TICK_USEC;
+	}
+	else {
+		usecs = (next - now) * TW_TICK_USEC;
+	}
+	tw_armed = next;
+	tw_settimer(tw_devdata, usecs);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+timeout_init(struct timeout *to, void (*func)(void *), void *arg)
+{
+	to->to_next = NULL;
+	to->to_prevp = NULL;
+	to->to_expires = 0;
+	to->to_func = func;
+	to->to_arg = arg;
+}
+
+void
+timeout_add(struct timeout *to, const struct timespec *deadline)
+{
+	KASSERT(tw_gettime != NULL);
+
+	spinlock_acquire(&tw_lock);
+	if (to->to_prevp != NULL) {
+		timeout_remove(to);
+	}
+	to->to_expires = timeout_ticks(deadline, true);
+	timeout_insert(to);
+	if (to->to_expires < tw_armed) {
+		timeout_rearm();
+	}
+	spinlock_release(&tw_lock);
+}
+
+bool
+timeout_cancel(struct timeout *to)
+{
+	bool pending;
+
+	spinlock_acquire(&tw_lock);
+	pending = to->to_prevp != NULL;
+	if (pending) {
+		timeout_remove(to);
+	}
+	spinlock_release(&tw_lock);
+
+	/*
+	 * Don't bother moving the hardware timer; if it goes off for
+	 * nothing, it just gets set again.
+	 */
+	return pending;
+}
+
+bool
+timeout_pending(struct timeout *to)
+{
+	bool pending;
+
+	spinlock_acquire(&tw_lock);
+	pending = to->to_prevp != NULL;
+	spinlock_release(&tw_lock);
+	return pending;
+}
+
+/*
+ * Timer interrupt: run everything that's due and set up the next one.
+ */
+void
+timeout_interrupt(void)
+{
+	struct timeout *expired, *to;
+
+	expired = NULL;
+
+	spinlock_acquire(&tw_lock);
+	timeout_advance(timeout_now(), &expired);
+	timeout_rearm();
+	spinlock_release(&tw_lock);
+
+	while ((to = expired) != NULL) {
+		expired = to->to_next;
+		to->to_next = NULL;
+		to->to_func(to->to_arg);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Sleeping
+
+static
+void
+timeout_wakesleeper(void *vts)
+{
+	struct timeout_sleeper *ts = vts;
+	struct timeout_sleepq *q = ts->ts_q;
+
+	spinlock_acquire(&q->tsq_lock);
+	ts->ts_done = true;
+	wchan_wakeall(q->tsq_wchan, &q->tsq_lock);
+	spinlock_release(&q->tsq_lock);
+}
+
+/*
+ * Process-exit hook: wake up everyone on the sleeper's queue so it can
+ * notice its process is exiting.
+ */
+static
+void
+timeout_intrsleeper(void *vts)
+{
+	struct timeout_sleeper *ts = vts;
+	struct timeout_sleepq *q = ts->ts_q;
+
+	spinlock_acquire(&q->tsq_lock);
+	wchan_wakeall(q->tsq_wchan, &q->tsq_lock);
+	spinlock_release(&q->tsq_lock);
+}
+
+int
+timeout_sleepuntil(const struct timespec *deadline)
+{
+	struct timeout to;
+	struct timeout_sleeper ts;
+	struct proc_intr pi;
+	unsigned n;
+	int result = 0;
+
+	KASSERT(!curthread->t_in_interrupt);
+
+	if (timeout_ticks(deadline, true) <= timeout_now()) {
+		return 0;
+	}
+
+	n = ((vaddr_t)curthread / sizeof(struct thread)) % TIMEOUT_NSLEEPQS;
+	ts.ts_q = &timeout_sleepqs[n];
+	ts.ts_done = false;
+	timeout_init(&to, timeout_wakesleeper, &ts);
+
+	proc_intr_enter(&pi, timeout_intrsleeper, &ts);
+	spinlock_acquire(&ts.ts_q->tsq_lock);
+	timeout_add(&to, deadline);
+	while (!ts.ts_done && !proc_exiting()) {
+		wchan_sleep(ts.ts_q->tsq_wchan, &ts.ts_q->tsq_lock);
+	}
+	if (!ts.ts_done) {
+		if (timeout_cancel(&to)) {
+			result = EINTR;
+		}
+		else {
+			/* It's going off right now; it needs TS. */
+			while (!ts.ts_done) {
+				wchan_sleep(ts.ts_q->tsq_wchan,
+					    &ts.ts_q->tsq_lock);
+			}
+		}
+	}
+	spinlock_release(&ts.ts_q->tsq_lock);
+	proc_intr_leave(&pi);
+
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Setup
+
+static
+void
+timeout_timerclock(void *arg)
+{
+	(void)arg;
+
+	timerclock();
+	timerclock_next.tv_sec++;
+	timeout_add(&timerclock_timeout, &timerclock_next);
+}
+
+void
+timeout_bootstrap(void)
+{
+	unsigned i;
+
+	for (i = 0; i < TIMEOUT_NSLEEPQS; i++) {
+		spinlock_init(&timeout_sleepqs[i].tsq_lock);
+		timeout_sleepqs[i].tsq_wchan = wchan_create("timeout");
+		if (timeout_sleepqs[i].tsq_wchan == NULL) {
+			panic("timeout_bootstrap: Out of memory\n");
+		}
+	}
+	tw_armed = TW_NEVER;
+}
+
+void
+timeout_setclock(void *devdata,
+		 void (*gettime)(void *devdata, struct timespec *ts),
+		 void (*settimer)(void *devdata, uint32_t usecs))
+{
+	/* We use only the first timer. */
+	if (tw_gettime != NULL) {
+		return;
+	}
+
+	spinlock_acquire(&tw_lock);
+	tw_devdata = devdata;
+	tw_gettime = gettime;
+	tw_settimer = settimer;
+	tw_now = timeout_now();
+	spinlock_release(&tw_lock);
+
+	gettime(devdata, &timerclock_next);
+	timerclock_next.tv_sec++;
+	timerclock_next.tv_nsec = 0;
+	timeout_init(&timerclock_timeout, timeout_timerclock, NULL);
+	timeout_add(&timerclock_timeout, &timerclock_next);
+}
@@ -0,0 +1,403 @@
+/*
+ * Pipes.
+ *
+ * A pipe is a ring buffer one page long with a vnode for each end.
+ * Both vnodes live inside struct pipe; closing an end (its vnode
+ * being reclaimed) wakes whoever is waiting on the other end, and the
+ * pipe goes away when both ends are closed.
+ *
+ * p_lock covers the ring's head and count and the closed flags, and
+ * is what readers and writers sleep on. It is not held while copying:
+ * the data is moved with uiomove straight between the user buffer and
+ * the ring, which can fault. That's safe because only one reader and
+ * one writer copy at a time (p_rlock and p_wlock), the reader only
+ * touches bytes already counted, and the writer only bytes not yet
+ * counted.
+ *
+ * A writer holds p_wlock for its whole write, so writes never
+ * interleave. A write of up to PIPE_BUF bytes also waits until there's
+ * room for all of it, so it goes in in one piece or, if the reader
+ * goes away first, not at all.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <limits.h>
+#include <stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <synch.h>
+#include <vm.h>
+#include <vnode.h>
+#include <proc.h>
+#include <pipe.h>
+
+/* The ring is one page. */
+#define PIPE_SIZE PAGE_SIZE
+
+struct pipe {
+	struct vnode p_rvn;		/* Read end */
+	struct vnode p_wvn;		/* Write end */
+
+	char *p_buf;			/* The ring */
+	struct lock *p_rlock;		/* One reader copies at a time */
+	struct lock *p_wlock;		/* One writer copies at a time */
+
+	struct spinlock p_lock;		/* Covers what follows */
+	unsigned p_head;		/* Offset of first byte in ring */
+	unsigned p_count;		/* Bytes in ring */
+	bool p_rclosed;			/* Read end is closed */
+	bool p_wclosed;			/* Write end is closed */
+	struct wchan *p_rwchan;		/* Readers waiting for data */
+	struct wchan *p_wwchan;		/* Writers waiting for room */
+};
+
+static
+void
+pipe_destroy(struct pipe *p)
+{
+	if (p->p_wwchan != NULL) {
+		wchan_destroy(p->p_wwchan);
+	}
+	if (p->p_rwchan != NULL) {
+		wchan_destroy(p->p_rwchan);
+	}
+	spinlock_cleanup(&p->p_lock);
+	if (p->p_wlock != NULL) {
+		lock_destroy(p->p_wlock);
+	}
+	if (p->p_rlock != NULL) {
+		lock_destroy(p->p_rlock);
+	}
+	if (p->p_buf != NULL) {
+		free_kpages((vaddr_t)p->p_buf);
+	}
+	kfree(p);
+}
+
+/*
+ * Called when the last reference to one end goes away.
+ */
+static
+int
+pipe_reclaim(struct vnode *v)
+{
+	struct pipe *p = v->vn_data;
+	bool gone;
+
+	/*
+	 * Do this first: once we drop p_lock below, the other end's
+	 * reclaim may free the whole pipe, vnodes and all.
+	 */
+	vnode_cleanup(v);
+
+	spinlock_acquire(&p->p_lock);
+	if (v == &p->p_rvn) {
+		KASSERT(!p->p_rclosed);
+		p->p_rclosed = true;
+		wchan_wakeall(p->p_wwchan, &p->p_lock);
+	}
+	else {
+		KASSERT(v == &p->p_wvn);
+		KASSERT(!p->p_wclosed);
+		p->p_wclosed = true;
+		wchan_wakeall(p->p_rwchan, &p->p_lock);
+	}
+	gone = p->p_rclosed && p->p_wclosed;
+	spinlock_release(&p->p_lock);
+
+	if (gone) {
+		pipe_destroy(p);
+	}
+	return 0;
+}
+
+static
+int
+pipe_eachopen(struct vnode *v, int flags)
+{
+	/* Pipes aren't reachable by name, so this can't happen. */
+	(void)v;
+	(void)flags;
+	return EINVAL;
+}
+
+/*
+ * Process-exit hook: wake up whoever's waiting on the pipe, so a
+ * thread of an exiting process can give up.
+ */
+static
+void
+pipe_intr(void *vp)
+{
+	struct pipe *p = vp;
+
+	spinlock_acquire(&p->p_lock);
+	wchan_wakeall(p->p_rwchan, &p->p_lock);
+	wchan_wakeall(p->p_wwchan, &p->p_lock);
+	spinlock_release(&p->p_lock);
+}
+
+/*
+ * Read. Waits until there's something to read or the write end is
+ * closed (EOF), then takes whatever is there, up to what was asked.
+ * Fails with EINTR if the process exits while we're waiting.
+ */
+static
+int
+pipe_read(struct vnode *v, struct uio *uio)
+{
+	struct pipe *p = v->vn_data;
+	struct proc_intr pi;
+	unsigned head, n;
+	int result;
+
+	if (v != &p->p_rvn) {
+		return EBADF;
+	}
+
+	lock_acquire(p->p_rlock);
+	proc_intr_enter(&pi, pipe_intr, p);
+	spinlock_acquire(&p->p_lock);
+	while (p->p_count == 0 && !p->p_wclosed && !proc_exiting()) {
+		wchan_sleep(p->p_rwchan, &p->p_lock);
+	}
+
+	result = (p->p_count == 0 && !p->p_wclosed) ? EINTR : 0;
+	while (p->p_count > 0 && uio->uio_resid > 0) {
+		head = p->p_head;
+		/* Up to the end of the ring; a wrap takes a second pass. */
+		n = p->p_count;
+		if (n > PIPE_SIZE - head) {
+			n = PIPE_SIZE - head;
+		}
+		if (n > uio->uio_resid) {
+			n = uio->uio_resid;
+		}
+		spinlock_release(&p->p_lock);
+
+		result = uiomove(p->p_buf + head, n, uio);
+
+		spinlock_acquire(&p->p_lock);
+		if (result) {
+			break;
+		}
+		p->p_head = (head + n) % PIPE_SIZE;
+		p->p_count -= n;
+		wchan_wakeall(p->p_wwchan, &p->p_lock);
+	}
+	spinlock_release(&p->p_lock);
+	proc_intr_leave(&pi);
+	lock_release(p->p_rlock);
+	return result;
+}
+
+/*
+ * Write. Fails with EPIPE if the read end is closed before anything
+ * was written; if it closes partway, the short count is returned.
+ * Likewise EINTR, if the process exits while we're waiting for room.
+ */
+static
+int
+pipe_write(struct vnode *v, struct uio *uio)
+{
+	struct pipe *p = v->vn_data;
+	struct proc_intr pi;
+	size_t len, need;
+	unsigned tail, n;
+	int result;
+
+	if (v != &p->p_wvn) {
+		return EBADF;
+	}
+
+	len = uio->uio_resid;
+	need = (len <= PIPE_BUF) ? len : 1;
+
+	lock_acquire(p->p_wlock);
+	proc_intr_enter(&pi, pipe_intr, p);
+	spinlock_acquire(&p->p_lock);
+
+	result = 0;
+	while (uio->uio_resid > 0) {
+		while (!p->p_rclosed && PIPE_SIZE - p->p_count < need &&
+		       !proc_exiting()) {
+			wchan_sleep(p->p_wwchan, &p->p_lock);
+		}
+		if (p->p_rclosed) {
+			if (uio->uio_resid == len) {
+				result = EPIPE;
+			}
+			break;
+		}
+		if (PIPE_SIZE - p->p_count < need) {
+			/* The process is exiting. */
+			if (uio->uio_resid == len) {
+				result = EINTR;
+			}
+			break;
+		}
+
+		/* Head moves under us, but head+count doesn't. */
+		tail = (p->p_head + p->p_count) % PIPE_SIZE;
+		n = PIPE_SIZE - p->p_count;
+		if (n > PIPE_SIZE - tail) {
+			n = PIPE_SIZE - tail;
+		}
+		if (n > uio->uio_resid) {
+			n = uio->uio_resid;
+		}
+		spinlock_release(&p->p_lock);
+
+		result = uiomove(p->p_buf + tail, n, uio);
+
+		spinlock_acquire(&p->p_lock);
+		if (result) {
+			break;
+		}
+		p->p_count += n;
+		wchan_wakeall(p->p_rwchan, &p->p_lock);
+		/* Any room we waited for is still ours. */
+		need = 1;
+	}
+	spinlock_release(&p->p_lock);
+	proc_intr_leave(&pi);
+	lock_release(p->p_wlock);
+	return result;
+}
+
+static
+int
+pipe_ioctl(struct vnode *v, int op, userptr_t data)
+{
+	(void)v;
+	(void)op;
+	(void)data;
+	return EINVAL;
+}
+
+static
+int
+pipe_gettype(struct vnode *v, mode_t *ret)
+{
+	(void)v;
+	*ret = S_IFIFO;
+	return 0;
+}
+
+static
+int
+pipe_stat(struct vnode *v, struct stat *statbuf)
+{
+	struct pipe *p = v->vn_data;
+	int result;
+
+	bzero(statbuf, sizeof(struct stat));
+
+	result = VOP_GETTYPE(v, &statbuf->st_mode);
+	if (result) {
+		return result;
+	}
+	statbuf->st_mode |= 0600;
+	statbuf->st_nlink = 1;
+	statbuf->st_blksize = PIPE_BUF;
+
+	spinlock_acquire(&p->p_lock);
+	statbuf->st_size = p->p_count;
+	spinlock_release(&p->p_lock);
+
+	return 0;
+}
+
+static
+bool
+pipe_isseekable(struct vnode *v)
+{
+	(void)v;
+	return false;
+}
+
+static
+int
+pipe_fsync(struct vnode *v)
+{
+	(void)v;
+	return EINVAL;
+}
+
+static
+int
+pipe_truncate(struct vnode *v, off_t len)
+{
+	(void)v;
+	(void)len;
+	return EINVAL;
+}
+
+static const struct vnode_ops pipe_vnode_ops = {
+	.vop_magic = VOP_MAGIC,
+
+	.vop_eachopen = pipe_eachopen,
+	.vop_reclaim = pipe_reclaim,
+	.vop_read = pipe_read,
+	.vop_readlink = vopfail_uio_inval,
+	.vop_getdirentry = vopfail_uio_notdir,
+	.vop_write = pipe_write,
+	.vop_ioctl = pipe_ioctl,
+	.vop_stat = pipe_stat,
+	.vop_gettype = pipe_gettype,
+	.vop_isseekable = pipe_isseekable,
+	.vop_fsync = pipe_fsync,
+	.vop_mmap = vopfail_mmap_perm,
+	.vop_truncate = pipe_truncate,
+	.vop_namefile = vopfail_uio_inval,
+	.vop_creat = vopfail_creat_notdir,
+	.vop_symlink = vopfail_symlink_notdir,
+	.vop_mkdir = vopfail_mkdir_notdir,
+	.vop_link = vopfail_link_notdir,
+	.vop_remove = vopfail_string_notdir,
+	.vop_rmdir = vopfail_string_notdir,
+	.vop_rename = vopfail_rename_notdir,
+	.vop_lookup = vopfail_lookup_notdir,
+	.vop_lookparent = vopfail_lookparent_notdir,
+};
+
+int
+pipe_create(struct vnode **rd, struct vnode **wr)
+{
+	struct pipe *p;
+	vaddr_t page;
+
+	p = kmalloc(sizeof(*p));
+	if (p == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&p->p_lock);
+	p->p_head = 0;
+	p->p_count = 0;
+	p->p_rclosed = false;
+	p->p_wclosed = false;
+	p->p_buf = NULL;
+	p->p_rlock = lock_create("pipe-r");
+	p->p_wlock = lock_create("pipe-w");
+	p->p_rwchan = wchan_create("pipe-r");
+	p->p_wwchan = wchan_create("pipe-w");
+	page = alloc_kpages(1);
+	if (page != 0) {
+		p->p_buf = (char *)page;
+	}
+	if (p->p_rlock == NULL || p->p_wlock == NULL ||
+	    p->p_rwchan == NULL || p->p_wwchan == NULL || p->p_buf == NULL) {
+		pipe_destroy(p);
+		return ENOMEM;
+	}
+
+	vnode_init(&p->p_rvn, &pipe_vnode_ops, NULL, p);
+	vnode_init(&p->p_wvn, &pipe_vnode_ops, NULL, p);
+
+	*rd = &p->p_rvn;
+	*wr = &p->p_wvn;
+	return 0;
+}
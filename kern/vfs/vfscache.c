@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * VFS name cache.
+ *
+ * Caches the result of looking up a single pathname component in a
+ * directory: (directory vnode, name) -> vnode, or "no such file".
+ * vfs_lookup consults it before calling VOP_LOOKUP, so repeatedly
+ * used names don't go back to the filesystem's directory search.
+ *
+ * Positive entries hold a reference to the vnode found, and every
+ * entry holds one to its directory, so a cached vnode pointer can't
+ * be recycled behind our back. vfspath.c invalidates a name whenever
+ * it might have been created, removed or renamed, both before the
+ * operation (so nobody gets a stale hit while it's in progress) and
+ * after (to catch lookups that raced it); unmount purges everything
+ * for the filesystem.
+ *
+ * Invalidation goes by (filesystem, name) rather than by directory,
+ * since the directory vnode lookparent hands back isn't necessarily
+ * the one the name was cached under.
+ *
+ * A lookup that misses races with creates and removes, so it reads
+ * vfs_ncgen beforehand and vfs_ncache_enter drops the result if any
+ * invalidation happened in between.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <limits.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vfs.h>
+#include <vnode.h>
+
+/* Maximum number of entries, and number of hash chains (a power of 2). */
+#define VFS_NCACHE_SIZE 128
+#define VFS_NCACHE_HASH 64
+
+struct vfs_ncentry {
+	struct vfs_ncentry *nc_hashnext;	/* Next in hash chain */
+	struct vfs_ncentry *nc_lrunext;		/* Toward least recent */
+	struct vfs_ncentry *nc_lruprev;		/* Toward most recent */
+	struct vnode *nc_dir;			/* Directory searched */
+	struct vnode *nc_vn;			/* Result, or NULL */
+	char *nc_name;				/* Name searched for */
+};
+
+/*
+ * vfs_ncspin covers everything below. Vnodes are only decref'd after
+ * it's released, since that can call into the filesystem.
+ */
+static struct spinlock vfs_ncspin = SPINLOCK_INITIALIZER;
+static struct vfs_ncentry *vfs_nchash[VFS_NCACHE_HASH];
+static struct vfs_ncentry *vfs_nclruhead, *vfs_nclrutail;
+static unsigned vfs_nccount;
+static unsigned vfs_ncgen;
+
+static
+unsigned
+vfs_ncache_hashval(const char *name)
+{
+	unsigned h = 5381;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h & (VFS_NCACHE_HASH - 1);
+}
+
+static
+void
+vfs_ncache_lruremove(struct vfs_ncentry *nc)
+{
+	if (nc->nc_lruprev != NULL) {
+		nc->nc_lruprev->nc_lrunext = nc->nc_lrunext;
+	}
+	else {
+		vfs_nclruhead = nc->nc_lrunext;
+	}
+	if (nc->nc_lrunext != NULL) {
+		nc->nc_lrunext->nc_lruprev = nc->nc_lruprev;
+	}
+	else {
+		vfs_nclrutail = nc->nc_lruprev;
+	}
+	nc->nc_lrunext = nc->nc_lruprev = NULL;
+}
+
+static
+void
+vfs_ncache_lruinsert(struct vfs_ncentry *nc)
+{
+	nc->nc_lruprev = NULL;
+	nc->nc_lrunext = vfs_nclruhead;
+	if (vfs_nclruhead != NULL) {
+		vfs_nclruhead->nc_lruprev = nc;
+	}
+	else {
+		vfs_nclrutail = nc;
+	}
+	vfs_nclruhead = nc;
+}
+
+/*
+ * Take an entry out of the cache. The caller must destroy it after
+ * releasing vfs_ncspin.
+ */
+static
+void
+vfs_ncache_unlink(struct vfs_ncentry *nc)
+{
+	struct vfs_ncentry **ncp;
+
+	KASSERT(spinlock_do_i_hold(&vfs_ncspin));
+
+	ncp = &vfs_nchash[vfs_ncache_hashval(nc->nc_name)];
+	while (*ncp != nc) {
+		KASSERT(*ncp != NULL);
+		ncp = &(*ncp)->nc_hashnext;
+	}
+	*ncp = nc->nc_hashnext;
+	nc->nc_hashnext = NULL;
+	vfs_ncache_lruremove(nc);
+	vfs_nccount--;
+}
+
+static
+void
+vfs_ncache_destroy(struct vfs_ncentry *nc)
+{
+	KASSERT(!spinlock_do_i_hold(&vfs_ncspin));
+
+	if (nc->nc_vn != NULL) {
+		VOP_DECREF(nc->nc_vn);
+	}
+	VOP_DECREF(nc->nc_dir);
+	kfree(nc->nc_name);
+	kfree(nc);
+}
+
+/*
+ * Destroy a list of unlinked entries chained through nc_hashnext.
+ */
+static
+void
+vfs_ncache_destroylist(struct vfs_ncentry *list)
+{
+	struct vfs_ncentry *next;
+
+	for (; list != NULL; list = next) {
+		next = list->nc_hashnext;
+		vfs_ncache_destroy(list);
+	}
+}
+
+/*
+ * Check if NAME is something we cache: a single, ordinary component.
+ */
+bool
+vfs_ncache_ok(struct vnode *dir, const char *name)
+{
+	size_t len;
+
+	if (dir->vn_fs == NULL) {
+		/* device vnode */
+		return false;
+	}
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return false;
+	}
+	len = strlen(name);
+	return len > 0 && len <= NAME_MAX && strchr(name, '/') == NULL;
+}
+
+/*
+ * Look up NAME in DIR. On a hit, returns true and hands back the
+ * vnode (with a reference) in RET, or NULL if the name is known not
+ * to exist. On a miss, returns false and hands back in GEN the value
+ * to pass to vfs_ncache_enter.
+ */
+bool
+vfs_ncache_lookup(struct vnode *dir, const char *name, struct vnode **ret,
+		  unsigned *gen)
+{
+	struct vfs_ncentry *nc;
+
+	spinlock_acquire(&vfs_ncspin);
+	for (nc = vfs_nchash[vfs_ncache_hashval(name)]; nc != NULL;
+	     nc = nc->nc_hashnext) {
+		if (nc->nc_dir == dir && !strcmp(nc->nc_name, name)) {
+			vfs_ncache_lruremove(nc);
+			vfs_ncache_lruinsert(nc);
+			if (nc->nc_vn != NULL) {
+				VOP_INCREF(nc->nc_vn);
+			}
+			*ret = nc->nc_vn;
+			spinlock_release(&vfs_ncspin);
+			return true;
+		}
+	}
+	*gen = vfs_ncgen;
+	spinlock_release(&vfs_ncspin);
+	return false;
+}
+
+/*
+ * Record the result of looking up NAME in DIR: VN, or NULL for "no
+ * such file". GEN is what vfs_ncache_lookup handed back. Failure to
+ * allocate just means the result isn't cached.
+ */
+void
+vfs_ncache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		 unsigned gen)
+{
+	struct vfs_ncentry *nc, *old, *victim = NULL;
+
+	nc = kmalloc(sizeof(*nc));
+	if (nc == NULL) {
+		return;
+	}
+	nc->nc_name = kstrdup(name);
+	if (nc->nc_name == NULL) {
+		kfree(nc);
+		return;
+	}
+	nc->nc_dir = dir;
+	nc->nc_vn = vn;
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+
+	spinlock_acquire(&vfs_ncspin);
+
+	if (gen != vfs_ncgen) {
+		/* Something changed since the lookup; result may be stale. */
+		spinlock_release(&vfs_ncspin);
+		vfs_ncache_destroy(nc);
+		return;
+	}
+
+	/* Someone else may have got here first. */
+	for (old = vfs_nchash[vfs_ncache_hashval(name)]; old != NULL;
+	     old = old->nc_hashnext) {
+		if (old->nc_dir == dir && !strcmp(old->nc_name, name)) {
+			spinlock_release(&vfs_ncspin);
+			vfs_ncache_destroy(nc);
+			return;
+		}
+	}
+
+	if (vfs_nccount >= VFS_NCACHE_SIZE) {
+		victim = vfs_nclrutail;
+		KASSERT(victim != NULL);
+		vfs_ncache_unlink(victim);
+	}
+
+	nc->nc_hashnext = vfs_nchash[vfs_ncache_hashval(name)];
+	vfs_nchash[vfs_ncache_hashval(name)] = nc;
+	vfs_ncache_lruinsert(nc);
+	vfs_nccount++;
+
+	spinlock_release(&vfs_ncspin);
+
+	if (victim != NULL) {
+		vfs_ncache_destroy(victim);
+	}
+}
+
+/*
+ * Drop any entries for NAME in directories on filesystem FS. Called
+ * after anything that might create, remove or rename NAME.
+ */
+void
+vfs_ncache_invalidate(struct fs *fs, const char *name)
+{
+	struct vfs_ncentry *nc, *next, *dead = NULL;
+
+	spinlock_acquire(&vfs_ncspin);
+	vfs_ncgen++;
+	for (nc = vfs_nchash[vfs_ncache_hashval(name)]; nc != NULL;
+	     nc = next) {
+		next = nc->nc_hashnext;
+		if (nc->nc_dir->vn_fs == fs && !strcmp(nc->nc_name, name)) {
+			vfs_ncache_unlink(nc);
+			nc->nc_hashnext = dead;
+			dead = nc;
+		}
+	}
+	spinlock_release(&vfs_ncspin);
+
+	vfs_ncache_destroylist(dead);
+}
+
+/*
+ * Drop all entries for filesystem FS, so it can be unmounted.
+ */
+void
+vfs_ncache_purgefs(struct fs *fs)
+{
+	struct vfs_ncentry *nc, *next, *dead = NULL;
+
+	spinlock_acquire(&vfs_ncspin);
+	vfs_ncgen++;
+	for (nc = vfs_nclruhead; nc != NULL; nc = next) {
+		next = nc->nc_lrunext;
+		if (nc->nc_dir->vn_fs == fs) {
+			vfs_ncache_unlink(nc);
+			nc->nc_hashnext = dead;
+			dead = nc;
+		}
+	}
+	spinlock_release(&vfs_ncspin);
+
+	vfs_ncache_destroylist(dead);
+}
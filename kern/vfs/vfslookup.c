@@ -239,11 +239,14 @@ vfs_lookparent(char *path, struct vnode **retval,
 	struct vnode *startvn;
 	int result;
 
+	/*
+	 * The big lock protects the mount list and bootfs; the
+	 * filesystem locks the directory itself.
+	 */
 	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -261,7 +264,6 @@ vfs_lookparent(char *path, struct vnode **retval,
 
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -269,25 +271,43 @@ int
 vfs_lookup(char *path, struct vnode **retval)
 {
 	struct vnode *startvn;
+	char name[NAME_MAX+1];
+	unsigned gen;
 	int result;
 
 	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
+	if (!vfs_ncache_ok(startvn, path)) {
+		result = VOP_LOOKUP(startvn, path, retval);
+		VOP_DECREF(startvn);
+		return result;
+	}
+
+	if (vfs_ncache_lookup(startvn, path, retval, &gen)) {
+		VOP_DECREF(startvn);
+		return *retval == NULL ? ENOENT : 0;
+	}
+
+	/* VOP_LOOKUP may destroy the path, so keep a copy of the name. */
+	strcpy(name, path);
 	result = VOP_LOOKUP(startvn, path, retval);
+	if (result == 0) {
+		vfs_ncache_enter(startvn, name, *retval, gen);
+	}
+	else if (result == ENOENT) {
+		vfs_ncache_enter(startvn, name, NULL, gen);
+	}
 
 	VOP_DECREF(startvn);
-	vfs_biglock_release();
 	return result;
 }
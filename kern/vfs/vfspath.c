@@ -73,7 +73,15 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 			return result;
 		}
 
+		/*
+		 * Drop any negative name cache entry, both before (so
+		 * a hit can't be served while the create is underway)
+		 * and after (so a lookup that raced it can't re-enter
+		 * a stale one).
+		 */
+		vfs_ncache_invalidate(dir->vn_fs, name);
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
+		vfs_ncache_invalidate(dir->vn_fs, name);
 
 		VOP_DECREF(dir);
 	}
@@ -145,7 +153,9 @@ vfs_remove(char *path)
 		return result;
 	}
 
+	vfs_ncache_invalidate(dir->vn_fs, name);
 	result = VOP_REMOVE(dir, name);
+	vfs_ncache_invalidate(dir->vn_fs, name);
 	VOP_DECREF(dir);
 
 	return result;
@@ -178,7 +188,11 @@ vfs_rename(char *oldpath, char *newpath)
 		return EXDEV;
 	}
 
+	vfs_ncache_invalidate(olddir->vn_fs, oldname);
+	vfs_ncache_invalidate(newdir->vn_fs, newname);
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	vfs_ncache_invalidate(olddir->vn_fs, oldname);
+	vfs_ncache_invalidate(newdir->vn_fs, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -212,7 +226,9 @@ vfs_link(char *oldpath, char *newpath)
 		return EXDEV;
 	}
 
+	vfs_ncache_invalidate(newdir->vn_fs, newname);
 	result = VOP_LINK(newdir, newname, oldfile);
+	vfs_ncache_invalidate(newdir->vn_fs, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -239,7 +255,9 @@ vfs_symlink(const char *contents, char *path)
 		return result;
 	}
 
+	vfs_ncache_invalidate(newdir->vn_fs, newname);
 	result = VOP_SYMLINK(newdir, newname, contents);
+	vfs_ncache_invalidate(newdir->vn_fs, newname);
 	VOP_DECREF(newdir);
 
 	return result;
@@ -285,7 +303,9 @@ vfs_mkdir(char *path, mode_t mode)
 		return result;
 	}
 
+	vfs_ncache_invalidate(parent->vn_fs, name);
 	result = VOP_MKDIR(parent, name, mode);
+	vfs_ncache_invalidate(parent->vn_fs, name);
 
 	VOP_DECREF(parent);
 
@@ -307,7 +327,9 @@ vfs_rmdir(char *path)
 		return result;
 	}
 
+	vfs_ncache_invalidate(parent->vn_fs, name);
 	result = VOP_RMDIR(parent, name);
+	vfs_ncache_invalidate(parent->vn_fs, name);
 
 	VOP_DECREF(parent);
 
@@ -129,7 +129,12 @@ vnode_decref(struct vnode *vn)
 void
 vnode_check(struct vnode *v, const char *opstr)
 {
-	vfs_biglock_acquire();
+	/*
+	 * This runs before every VOP, so it must not take the big
+	 * lock: filesystems do their own locking, and a caller
+	 * holding a vnode lock would otherwise deadlock against
+	 * vfs_sync.
+	 */
 
 	if (v == NULL) {
 		panic("vnode_check: vop_%s: null vnode\n", opstr);
@@ -173,5 +178,4 @@ vnode_check(struct vnode *v, const char *opstr)
 	}
 
 	spinlock_release(&v->vn_countlock);
-	vfs_biglock_release();
 }
@@ -34,6 +34,8 @@
 #include <vm.h>
 #include <proc.h>
 #include <coremap.h>
+#include <atomic.h>
+#include <synch.h>
 #include <spl.h>
 #include <mips/tlb.h>
 
@@ -57,6 +59,13 @@ as_create(void)
 		kfree(as);
 		return NULL;
 	}
+	as->as_lock = lock_create("addrspace");
+	if (as->as_lock == NULL) {
+		kfree(as->pt_dir);
+		kfree(as);
+		return NULL;
+	}
+	as->as_refcount = 1;
 
 	for (int i = 0; i < PAGE_TABLE_SIZE; ++i) {
 		as->pt_dir->pt_table[i] = NULL;
@@ -78,10 +87,14 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
+	/* Other threads sharing OLD mustn't change it under us. */
+	lock_acquire(old->as_lock);
+
 	// copy segments, heap, stackptr
 	if (old->segments != NULL) {
 		newas->segments = kmalloc(sizeof(struct segment));
 		if (newas->segments == NULL) {
+			lock_release(old->as_lock);
 			return ENOMEM;
 		}
 		*(newas->segments) = *(old->segments);
@@ -91,6 +104,7 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 			new_segment->next_segment = kmalloc(sizeof(struct segment));
 			if (new_segment->next_segment == NULL) {
 				kfree(newas->segments);
+				lock_release(old->as_lock);
 				return ENOMEM;
 			}
 			new_segment = new_segment->next_segment;
@@ -102,6 +116,7 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	if (old->heap != NULL) {
 		newas->heap = kmalloc(sizeof(struct segment));
 		if (newas->heap == NULL) {
+			lock_release(old->as_lock);
 			return ENOMEM;
 		}
 		*(newas->heap) = *(old->heap);
@@ -115,6 +130,7 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		} else {
 			(newas->pt_dir)->pt_table[i] = kmalloc(sizeof(struct page_table));
 			if ((newas->pt_dir)->pt_table[i] == NULL) {
+				lock_release(old->as_lock);
 				return ENOMEM;
 			}
 			for (int j = 0; j < PAGE_TABLE_SIZE; ++j) {
@@ -124,11 +140,13 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 				} else {
 					struct page_table_entry *new_pte = kmalloc(sizeof(struct page_table_entry));
 					if (new_pte == NULL) {
+						lock_release(old->as_lock);
 						return ENOMEM;
 					}
 					if (pte->valid && pte->pbase != 0) {
 						paddr_t new_pa = 0;
 						if ((new_pa = single_page_alloc(USER)) == 0) {
+							lock_release(old->as_lock);
 							return ENOMEM;
 						}
 						new_pte->pbase = new_pa;
@@ -148,13 +166,26 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		}
 	}
 
+	lock_release(old->as_lock);
+
 	*ret = newas;
 	return 0;
 }
 
+void
+as_incref(struct addrspace *as)
+{
+	atomic_add(&as->as_refcount, 1);
+}
+
 void
 as_destroy(struct addrspace *as)
 {
+	if (atomic_add(&as->as_refcount, -1) != 0) {
+		/* Still in use by another thread. */
+		return;
+	}
+
 	for (unsigned i = 0; i < PAGE_TABLE_SIZE; ++i) {
 		struct page_table *pt = (as->pt_dir)->pt_table[i];
 		if (pt != NULL) {
@@ -180,6 +211,7 @@ as_destroy(struct addrspace *as)
 
 	kfree(as->heap);
 	kfree(as->pt_dir);
+	lock_destroy(as->as_lock);
 	kfree(as);
 }
 
@@ -355,12 +355,101 @@ static struct {
 	{ NULL, NULL }
 };
 
+/*
+ * dopipeline
+ * runs ARGS, which has at least one "|" in it, as a pipeline: each
+ * stage's standard output feeds the next one's standard input. waits
+ * for all of them; the exit status is the last stage's.
+ */
+static
+void
+dopipeline(char **args, int nargs, struct exitinfo *ei)
+{
+	pid_t pids[NARG_MAX / 2 + 1];
+	int npids, start, i, infd, last, status;
+	int fds[2];
+	pid_t pid;
+
+	npids = 0;
+	infd = -1;
+	start = 0;
+	for (i=0; i<=nargs; i++) {
+		if (i < nargs && strcmp(args[i], "|")) {
+			continue;
+		}
+		args[i] = NULL;
+		if (i == start) {
+			printf("sh: Empty command in pipeline\n");
+			break;
+		}
+		last = (i == nargs);
+
+		if (!last && pipe(fds) < 0) {
+			warn("pipe");
+			break;
+		}
+		pid = fork();
+		if (pid < 0) {
+			warn("fork");
+			if (!last) {
+				close(fds[0]);
+				close(fds[1]);
+			}
+			break;
+		}
+		if (pid == 0) {
+			/* child */
+			if (infd >= 0) {
+				dup2(infd, STDIN_FILENO);
+				close(infd);
+			}
+			if (!last) {
+				dup2(fds[1], STDOUT_FILENO);
+				close(fds[0]);
+				close(fds[1]);
+			}
+			execvp(args[start], &args[start]);
+			warn("%s", args[start]);
+			_exit(1);
+		}
+
+		/* parent */
+		pids[npids++] = pid;
+		if (infd >= 0) {
+			close(infd);
+			infd = -1;
+		}
+		if (!last) {
+			/* the read end goes to the next stage */
+			close(fds[1]);
+			infd = fds[0];
+		}
+		start = i+1;
+	}
+
+	/* if we bailed out early, make sure the stages started see EOF */
+	if (infd >= 0) {
+		close(infd);
+	}
+
+	exitinfo_exit(ei, 255);
+	for (i=0; i<npids; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			warn("waitpid");
+		}
+		else if (i == npids-1 && start > nargs) {
+			readstatus(status, ei);
+		}
+	}
+}
+
 /*
  * docommand
  * tokenizes the command line using strtok.  if there aren't any commands,
  * simply returns.  checks to see if it's a builtin, running it if it is.
  * otherwise, it's a standard command.  check for the '&', try to background
- * the job if possible, otherwise just run it and wait on it.
+ * the job if possible, otherwise just run it and wait on it. commands with
+ * a "|" in them are handed to dopipeline, and can't be backgrounded.
  */
 static
 void
@@ -417,6 +506,22 @@ docommand(char *buf, struct exitinfo *ei)
 		bg = 1;
 	}
 
+	for (i=0; i<nargs; i++) {
+		if (!strcmp(args[i], "|")) {
+			break;
+		}
+	}
+	if (i < nargs) {
+		if (bg) {
+			printf("%s: Pipelines can't be run in the background\n",
+			       args[0]);
+			exitinfo_exit(ei, 1);
+			return;
+		}
+		dopipeline(args, nargs, ei);
+		return;
+	}
+
 	if (timing) {
 		__time(&startsecs, &startnsecs);
 	}
@@ -39,6 +39,8 @@
  * about the kern/ headers.
  */
 #include <kern/fcntl.h>
+#include <kern/futex.h>
+#include <kern/iovec.h>
 #include <kern/ioctl.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
@@ -121,6 +123,19 @@ pid_t waitpid(pid_t pid, int *returncode, int flags);
 int open(const char *filename, int flags, ...);
 ssize_t read(int filehandle, void *buf, size_t size);
 ssize_t write(int filehandle, const void *buf, size_t size);
+/*
+ * Scatter/gather and positional versions of read and write. The p*
+ * forms use the offset given and leave the file's own offset alone;
+ * they fail with ESPIPE on things that can't seek.
+ */
+ssize_t pread(int filehandle, void *buf, size_t size, off_t offset);
+ssize_t pwrite(int filehandle, const void *buf, size_t size, off_t offset);
+ssize_t readv(int filehandle, const struct iovec *iov, int iovcnt);
+ssize_t writev(int filehandle, const struct iovec *iov, int iovcnt);
+ssize_t preadv(int filehandle, const struct iovec *iov, int iovcnt,
+	       off_t offset);
+ssize_t pwritev(int filehandle, const struct iovec *iov, int iovcnt,
+		off_t offset);
 int close(int filehandle);
 int reboot(int code);
 int sync(void);
@@ -147,7 +162,12 @@ ssize_t readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
+int nanosleep(const struct timespec *req, struct timespec *rem);
 ssize_t __getcwd(char *buf, size_t buflen);
+int futex(volatile int *uaddr, int op, int val);
+int __thread_create(void (*entry)(void *), void *arg, void *stack);
+__DEAD void thread_exit(int code);
+int thread_join(int tid, int *code);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -158,5 +178,7 @@ ssize_t __getcwd(char *buf, size_t buflen);
 int execvp(const char *prog, char *const *args); /* calls execv */
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
+int thread_create(int (*func)(void *), void *arg,
+		  void *stack, size_t stacksize);	/* calls __thread_create */
 
 #endif /* _UNISTD_H_ */
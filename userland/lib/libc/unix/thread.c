@@ -0,0 +1,53 @@
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * thread_create: start FUNC(ARG) in a new thread of this process,
+ * running on the caller-supplied stack STACK of STACKSIZE bytes.
+ * Returns the new thread's id, or -1 with errno set.
+ *
+ * The kernel (__thread_create) starts the thread at an address with
+ * an argument and a stack pointer, and nothing to return to. So we
+ * start it in thread_start instead, with FUNC and ARG parked at the
+ * top of its stack, and that makes the return value into the
+ * thread's exit code.
+ */
+
+struct thread_start {
+	int (*ts_func)(void *);
+	void *ts_arg;
+};
+
+static
+void
+thread_start(void *data)
+{
+	struct thread_start *ts = data;
+
+	thread_exit(ts->ts_func(ts->ts_arg));
+}
+
+int
+thread_create(int (*func)(void *), void *arg, void *stack, size_t stacksize)
+{
+	struct thread_start *ts;
+	uintptr_t top;
+
+	if (stacksize < 1024) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Keep the stack 8-byte aligned, as the calling convention wants. */
+	top = ((uintptr_t)stack + stacksize) & ~(uintptr_t)7;
+	top -= (sizeof(*ts) + 7) & ~(size_t)7;
+	ts = (struct thread_start *)top;
+	ts->ts_func = func;
+	ts->ts_arg = arg;
+
+	/* Leave the 16 bytes a callee may store its arguments in. */
+	top -= 16;
+
+	return __thread_create(thread_start, ts, (void *)top);
+}
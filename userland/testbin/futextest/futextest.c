@@ -0,0 +1,233 @@
+/*
+ * futextest.c
+ *
+ * 	Builds a mutex out of futex() and an atomic compare-and-swap,
+ * 	has several threads bang on it, and times that against the
+ * 	same work done with a semfs semaphore (as in usemtest) for the
+ * 	lock. Checks that no increments of the shared counter were
+ * 	lost either way.
+ *
+ * 	The futex lock only goes into the kernel when there's
+ * 	contention, so it should be a good deal faster.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#define NTHREADS  4
+#define LOOPS     2000
+#define STACKSIZE 16384
+#define SEMNAME   "sem:futextest"
+
+static char stacks[NTHREADS][STACKSIZE];
+static volatile unsigned counter;
+
+////////////////////////////////////////////////////////////
+// futex mutex
+
+/*
+ * Atomic compare-and-swap with LL/SC; returns the old value. Same as
+ * the kernel's atomic_cas.
+ */
+static
+int
+cas(volatile int *p, int oldval, int newval)
+{
+	int x, y;
+
+	do {
+		y = newval;
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"sync;"			/* barrier before */
+			"ll %0, 0(%2);"		/*   x = *p */
+			"bne %0, %3, 1f;"	/*   if (x != oldval) done */
+			"sc %1, 0(%2);"		/*   *p = y; y = success? */
+			"1: sync;"		/* barrier after */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "+r" (y)
+			: "r" (p), "r" (oldval)
+			: "memory");
+	} while (x == oldval && y == 0);
+
+	return x;
+}
+
+static
+int
+swap(volatile int *p, int newval)
+{
+	int x;
+
+	do {
+		x = *p;
+	} while (cas(p, x, newval) != x);
+	return x;
+}
+
+/*
+ * The lock word is 0 when free, 1 when held, and 2 when held and
+ * someone may be asleep on it, so unlock only has to call the kernel
+ * in that last case.
+ */
+static volatile int fmutex;
+
+static
+void
+fmutex_lock(volatile int *m)
+{
+	int c;
+
+	c = cas(m, 0, 1);
+	if (c == 0) {
+		return;
+	}
+	if (c != 2) {
+		c = swap(m, 2);
+	}
+	while (c != 0) {
+		if (futex(m, FUTEX_WAIT, 2) < 0 && errno != EAGAIN) {
+			err(1, "futex wait");
+		}
+		c = swap(m, 2);
+	}
+}
+
+static
+void
+fmutex_unlock(volatile int *m)
+{
+	if (swap(m, 0) == 2) {
+		if (futex(m, FUTEX_WAKE, 1) < 0) {
+			err(1, "futex wake");
+		}
+	}
+}
+
+static
+int
+futexthread(void *arg)
+{
+	int i;
+
+	(void)arg;
+	for (i=0; i<LOOPS; i++) {
+		fmutex_lock(&fmutex);
+		counter++;
+		fmutex_unlock(&fmutex);
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// semfs semaphore
+
+/*
+ * Each thread opens the semaphore for itself, so a P that blocks
+ * can't hold up a V behind the same open file.
+ */
+static
+int
+semthread(void *arg)
+{
+	int i, fd;
+	char c = 0;
+
+	(void)arg;
+	fd = open(SEMNAME, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", SEMNAME);
+	}
+	for (i=0; i<LOOPS; i++) {
+		if (read(fd, &c, 1) != 1) {
+			err(1, "%s: P", SEMNAME);
+		}
+		counter++;
+		if (write(fd, &c, 1) != 1) {
+			err(1, "%s: V", SEMNAME);
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+static
+void
+sem_setup(void)
+{
+	int fd;
+	char c = 0;
+
+	fd = open(SEMNAME, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", SEMNAME);
+	}
+	/* Start it at 1, so it's a lock. */
+	if (write(fd, &c, 1) != 1) {
+		err(1, "%s: V", SEMNAME);
+	}
+	close(fd);
+}
+
+////////////////////////////////////////////////////////////
+// driver
+
+/*
+ * Run NTHREADS copies of FUNC, check the count, and return the
+ * elapsed time in microseconds.
+ */
+static
+unsigned long
+race(const char *what, int (*func)(void *))
+{
+	time_t s0, s1;
+	unsigned long ns0, ns1;
+	int tids[NTHREADS];
+	int i, code;
+
+	counter = 0;
+	__time(&s0, &ns0);
+	for (i=0; i<NTHREADS; i++) {
+		tids[i] = thread_create(func, NULL, stacks[i], STACKSIZE);
+		if (tids[i] < 0) {
+			err(1, "thread_create");
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		if (thread_join(tids[i], &code) < 0) {
+			err(1, "thread_join");
+		}
+	}
+	__time(&s1, &ns1);
+
+	if (counter != NTHREADS * LOOPS) {
+		errx(1, "%s: counter is %u, expected %u", what, counter,
+		     NTHREADS * LOOPS);
+	}
+	return (unsigned long)(s1 - s0) * 1000000 + ns1 / 1000 - ns0 / 1000;
+}
+
+int
+main(void)
+{
+	unsigned long futexus, semus;
+
+	futexus = race("futex", futexthread);
+
+	sem_setup();
+	semus = race("semfs", semthread);
+	(void)remove(SEMNAME);
+
+	printf("futex mutex: %lu us for %u lock/unlock pairs\n",
+	       futexus, NTHREADS * LOOPS);
+	printf("semfs P/V:   %lu us for %u lock/unlock pairs\n",
+	       semus, NTHREADS * LOOPS);
+	printf("Passed futextest.\n");
+	return 0;
+}
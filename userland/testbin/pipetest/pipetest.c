@@ -0,0 +1,135 @@
+/*
+ * pipetest.c
+ *
+ * 	Tests pipes.
+ *
+ * 	Several children write PIPE_BUF-sized records, each filled with
+ * 	its writer's number, into one pipe; the parent reads them back and
+ * 	checks that no record was broken up by another writer's data.
+ * 	Then checks EOF once all writers are gone, that writing with no
+ * 	reader gives EPIPE, and that a pipe can't be seeked.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <err.h>
+
+#define NKIDS 4
+#define NRECORDS 64
+
+static char buf[PIPE_BUF];
+
+static
+void
+writer(int fd, int which)
+{
+	int i;
+
+	memset(buf, 'A' + which, sizeof(buf));
+	for (i=0; i<NRECORDS; i++) {
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+			err(1, "writer %d: write", which);
+		}
+	}
+	_exit(0);
+}
+
+/* Read exactly one record, which may take more than one read. */
+static
+int
+readrecord(int fd)
+{
+	size_t got;
+	int len;
+
+	got = 0;
+	while (got < sizeof(buf)) {
+		len = read(fd, buf + got, sizeof(buf) - got);
+		if (len < 0) {
+			err(1, "read");
+		}
+		if (len == 0) {
+			if (got > 0) {
+				errx(1, "EOF in the middle of a record");
+			}
+			return 0;
+		}
+		got += len;
+	}
+	return 1;
+}
+
+int
+main(void)
+{
+	int fds[2];
+	int counts[NKIDS];
+	pid_t pids[NKIDS];
+	int i, j, n, status;
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+
+	for (i=0; i<NKIDS; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			close(fds[0]);
+			writer(fds[1], i);
+		}
+		counts[i] = 0;
+	}
+	/* Drop our write end, or we'd never see EOF. */
+	close(fds[1]);
+
+	n = 0;
+	while (readrecord(fds[0])) {
+		j = buf[0] - 'A';
+		if (j < 0 || j >= NKIDS) {
+			errx(1, "Record %d: garbage", n);
+		}
+		for (i=1; i<PIPE_BUF; i++) {
+			if (buf[i] != buf[0]) {
+				errx(1, "Record %d: writers interleaved", n);
+			}
+		}
+		counts[j]++;
+		n++;
+	}
+	for (i=0; i<NKIDS; i++) {
+		if (counts[i] != NRECORDS) {
+			errx(1, "Writer %d: got %d records, expected %d",
+			     i, counts[i], NRECORDS);
+		}
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			errx(1, "Writer %d failed", i);
+		}
+	}
+	close(fds[0]);
+
+	/* No reader: the write should fail. */
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+	if (lseek(fds[0], 0, SEEK_SET) >= 0 || errno != ESPIPE) {
+		errx(1, "lseek on a pipe didn't fail with ESPIPE");
+	}
+	close(fds[0]);
+	if (write(fds[1], "x", 1) >= 0 || errno != EPIPE) {
+		errx(1, "write with no reader didn't fail with EPIPE");
+	}
+	close(fds[1]);
+
+	printf("Passed pipetest.\n");
+	return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * preadtest.c
+ *
+ * 	Tests pread/pwrite and readv/writev.
+ *
+ * 	Writes a file of numbered blocks with pwrite, out of order, then
+ * 	forks several children that share the one descriptor and each
+ * 	pread a disjoint set of blocks. None of that should move the
+ * 	descriptor's offset. Last, readv/writev are checked to gather
+ * 	and scatter in order.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define FILENAME "preadtest.dat"
+#define BLOCKSIZE 512
+#define NBLOCKS 32
+#define NKIDS 4
+
+static char buf[BLOCKSIZE];
+
+static
+void
+fill(int block)
+{
+	int i;
+
+	for (i=0; i<BLOCKSIZE; i++) {
+		buf[i] = (char)(block * 7 + i);
+	}
+}
+
+static
+void
+check(int block)
+{
+	int i;
+
+	for (i=0; i<BLOCKSIZE; i++) {
+		if (buf[i] != (char)(block * 7 + i)) {
+			errx(1, "Block %d: wrong data at byte %d", block, i);
+		}
+	}
+}
+
+static
+void
+kid(int fd, int which)
+{
+	int block;
+	ssize_t len;
+
+	for (block = which; block < NBLOCKS; block += NKIDS) {
+		len = pread(fd, buf, BLOCKSIZE, (off_t)block * BLOCKSIZE);
+		if (len != BLOCKSIZE) {
+			err(1, "pread of block %d returned %d", block, (int)len);
+		}
+		check(block);
+	}
+	_exit(0);
+}
+
+int
+main(void)
+{
+	char a[10], b[20], c[30], d[20];
+	struct iovec iov[3];
+	int fd, i, block, status, failed;
+	pid_t pids[NKIDS];
+	ssize_t len;
+
+	fd = open(FILENAME, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open", FILENAME);
+	}
+
+	/* Write back to front, so each pwrite lands past what's there. */
+	for (block = NBLOCKS - 1; block >= 0; block--) {
+		fill(block);
+		len = pwrite(fd, buf, BLOCKSIZE, (off_t)block * BLOCKSIZE);
+		if (len != BLOCKSIZE) {
+			err(1, "pwrite of block %d returned %d", block, (int)len);
+		}
+	}
+	if (lseek(fd, 0, SEEK_CUR) != 0) {
+		errx(1, "pwrite moved the file offset");
+	}
+
+	for (i=0; i<NKIDS; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			kid(fd, i);
+		}
+	}
+	failed = 0;
+	for (i=0; i<NKIDS; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			failed = 1;
+		}
+	}
+	if (failed) {
+		errx(1, "Some readers failed");
+	}
+	if (lseek(fd, 0, SEEK_CUR) != 0) {
+		errx(1, "pread moved the file offset");
+	}
+
+	/* Now scatter/gather. */
+	memset(a, 'a', sizeof(a));
+	memset(b, 'b', sizeof(b));
+	memset(c, 'c', sizeof(c));
+	iov[0].iov_base = a;
+	iov[0].iov_len = sizeof(a);
+	iov[1].iov_base = b;
+	iov[1].iov_len = sizeof(b);
+	iov[2].iov_base = c;
+	iov[2].iov_len = sizeof(c);
+	len = writev(fd, iov, 3);
+	if (len != sizeof(a) + sizeof(b) + sizeof(c)) {
+		err(1, "writev returned %d", (int)len);
+	}
+
+	memset(a, 0, sizeof(a));
+	memset(b, 0, sizeof(b));
+	memset(c, 0, sizeof(c));
+	memset(d, 0, sizeof(d));
+	/* Read some of them back into different buffers. */
+	iov[0].iov_base = c;
+	iov[0].iov_len = sizeof(a);
+	iov[1].iov_base = b;
+	iov[1].iov_len = sizeof(b);
+	iov[2].iov_base = d;
+	iov[2].iov_len = sizeof(d);
+	len = preadv(fd, iov, 3, 0);
+	if (len != sizeof(a) + sizeof(b) + sizeof(d)) {
+		err(1, "preadv returned %d", (int)len);
+	}
+	for (i=0; i<(int)sizeof(a); i++) {
+		if (c[i] != 'a') {
+			errx(1, "preadv got the wrong data");
+		}
+	}
+	for (i=0; i<(int)sizeof(b); i++) {
+		if (b[i] != 'b' || d[i] != 'c') {
+			errx(1, "preadv got the wrong data");
+		}
+	}
+
+	close(fd);
+	remove(FILENAME);
+	printf("Passed preadtest.\n");
+	return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * threadexit.c
+ *
+ * 	Tests that _exit gets a process out even when its other threads
+ * 	are asleep in the kernel waiting for things that won't happen
+ * 	soon: a pipe nobody writes, a long nanosleep, and a child that
+ * 	takes its time. The parent's waitpid should come back promptly
+ * 	with the exit code; if the test hangs, it failed.
+ *
+ * 	Also checks that two threads can't both wait for the same child.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define STACKSIZE 16384
+#define NSLEEPERS 4
+#define EXITCODE 7
+
+static char stacks[NSLEEPERS][STACKSIZE];
+static int fds[2];
+static pid_t slowkid;
+static volatile int nwaiting;
+static volatile int nechild;
+
+static
+void
+nap(time_t secs, long nsecs)
+{
+	struct timespec ts;
+
+	ts.tv_sec = secs;
+	ts.tv_nsec = nsecs;
+	nanosleep(&ts, NULL);
+}
+
+static
+int
+piper(void *arg)
+{
+	char ch;
+
+	(void)arg;
+	/* We hold the write end ourselves, so this never finishes. */
+	read(fds[0], &ch, 1);
+	errx(1, "pipe read came back");
+}
+
+static
+int
+sleeper(void *arg)
+{
+	(void)arg;
+	nap(1000, 0);
+	errx(1, "nanosleep came back");
+}
+
+static
+int
+waiter(void *arg)
+{
+	int status;
+
+	(void)arg;
+	nwaiting++;
+	if (waitpid(slowkid, &status, 0) < 0 && errno == ECHILD) {
+		/* The other waiter got there first; that's right. */
+		nechild++;
+		return 0;
+	}
+	errx(1, "waitpid came back");
+}
+
+/*
+ * The process under test: start the sleepers, give them time to get
+ * to sleep, and leave.
+ */
+static
+void
+victim(void)
+{
+	int i;
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+
+	slowkid = fork();
+	if (slowkid < 0) {
+		err(1, "fork");
+	}
+	if (slowkid == 0) {
+		nap(5, 0);
+		_exit(0);
+	}
+
+	if (thread_create(piper, NULL, stacks[0], STACKSIZE) < 0 ||
+	    thread_create(sleeper, NULL, stacks[1], STACKSIZE) < 0 ||
+	    thread_create(waiter, NULL, stacks[2], STACKSIZE) < 0 ||
+	    thread_create(waiter, NULL, stacks[3], STACKSIZE) < 0) {
+		err(1, "thread_create");
+	}
+
+	for (i=0; i<100 && nwaiting < 2; i++) {
+		nap(0, 10000000);
+	}
+	nap(0, 200000000);
+	if (nechild != 1) {
+		errx(1, "%d of 2 waiters for one child got ECHILD", nechild);
+	}
+
+	_exit(EXITCODE);
+}
+
+int
+main(void)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		victim();
+	}
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXITCODE) {
+		errx(1, "Victim exited with status 0x%x, expected exit %d",
+		     status, EXITCODE);
+	}
+
+	printf("Passed threadexit.\n");
+	return 0;
+}
@@ -29,54 +29,62 @@
 
 /*
  * Test multiple user level threads inside a process. The program
- * forks 3 threads off 2 to functions, each of which displays a string
- * every once in a while.
+ * starts 3 threads off 2 to functions, each of which displays a string
+ * every once in a while, and then joins them all.
  *
- * This won't do much of anything unless you implement user-level
- * threads.
- *
- * It also makes various assumptions about the thread API. In
- * particular, it believes (1) that you create a thread by calling
- * "threadfork()" and passing the address for execution of the new
- * thread to begin at, (2) that if the parent thread exits any child
- * threads will keep running, and (3) child threads will exit if they
- * return from the function they started in. If any or all of these
- * assumptions are not met by your user-level threads, you will need
- * to patch this test accordingly.
+ * Threads are made with thread_create(), on stacks the program
+ * provides, and exit by returning from the function they started in.
+ * The return value comes back from thread_join().
  *
  * This is also a rather basic test and you'll probably want to write
  * some more of your own.
  */
 
 
+#include <stdint.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <err.h>
 
 #define NTHREADS  3
 #define MAX       1<<25
+#define STACKSIZE 16384
 
 /* counter for the loop in the threads:
    This variable is shared and incremented by each
    thread during his computation */
 volatile int count = 0;
 
+static char stacks[NTHREADS][STACKSIZE];
+
 /* the 2 threads : */
-void ThreadRunner(void);
-void BladeRunner(void);
+int ThreadRunner(void *);
+int BladeRunner(void *);
 
 int
 main(int argc, char *argv[])
 {
-    int i;
+    int i, code;
+    int tids[NTHREADS];
 
     (void)argc;
     (void)argv;
 
     for (i=0; i<NTHREADS; i++) {
-	if (i)
-	    threadfork(ThreadRunner);
-        else
-	    threadfork(BladeRunner);
+	tids[i] = thread_create(i ? ThreadRunner : BladeRunner,
+				(void *)(intptr_t)i, stacks[i], STACKSIZE);
+	if (tids[i] < 0) {
+	    err(1, "thread_create");
+	}
+    }
+
+    for (i=0; i<NTHREADS; i++) {
+	if (thread_join(tids[i], &code) < 0) {
+	    err(1, "thread_join");
+	}
+	if (code != i) {
+	    errx(1, "thread %d exited with %d", tids[i], code);
+	}
     }
 
     tprintf("Parent has left.\n");
@@ -88,22 +96,24 @@ main(int argc, char *argv[])
    random results.
 */
 
-void
-BladeRunner()
+int
+BladeRunner(void *arg)
 {
     while (count < MAX) {
 	if (count % 500 == 0)
 	    tprintf("Blade ");
 	count++;
     }
+    return (intptr_t)arg;
 }
 
-void
-ThreadRunner()
+int
+ThreadRunner(void *arg)
 {
     while (count < MAX) {
 	if (count % 513 == 0)
 	    tprintf(" Runner\n");
 	count++;
     }
+    return (intptr_t)arg;
 }